@@ -0,0 +1,382 @@
+#include "assembler.hpp"
+#include "../exec/instruction.hpp"
+#include "../log/log.hpp"
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+using rvm::exec::DataType;
+using rvm::exec::InstructionUnit;
+using rvm::exec::OpCode;
+using rvm::exec::VMValue;
+using rvm::loading::GlobalDataUnit;
+namespace asmb = rvm::assembler;
+using namespace std::literals;
+
+namespace {
+    // Source of one unit, the lines between its header and its closing brace.
+    struct Block {
+        bool function;
+        std::string_view name;
+        std::string_view body;
+        // Line of the header.
+        size_t line;
+    };
+
+    struct Position {
+        const std::string& file;
+        size_t line;
+    };
+
+    // Units are assembled on worker threads, so errors are collected and reported afterwards.
+    struct AssemblyError {
+        std::string message;
+    };
+
+    [[noreturn]] void Fail(const Position& at, const std::string& reason) {
+        throw AssemblyError {"Assembly error in \""s + at.file + "\" at line " + std::to_string(at.line) + ": " + reason + "."};
+    }
+
+    // Runs `assemble` for every index below `count` and reports the error of the lowest index, if any.
+    void AssembleAll(size_t count, const std::function<void(size_t)>& assemble) {
+        std::vector<std::string> errors(count);
+        rvm::loading::ParallelFor(count, [&] (size_t i) {
+            try {
+                assemble(i);
+            }
+            catch (AssemblyError& error) {
+                errors[i] = std::move(error.message);
+            }
+        });
+        for (auto& error : errors) {
+            if (!error.empty()) rvm::log::LogError(error);
+        }
+    }
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    // Splits a line into tokens, keeping strings with their spaces and stopping at comments.
+    void Tokenize(std::string_view line, std::vector<std::string_view>& tokens, const Position& at) {
+        tokens.clear();
+        size_t i = 0;
+        while (true) {
+            while (i < line.size() && IsSpace(line[i])) i++;
+            if (i == line.size() || line.substr(i).starts_with("//")) return;
+
+            auto start = i;
+            if (line.substr(i).starts_with("$\"")) {
+                for (i += 2; i < line.size() && line[i] != '"'; i++) {
+                    if (line[i] == '\\') i++;
+                }
+                if (i >= line.size()) Fail(at, "unterminated string");
+                i++;
+            }
+            else {
+                while (i < line.size() && !IsSpace(line[i])) i++;
+            }
+            tokens.push_back(line.substr(start, i - start));
+        }
+    }
+
+    // Reads the next line of `text` from `offset` on.
+    std::string_view NextLine(std::string_view text, size_t& offset) {
+        auto end = text.find('\n', offset);
+        if (end == std::string_view::npos) end = text.size();
+        auto line = text.substr(offset, end - offset);
+        offset = end + 1;
+        return line;
+    }
+
+    std::vector<Block> SplitUnits(std::string_view source, const std::string& file) {
+        std::vector<Block> blocks;
+        std::vector<std::string_view> tokens;
+        size_t offset = 0;
+        size_t line = 0;
+        while (offset < source.size()) {
+            line++;
+            Position at {file, line};
+            Tokenize(NextLine(source, offset), tokens, at);
+            if (tokens.empty()) continue;
+
+            auto name = tokens.size() > 1 ? tokens[1] : ""sv;
+            bool braced = tokens.size() == 3 && tokens[2] == "{";
+            if (tokens.size() == 2 && name.size() > 1 && name.ends_with('{')) {
+                name.remove_suffix(1);
+                braced = true;
+            }
+            if ((tokens[0] != "function" && tokens[0] != "global") || !braced) Fail(at, "expected \"function <name> {\" or \"global <name> {\"");
+
+            Block block {tokens[0] == "function", name, {}, line};
+            auto begin = offset;
+            while (true) {
+                if (offset >= source.size()) Fail(at, "unit \""s + std::string(name) + "\" is not closed");
+                auto end = offset;
+                line++;
+                auto text = NextLine(source, offset);
+                while (!text.empty() && IsSpace(text.back())) text.remove_suffix(1);
+                while (!text.empty() && IsSpace(text.front())) text.remove_prefix(1);
+                if (text == "}") {
+                    block.body = source.substr(begin, end - begin);
+                    break;
+                }
+            }
+            blocks.push_back(block);
+        }
+        return blocks;
+    }
+
+    const std::unordered_map<std::string_view, OpCode>& Mnemonics() {
+        static const auto mnemonics = [] {
+            std::unordered_map<std::string_view, OpCode> out;
+            for (size_t op = 0; op < rvm::exec::OpCodeCount; op++) out.emplace(rvm::exec::OpCodeName(OpCode(op)), OpCode(op));
+            return out;
+        }();
+        return mnemonics;
+    }
+
+    bool ParseType(std::string_view name, DataType& type) {
+        static const std::unordered_map<std::string_view, DataType> types = {
+            {"none", DataType::NONE}, {"i8", DataType::I8}, {"i16", DataType::I16}, {"i32", DataType::I32}, {"i64", DataType::I64},
+            {"f32", DataType::F32}, {"f64", DataType::F64}, {"ptr", DataType::PTR}
+        };
+        auto found = types.find(name);
+        if (found == types.end()) return false;
+        type = found->second;
+        return true;
+    }
+
+    // Integers are decimal or 0x hexadecimal. A type of `bits` bits takes both signed and
+    // unsigned values, and keeps their low bits.
+    bool ParseInteger(std::string_view text, int bits, int64_t& value) {
+        bool negative = text.starts_with('-');
+        if (negative) text.remove_prefix(1);
+        int base = 10;
+        if (text.starts_with("0x") || text.starts_with("0X")) {
+            base = 16;
+            text.remove_prefix(2);
+        }
+
+        uint64_t magnitude = 0;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), magnitude, base);
+        if (text.empty() || error != std::errc() || end != text.data() + text.size()) return false;
+        if (negative ? magnitude > uint64_t(1) << (bits - 1) : bits < 64 && magnitude >> bits != 0) return false;
+        value = int64_t(negative ? 0 - magnitude : magnitude);
+        return true;
+    }
+
+    bool ParseConstant(std::string_view type, std::string_view text, VMValue& value) {
+        DataType parsed;
+        if (!type.starts_with('!') || !ParseType(type.substr(1), parsed) || parsed == DataType::NONE) return false;
+
+        if (parsed == DataType::F32 || parsed == DataType::F64) {
+            double number = 0;
+            auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+            if (text.empty() || error != std::errc() || end != text.data() + text.size()) return false;
+            value = parsed == DataType::F32 ? VMValue(float(number)) : VMValue(number);
+            return true;
+        }
+
+        int64_t number = 0;
+        switch (parsed) {
+            case DataType::I8:
+                if (!ParseInteger(text, 8, number)) return false;
+                value = VMValue(int8_t(number));
+                return true;
+            case DataType::I16:
+                if (!ParseInteger(text, 16, number)) return false;
+                value = VMValue(int16_t(number));
+                return true;
+            case DataType::I32:
+                if (!ParseInteger(text, 32, number)) return false;
+                value = VMValue(int32_t(number));
+                return true;
+            default:
+                if (!ParseInteger(text, 64, number)) return false;
+                value = VMValue(number);
+                return true;
+        }
+    }
+
+    int HexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Appends a $"..." token as a string of whole units, zero terminated and padded.
+    void AppendString(std::string_view token, std::vector<InstructionUnit>& out, std::string& text, const Position& at) {
+        text.clear();
+        for (size_t i = 2; i + 1 < token.size(); i++) {
+            if (token[i] != '\\') {
+                text += token[i];
+                continue;
+            }
+
+            switch (token[++i]) {
+                case 'n': text += '\n'; break;
+                case 't': text += '\t'; break;
+                case 'r': text += '\r'; break;
+                case '0': text += '\0'; break;
+                case '\\': text += '\\'; break;
+                case '"': text += '"'; break;
+                case '\'': text += '\''; break;
+                case 'x': {
+                    auto high = i + 2 < token.size() ? HexDigit(token[i + 1]) : -1;
+                    auto low = i + 2 < token.size() ? HexDigit(token[i + 2]) : -1;
+                    if (high < 0 || low < 0) Fail(at, "bad \\x escape");
+                    text += char(high * 16 + low);
+                    i += 2;
+                    break;
+                }
+                default:
+                    Fail(at, "unknown escape \\"s + token[i]);
+            }
+        }
+
+        auto begin = out.size();
+        out.resize(begin + text.size() / sizeof(InstructionUnit) + 1);
+        std::memcpy((void*) &out[begin], text.data(), text.size());
+    }
+
+    // Reads `!type value` or a $"..." string at `tokens[t]`, and moves past it.
+    bool AppendData(const std::vector<std::string_view>& tokens, size_t& t, std::vector<InstructionUnit>& out, std::string& text, const Position& at) {
+        if (tokens[t].starts_with("$\"")) {
+            AppendString(tokens[t++], out, text, at);
+            return true;
+        }
+        if (!tokens[t].starts_with('!')) return false;
+
+        VMValue value;
+        if (t + 1 == tokens.size()) Fail(at, "missing value after \""s + std::string(tokens[t]) + "\"");
+        if (!ParseConstant(tokens[t], tokens[t + 1], value)) {
+            Fail(at, "bad constant \""s + std::string(tokens[t]) + " " + std::string(tokens[t + 1]) + "\"");
+        }
+        out.emplace_back(value);
+        t += 2;
+        return true;
+    }
+
+    GlobalDataUnit AssembleUnit(const Block& block, const std::string& file) {
+        struct LabelUse {
+            size_t index;
+            std::string_view label;
+            size_t line;
+        };
+
+        GlobalDataUnit unit;
+        unit.name = block.name;
+        auto& out = unit.dataVector;
+        std::unordered_map<std::string_view, size_t> labels;
+        std::vector<LabelUse> uses;
+        std::vector<std::string_view> tokens;
+        std::string text;
+
+        size_t offset = 0;
+        size_t line = block.line;
+        while (offset < block.body.size()) {
+            line++;
+            Position at {file, line};
+            Tokenize(NextLine(block.body, offset), tokens, at);
+            if (tokens.empty()) continue;
+
+            if (!block.function) {
+                for (size_t t = 0; t < tokens.size();) {
+                    if (!AppendData(tokens, t, out, text, at)) Fail(at, "expected a constant or a string, found \""s + std::string(tokens[t]) + "\"");
+                }
+                continue;
+            }
+
+            if (tokens[0] == "label") {
+                if (tokens.size() != 2) Fail(at, "expected \"label <name>\"");
+                if (!labels.emplace(tokens[1], out.size()).second) Fail(at, "label \""s + std::string(tokens[1]) + "\" defined twice");
+                continue;
+            }
+
+            auto mnemonic = Mnemonics().find(tokens[0]);
+            if (mnemonic == Mnemonics().end()) Fail(at, "unknown instruction \""s + std::string(tokens[0]) + "\"");
+            auto op = mnemonic->second;
+            auto index = out.size();
+            out.emplace_back();
+            out[index].ins.code = op;
+
+            size_t types = 0;
+            size_t data = 0;
+            for (size_t t = 1; t < tokens.size();) {
+                auto token = tokens[t];
+                if (AppendData(tokens, t, out, text, at)) {
+                    data++;
+                    continue;
+                }
+
+                t++;
+                if (token.starts_with('@')) {
+                    if (types == 3) Fail(at, "more than 3 type parameters");
+                    if (!ParseType(token.substr(1), out[index].ins.optype[types])) Fail(at, "bad type parameter \""s + std::string(token) + "\"");
+                    types++;
+                }
+                else if (token.starts_with('[') && token.ends_with(']')) {
+                    auto value = token.substr(1, token.size() - 2);
+                    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), out[index].ins.data);
+                    if (value.empty() || error != std::errc() || end != value.data() + value.size()) Fail(at, "bad integer \""s + std::string(token) + "\"");
+                }
+                else if (op == OpCode::JMP || op == OpCode::JMPIF) uses.push_back({index, token, line});
+                else Fail(at, "unexpected \""s + std::string(token) + "\"");
+            }
+
+            bool takesData = op == OpCode::LOADCONST || op == OpCode::STORECONST || op == OpCode::CALL || op == OpCode::GETGLOBAL;
+            if (data != (takesData ? 1 : 0)) Fail(at, "\""s + std::string(tokens[0]) + (takesData ? "\" takes one constant or string" : "\" takes no constants or strings"));
+        }
+
+        // Jump offsets count units from the jump itself.
+        for (auto& use : uses) {
+            auto label = labels.find(use.label);
+            if (label == labels.end()) Fail({file, use.line}, "undefined label \""s + std::string(use.label) + "\"");
+            out[use.index].ins.data = int32_t(int64_t(label->second) - int64_t(use.index));
+        }
+        return unit;
+    }
+}
+
+std::vector<GlobalDataUnit> asmb::Assemble(std::string_view source, const std::string& file) {
+    std::vector<Block> blocks;
+    try {
+        blocks = SplitUnits(source, file);
+    }
+    catch (AssemblyError& error) {
+        rvm::log::LogError(error.message);
+    }
+
+    std::vector<GlobalDataUnit> out(blocks.size());
+    AssembleAll(blocks.size(), [&] (size_t b) {
+        out[b] = AssembleUnit(blocks[b], file);
+    });
+    return out;
+}
+
+std::vector<GlobalDataUnit> asmb::AssembleFiles(const std::vector<std::string>& paths) {
+    rvm::log::LogInfo("Assembling "s + std::to_string(paths.size()) + " files.");
+    std::vector<std::string> sources(paths.size());
+    std::vector<std::vector<Block>> blocks(paths.size());
+    AssembleAll(paths.size(), [&] (size_t f) {
+        if (!rvm::loading::ReadFile(paths[f], sources[f])) throw AssemblyError {"Could not open input file \""s + paths[f] + "\"."};
+        blocks[f] = SplitUnits(sources[f], paths[f]);
+    });
+
+    std::vector<std::vector<GlobalDataUnit>> files(paths.size());
+    std::vector<std::pair<size_t, size_t>> units;
+    for (size_t f = 0; f < paths.size(); f++) {
+        files[f].resize(blocks[f].size());
+        for (size_t b = 0; b < blocks[f].size(); b++) units.push_back({f, b});
+    }
+
+    AssembleAll(units.size(), [&] (size_t u) {
+        auto [f, b] = units[u];
+        files[f][b] = AssembleUnit(blocks[f][b], paths[f]);
+    });
+    rvm::log::LogInfo("Assembled "s + std::to_string(units.size()) + " units.");
+    return rvm::loading::MergeFiles(files, paths);
+}
\ No newline at end of file
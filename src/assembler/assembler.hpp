@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../loading/loading.hpp"
+
+namespace rvm::assembler {
+    // Assembles the units of one source file, see "Assembly" in the documentation. Errors name
+    // `file` and the line they are on, and end the program like other load errors.
+    std::vector<loading::GlobalDataUnit> Assemble(std::string_view source, const std::string& file = "<source>");
+    // Reads and assembles files, all their units concurrently. The units come in the order of
+    // the files, like with DeserializeFiles.
+    std::vector<loading::GlobalDataUnit> AssembleFiles(const std::vector<std::string>& paths);
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "channel.hpp"
+
+#include <algorithm>
+#include <bit>
+
+using rvm::exec::Channel;
+using rvm::exec::VMValue;
+
+namespace {
+    constexpr size_t SegmentSize = 1024;
+
+    enum SlotState : uint8_t {
+        EMPTY,
+        FULL,
+        TAKEN
+    };
+}
+
+struct Channel::Segment {
+    std::atomic<size_t> sendIndex = 0;
+    std::atomic<size_t> receiveIndex = 0;
+    std::atomic<Segment*> next = nullptr;
+    Segment* retiredNext = nullptr;
+    std::atomic<uint8_t> states[SegmentSize] = {};
+    VMValue values[SegmentSize];
+};
+
+Channel::Channel(size_t capacity) {
+    if (capacity == 0) {
+        auto* first = new Segment();
+        head.store(first);
+        tail.store(first);
+        return;
+    }
+
+    // With a single slot, a sent value could not be told apart from a free slot one lap later.
+    auto size = std::bit_ceil(std::max<size_t>(capacity, 2));
+    slots = std::make_unique<Slot[]>(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+Channel::~Channel() {
+    for (auto* segment = head.load(); segment;) {
+        auto* next = segment->next.load();
+        delete segment;
+        segment = next;
+    }
+    for (auto* segment = retired.load(); segment;) {
+        auto* next = segment->retiredNext;
+        delete segment;
+        segment = next;
+    }
+}
+
+bool Channel::TrySend(VMValue value) {
+    if (Closed()) return false;
+    return slots ? Push(value) : Append(value);
+}
+
+bool Channel::TryReceive(VMValue& value) {
+    return slots ? Pop(value) : Take(value);
+}
+
+// A slot of lap `n` at position `p` has sequence p when free for that lap, p + 1 once written.
+bool Channel::Push(VMValue value) {
+    auto position = sendPosition.load(std::memory_order_relaxed);
+    while (true) {
+        auto& slot = slots[position & mask];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        auto difference = intptr_t(sequence) - intptr_t(position);
+        if (difference == 0) {
+            if (sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                slot.value = value;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0) return false;
+        else position = sendPosition.load(std::memory_order_relaxed);
+    }
+}
+
+bool Channel::Pop(VMValue& value) {
+    auto position = receivePosition.load(std::memory_order_relaxed);
+    while (true) {
+        auto& slot = slots[position & mask];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        auto difference = intptr_t(sequence) - intptr_t(position + 1);
+        if (difference == 0) {
+            if (receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                value = slot.value;
+                slot.sequence.store(position + mask + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0) return false;
+        else position = receivePosition.load(std::memory_order_relaxed);
+    }
+}
+
+bool Channel::Append(VMValue value) {
+    Enter();
+    while (true) {
+        auto* last = tail.load();
+        auto index = last->sendIndex.fetch_add(1);
+        if (index < SegmentSize) {
+            last->values[index] = value;
+            uint8_t expected = EMPTY;
+            if (last->states[index].compare_exchange_strong(expected, FULL)) break;
+            // A receiver gave up on the slot before it was written.
+            continue;
+        }
+
+        if (last != tail.load()) continue;
+        auto* next = last->next.load();
+        if (!next) {
+            auto* added = new Segment();
+            added->values[0] = value;
+            added->states[0].store(FULL, std::memory_order_relaxed);
+            added->sendIndex.store(1, std::memory_order_relaxed);
+            if (last->next.compare_exchange_strong(next, added)) {
+                tail.compare_exchange_strong(last, added);
+                break;
+            }
+            delete added;
+        }
+        else tail.compare_exchange_strong(last, next);
+    }
+    Leave();
+    return true;
+}
+
+bool Channel::Take(VMValue& value) {
+    Enter();
+    bool found = false;
+    while (true) {
+        auto* first = head.load();
+        if (first->receiveIndex.load() >= first->sendIndex.load() && !first->next.load()) break;
+
+        auto index = first->receiveIndex.fetch_add(1);
+        if (index >= SegmentSize) {
+            auto* next = first->next.load();
+            if (!next) break;
+            // Senders must not find the drained segment as the tail once it is freed.
+            auto* last = first;
+            tail.compare_exchange_strong(last, next);
+            if (head.compare_exchange_strong(first, next)) Retire(first);
+            continue;
+        }
+
+        uint8_t expected = EMPTY;
+        if (first->states[index].compare_exchange_strong(expected, TAKEN)) continue;
+        value = first->values[index];
+        found = true;
+        break;
+    }
+    Leave();
+    return found;
+}
+
+void Channel::Enter() {
+    users.fetch_add(1);
+}
+
+// Segments retired before the last operation in progress started can not be in use once
+// it is done, so the one leaving last frees them.
+void Channel::Leave() {
+    auto* batch = retired.load() ? retired.exchange(nullptr) : nullptr;
+    if (users.fetch_sub(1) == 1) {
+        while (batch) {
+            auto* next = batch->retiredNext;
+            delete batch;
+            batch = next;
+        }
+        return;
+    }
+    while (batch) {
+        auto* next = batch->retiredNext;
+        Retire(batch);
+        batch = next;
+    }
+}
+
+void Channel::Retire(Segment* segment) {
+    segment->retiredNext = retired.load();
+    while (!retired.compare_exchange_weak(segment->retiredNext, segment)) { }
+}
\ No newline at end of file
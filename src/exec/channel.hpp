@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "instruction.hpp"
+#include "scheduler.hpp"
+
+namespace rvm::exec {
+    // Lock-free multi-producer multi-consumer queue of values, in the order they were sent.
+    //
+    // A bounded channel is one ring of slots, each with a sequence number saying whether it
+    // waits for a sender or a receiver of a given lap (Vyukov's bounded queue). Senders and
+    // receivers only race for their own end's position, and nothing is allocated after the
+    // channel is made.
+    //
+    // An unbounded channel is a list of segments whose slots are each written once: senders
+    // and receivers take slot indices with a fetch-add, and a receiver that gets to a slot
+    // first marks it taken, making its sender retry further on. A new segment is only added
+    // once the last is full. Drained segments are freed when no operation is in progress.
+    class Channel {
+    public:
+        // Holds up to `capacity` values, rounded up to a power of two of at least 2, or any number if 0.
+        explicit Channel(size_t capacity);
+        ~Channel();
+        Channel(const Channel&) = delete;
+        Channel& operator=(const Channel&) = delete;
+
+        // Both return false instead of waiting, TrySend when the channel is full or closed and
+        // TryReceive when it is empty.
+        bool TrySend(VMValue value);
+        bool TryReceive(VMValue& value);
+
+        // Stops further sends. Values sent before can still be received.
+        void Close() { closed.store(true, std::memory_order_release); }
+        bool Closed() const { return closed.load(std::memory_order_acquire); }
+
+        // Fibers waiting to send or receive, woken by the built-in functions after every send,
+        // receive and close.
+        WaitQueue waiters;
+
+    private:
+        struct Slot {
+            std::atomic<size_t> sequence;
+            VMValue value;
+        };
+
+        struct Segment;
+
+        bool Push(VMValue value);
+        bool Pop(VMValue& value);
+        bool Append(VMValue value);
+        bool Take(VMValue& value);
+        void Enter();
+        void Leave();
+        void Retire(Segment* segment);
+
+        // Bounded ring, with its ends on separate cache lines.
+        std::unique_ptr<Slot[]> slots;
+        size_t mask = 0;
+        alignas(64) std::atomic<size_t> sendPosition = 0;
+        alignas(64) std::atomic<size_t> receivePosition = 0;
+
+        // Unbounded list, operations in progress on it and segments waiting to be freed.
+        alignas(64) std::atomic<Segment*> head = nullptr;
+        alignas(64) std::atomic<Segment*> tail = nullptr;
+        alignas(64) std::atomic<size_t> users = 0;
+        std::atomic<Segment*> retired = nullptr;
+
+        std::atomic<bool> closed = false;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+
+#include "instruction.hpp"
+
+#if defined(__GNUC__) && !defined(RVM_NO_COMPUTED_GOTO)
+#define RVM_COMPUTED_GOTO 1
+#else
+#define RVM_COMPUTED_GOTO 0
+#endif
+
+namespace rvm::exec {
+    // Opcodes of the pre-decoded stream. The first entries mirror OpCode one to one.
+    #define RVM_DECODED_OPS(X) \
+        X(NOP) X(HALT) \
+        X(LOAD) X(STORE) X(LOADCONST) X(STORECONST) \
+        X(CONVERT) X(ADD) X(SUB) X(MUL) X(DIV) \
+        X(LAND) X(LOR) X(LNOT) \
+        X(GT) X(GEQ) X(LT) X(LEQ) X(EQ) X(NOTEQ) \
+        X(BAND) X(BOR) X(BXOR) X(BNOT) X(LSHIFT) X(RSHIFT) \
+        X(JMP) X(JMPIF) \
+        X(CREATELOCALS) X(CALL) X(RET) \
+        X(CALLINDIRECT) X(GETGLOBAL) \
+        X(SPAWN) X(YIELD) X(JOIN) \
+        X(ATOMICLOAD) X(ATOMICSTORE) X(ATOMICADD) X(ATOMICCAS) X(FENCE) \
+        X(UNKNOWN) X(CONVERT_DROP) \
+        X(CALL_DIRECT) X(CALL_BUILTIN) X(TAILCALL_DIRECT) \
+        X(LOAD_LOAD) X(LOAD_LOADCONST) X(STORE_LOAD) \
+        X(R_MOV) X(R_CONST) X(R_JMPIF) X(R_LNOT) X(R_BNOT) \
+        X(JIT_ENTER) X(JMP_COUNTED) X(JMPIF_COUNTED) X(LOAD_UNIT)
+
+    // Quickened forms of the type parameterized opcodes, X(op, TYPE, ctype) names op_TYPE.
+    #define RVM_NUMERIC_TYPES(X, op) \
+        X(op, I8, int8_t) X(op, I16, int16_t) X(op, I32, int32_t) X(op, I64, int64_t) \
+        X(op, F32, float) X(op, F64, double)
+
+    #define RVM_COMPARED_TYPES(X, op) RVM_NUMERIC_TYPES(X, op) X(op, PTR, void*)
+
+    #define RVM_QUICKENED_OPS(X) \
+        RVM_NUMERIC_TYPES(X, ADD) RVM_NUMERIC_TYPES(X, SUB) \
+        RVM_NUMERIC_TYPES(X, MUL) RVM_NUMERIC_TYPES(X, DIV) \
+        RVM_COMPARED_TYPES(X, GT) RVM_COMPARED_TYPES(X, GEQ) \
+        RVM_COMPARED_TYPES(X, LT) RVM_COMPARED_TYPES(X, LEQ) \
+        RVM_COMPARED_TYPES(X, EQ) RVM_COMPARED_TYPES(X, NOTEQ)
+
+    // Quickened conversions, X(FROM, fromtype, TO, totype) names CONVERT_FROM_TO.
+    #define RVM_CONVERSIONS_FROM(X, F, ftype) \
+        X(F, ftype, I8, int8_t) X(F, ftype, I16, int16_t) X(F, ftype, I32, int32_t) \
+        X(F, ftype, I64, int64_t) X(F, ftype, F32, float) X(F, ftype, F64, double)
+
+    #define RVM_QUICKENED_CONVERSIONS(X) \
+        RVM_CONVERSIONS_FROM(X, I8, int8_t) RVM_CONVERSIONS_FROM(X, I16, int16_t) \
+        RVM_CONVERSIONS_FROM(X, I32, int32_t) RVM_CONVERSIONS_FROM(X, I64, int64_t) \
+        RVM_CONVERSIONS_FROM(X, F32, float) RVM_CONVERSIONS_FROM(X, F64, double)
+
+    // Superinstructions over I64 operations, X(kind, op) names kind_op_I64. See vmfuse.cpp.
+    // The BR, R and RI kinds are register forms, see vmregister.cpp.
+    #define RVM_FUSED_COMPARISONS(X, kind) \
+        X(kind, GT) X(kind, GEQ) X(kind, LT) X(kind, LEQ) X(kind, EQ) X(kind, NOTEQ)
+
+    #define RVM_REGISTER_UNTYPED(X, kind) \
+        X(kind, LAND) X(kind, LOR) \
+        X(kind, BAND) X(kind, BOR) X(kind, BXOR) X(kind, LSHIFT) X(kind, RSHIFT)
+
+    #define RVM_FUSED_OPS(X) \
+        RVM_FUSED_COMPARISONS(X, JMPIF) \
+        RVM_FUSED_COMPARISONS(X, LOCAL_CONST) \
+        RVM_FUSED_COMPARISONS(X, JMPIF_LOCAL_CONST) \
+        X(LOCAL_CONST, ADD) X(LOCAL_CONST, SUB) X(LOCAL_CONST, MUL) \
+        X(STORE_LOCAL_CONST, ADD) X(STORE_LOCAL_CONST, SUB) \
+        RVM_FUSED_COMPARISONS(X, BR) RVM_FUSED_COMPARISONS(X, BRI) \
+        RVM_REGISTER_UNTYPED(X, R) RVM_REGISTER_UNTYPED(X, RI)
+
+    // Expands X(name) for every decoded opcode, in enum order. X_REGISTER(op, T, ctype)
+    // names both R_op_T (register operands) and RI_op_T (immediate right operand).
+    #define RVM_ALL_DECODED_OPS(X) \
+        RVM_DECODED_OPS(X) \
+        RVM_QUICKENED_OPS(X##_TYPED) \
+        RVM_QUICKENED_CONVERSIONS(X##_CONVERSION) \
+        RVM_FUSED_OPS(X##_FUSED) \
+        RVM_QUICKENED_OPS(X##_REGISTER) \
+        RVM_QUICKENED_CONVERSIONS(X##_REGISTER_CONVERSION)
+
+    enum class DecodedOp : uint16_t {
+        #define RVM_DECODED_ENUM(name) name,
+        #define RVM_DECODED_ENUM_TYPED(op, T, ctype) op##_##T,
+        #define RVM_DECODED_ENUM_CONVERSION(F, ftype, T, ttype) CONVERT_##F##_##T,
+        #define RVM_DECODED_ENUM_FUSED(kind, op) kind##_##op##_I64,
+        #define RVM_DECODED_ENUM_REGISTER(op, T, ctype) R_##op##_##T, RI_##op##_##T,
+        #define RVM_DECODED_ENUM_REGISTER_CONVERSION(F, ftype, T, ttype) R_CONVERT_##F##_##T,
+        RVM_ALL_DECODED_OPS(RVM_DECODED_ENUM)
+        #undef RVM_DECODED_ENUM
+        #undef RVM_DECODED_ENUM_TYPED
+        #undef RVM_DECODED_ENUM_CONVERSION
+        #undef RVM_DECODED_ENUM_FUSED
+        #undef RVM_DECODED_ENUM_REGISTER
+        #undef RVM_DECODED_ENUM_REGISTER_CONVERSION
+        COUNT
+    };
+
+    struct ThreadedRegs;
+    template <bool Checked>
+    struct ThreadedOps;
+
+#if !RVM_COMPUTED_GOTO
+    using ThreadedFunction = void (*)(ThreadedRegs&);
+#endif
+
+    // Handler of a decoded instruction, relative to the checked UNKNOWN handler: the distance
+    // between their labels with computed goto, else between their ThreadedFunction table
+    // entries. A zeroed entry fails as an unknown instruction.
+    using ThreadedHandler = int32_t;
+
+    // One entry per instruction unit, so indices match the raw instruction stream.
+    // Units holding inline data are decoded as UNKNOWN. A fused instruction covers the
+    // whole sequence it replaces; the instructions after its head stay decoded as they were.
+    // Entries are kept at 32 bytes, two to a cache line, since the stream is as long as the
+    // code it was decoded from.
+    struct DecodedInstruction {
+        ThreadedHandler handler = 0;
+        DecodedOp op = DecodedOp::UNKNOWN;
+        DataType optype[2] = {DataType::NONE, DataType::NONE};
+        int32_t data = 0;
+        uint32_t length = 1;
+        // Stack slots needed by a verified callee for calls, second local index or branch
+        // offset for fused instructions.
+        int32_t aux = 0;
+
+        // Register forms address frame slots relative to the locals base: `data` is the
+        // destination (branch offset for branches), `aux` and `extra` the operands, and `sp`
+        // the stack height left once the instruction is done. They always fall through to the
+        // next entry. Only forms without an immediate `operand` use `extra`.
+        int32_t sp = 0;
+        union {
+            VMValue operand = VMValue();
+            int32_t extra;
+        };
+    };
+
+    static_assert(sizeof(DecodedInstruction) == 32);
+
+    // Entry into code compiled by the JIT, called with the frame pointer. Runs until an
+    // instruction it leaves to the interpreter and returns the index of that instruction,
+    // whose `sp` holds the stack height there. JIT_ENTER instructions hold one in `operand`.
+    using NativeCode = size_t (*)(VMValue* fp);
+
+    // Handlers of verified functions skip the per instruction stack and local bounds checks.
+    ThreadedHandler GetThreadedHandler(DecodedOp op, bool checked = true);
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <new>
+
+using rvm::exec::SharedHeap;
+
+SharedHeap::SharedHeap(size_t size) : size(size) {
+    // Large zeroed allocations are mapped on demand instead of being cleared here.
+    memory.reset((std::byte*) std::calloc(std::max<size_t>(size, 1), 1));
+    if (!memory) throw std::bad_alloc();
+}
+
+void* SharedHeap::Allocate(size_t bytes) {
+    if (bytes > size) return nullptr;
+    bytes = (std::max<size_t>(bytes, 1) + Alignment - 1) / Alignment * Alignment;
+
+    auto offset = used.load(std::memory_order_relaxed);
+    do {
+        if (bytes > size - offset) return nullptr;
+    } while (!used.compare_exchange_weak(offset, offset + bytes, std::memory_order_relaxed));
+    return memory.get() + offset;
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+
+namespace rvm::exec {
+    // Memory shared by every context running a VM, the only memory the atomic instructions
+    // access. It is handed out from one zeroed region, front to back, and only released with
+    // the heap; the region is reserved up front but, on most systems, pages only take up
+    // memory once they are touched.
+    class SharedHeap {
+    public:
+        // Everything allocated is aligned to at least this, the widest atomic access.
+        static constexpr size_t Alignment = 8;
+
+        explicit SharedHeap(size_t size);
+
+        // Zeroed block of `bytes`, or nullptr once the heap is used up. Safe to call from
+        // any number of threads.
+        void* Allocate(size_t bytes);
+        bool Contains(const void* address, size_t bytes) const {
+            auto* begin = (const std::byte*) address;
+            return begin >= memory.get() && bytes <= size && begin <= memory.get() + size - bytes;
+        }
+
+    private:
+        struct Free {
+            void operator()(std::byte* memory) const { std::free(memory); }
+        };
+
+        std::unique_ptr<std::byte, Free> memory;
+        size_t size = 0;
+        std::atomic<size_t> used = 0;
+    };
+}
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "instruction.hpp"
+#include <cstring>
 #include <string>
 
 using namespace rvm::exec;
@@ -26,4 +27,50 @@ std::vector<InstructionUnit> InstructionUnit::CreateInstructionDataStream(const
     if (relpos != 0) out.emplace_back(data);
 
     return out;
+}
+
+// Number of units taken by the instruction at `index` including its inline data,
+// or 0 if it is not a valid instruction.
+size_t InstructionUnit::InstructionLength(std::span<const InstructionUnit> code, size_t index) {
+    if (index >= code.size()) return 0;
+
+    switch (code[index].ins.code) {
+        case OpCode::LOADCONST:
+        case OpCode::STORECONST:
+            return index + 1 < code.size() ? 2 : 0;
+        case OpCode::CALL:
+        case OpCode::GETGLOBAL:
+            for (size_t i = index + 1; i < code.size(); i++) {
+                if (std::memchr(code[i].data.str, '\0', sizeof(Word))) return i - index + 1;
+            }
+            return 0;
+        default:
+            return size_t(code[index].ins.code) < OpCodeCount ? 1 : 0;
+    }
+}
+
+const char* rvm::exec::OpCodeName(OpCode code) {
+    static const char* names[] = {
+        "nop", "halt",
+        "load", "store", "loadconst", "storeconst",
+        "convert", "add", "sub", "mul", "div",
+        "land", "lor", "lnot",
+        "gt", "geq", "lt", "leq", "eq", "noteq",
+        "band", "bor", "bxor", "bnot", "lshift", "rshift",
+        "jmp", "jmpif",
+        "createlocals", "call", "ret",
+        "callindirect", "getglobal",
+        "spawn", "yield", "join",
+        "atomicload", "atomicstore", "atomicadd", "atomiccas", "fence"
+    };
+    return size_t(code) < OpCodeCount ? names[size_t(code)] : "unknown";
+}
+
+bool rvm::exec::AllowsMemoryOrder(OpCode code, int32_t order) {
+    if (order < 0 || order > int32_t(MemoryOrder::ACQ_REL)) return false;
+    auto acquires = MemoryOrder(order) == MemoryOrder::ACQUIRE || MemoryOrder(order) == MemoryOrder::ACQ_REL;
+    auto releases = MemoryOrder(order) == MemoryOrder::RELEASE || MemoryOrder(order) == MemoryOrder::ACQ_REL;
+    if (code == OpCode::ATOMICLOAD) return !releases;
+    if (code == OpCode::ATOMICSTORE) return !acquires;
+    return true;
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <span>
 #include <string_view>
+#include <type_traits>
 #include <vector>
 
 namespace rvm::exec {
@@ -48,9 +51,22 @@ namespace rvm::exec {
         RET,
 
         CALLINDIRECT,
-        GETGLOBAL
+        GETGLOBAL,
+
+        SPAWN,
+        YIELD,
+        JOIN,
+
+        ATOMICLOAD,
+        ATOMICSTORE,
+        ATOMICADD,
+        ATOMICCAS,
+        FENCE
     };
 
+    constexpr size_t OpCodeCount = size_t(OpCode::FENCE) + 1;
+    const char* OpCodeName(OpCode code);
+
     enum class DataType : uint8_t {
         NONE,
         I8,
@@ -63,6 +79,18 @@ namespace rvm::exec {
         PTR
     };
 
+    // Memory order of the atomic instructions, given as their `data`.
+    enum class MemoryOrder : int32_t {
+        SEQ_CST,
+        RELAXED,
+        ACQUIRE,
+        RELEASE,
+        ACQ_REL
+    };
+
+    // Loads can not release and stores can not acquire.
+    bool AllowsMemoryOrder(OpCode code, int32_t order);
+
     struct alignas(Word) InstructionHeader {
         OpCode code = OpCode::NOP;
         DataType optype[3] = {DataType::NONE};
@@ -87,6 +115,17 @@ namespace rvm::exec {
         explicit VMValue(float d) : VMValue() { f32 = d; }
         explicit VMValue(double d) : VMValue() { f64 = d; }
         explicit VMValue(void* d) : VMValue() { ptr = d; }
+
+        template <typename T>
+        T& As() {
+            if constexpr (std::is_same_v<T, int8_t>) return i8;
+            else if constexpr (std::is_same_v<T, int16_t>) return i16;
+            else if constexpr (std::is_same_v<T, int32_t>) return i32;
+            else if constexpr (std::is_same_v<T, int64_t>) return i64;
+            else if constexpr (std::is_same_v<T, float>) return f32;
+            else if constexpr (std::is_same_v<T, double>) return f64;
+            else return ptr;
+        }
     };
 
     union alignas(Word) InstructionUnit {
@@ -98,5 +137,6 @@ namespace rvm::exec {
         InstructionUnit(InstructionHeader header) : ins(header) { }
 
         static std::vector<InstructionUnit> CreateInstructionDataStream(const std::string_view& str);
+        static size_t InstructionLength(std::span<const InstructionUnit> code, size_t index);
     };
 }
\ No newline at end of file
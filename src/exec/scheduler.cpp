@@ -0,0 +1,243 @@
+#include "scheduler.hpp"
+#include "vmachine.hpp"
+#include "../log/log.hpp"
+
+#include <thread>
+
+using rvm::exec::Scheduler;
+using rvm::exec::Fiber;
+using rvm::exec::ExecutionContext;
+
+namespace {
+    // Queue Ready puts fibers in, the one of the thread running them.
+    thread_local size_t currentWorker = 0;
+
+    // Contexts of finished fibers kept for the next spawns, which saves mapping a stack.
+    constexpr size_t SpareContexts = 64;
+
+    // A handle is the slot of its fiber plus one, with the number of times the slot was used
+    // before above bit 32, so handles of joined fibers do not find the next one in the slot.
+    size_t Slot(int64_t handle) {
+        return size_t(handle & 0xFFFFFFFF) - 1;
+    }
+
+    int64_t NextHandle(int64_t handle) {
+        return (((handle >> 32) + 1) & 0x7FFFFFFF) << 32 | (handle & 0xFFFFFFFF);
+    }
+}
+
+Scheduler::Scheduler(VirtualMachine& vm, size_t threads, int64_t stackSize)
+    : vm(vm), stackSize(stackSize), workers(std::max<size_t>(threads, 1)) { }
+
+Scheduler::~Scheduler() = default;
+
+void Scheduler::Run(const std::string& entry) {
+    log::LogInfo("Running VM.");
+    currentWorker = 0;
+    Spawn(vm.EntryPoint(entry), {});
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers.size(); i++) {
+        threads.emplace_back([this, i] { Work(i); });
+    }
+    Work(0);
+    for (auto& thread : threads) thread.join();
+    if (stopping) log::LogError(failure);
+    log::LogInfo("Finished VM program.");
+}
+
+int64_t Scheduler::Spawn(size_t index, std::span<const VMValue> args) {
+    std::unique_ptr<ExecutionContext> context;
+    {
+        std::lock_guard lock(fibersMutex);
+        if (!spare.empty()) {
+            context = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    if (!context) context = std::make_unique<ExecutionContext>(vm, stackSize);
+    context->scheduler = this;
+    context->Enter(index, args);
+
+    Fiber* fiber;
+    {
+        std::lock_guard lock(fibersMutex);
+        if (freeSlots.empty()) {
+            fibers.push_back(std::make_unique<Fiber>());
+            fibers.back()->handle = int64_t(fibers.size());
+            freeSlots.push_back(fibers.size() - 1);
+        }
+        fiber = fibers[freeSlots.back()].get();
+        freeSlots.pop_back();
+    }
+    context->fiber = fiber;
+    fiber->context = std::move(context);
+
+    auto handle = fiber->handle.load();
+    live++;
+    Ready(*fiber);
+    return handle;
+}
+
+Fiber& Scheduler::Find(int64_t handle) {
+    std::lock_guard lock(fibersMutex);
+    if (handle < 1 || Slot(handle) >= fibers.size() || fibers[Slot(handle)]->handle != handle) {
+        throw VirtualMachineException("Invalid fiber handle.");
+    }
+    return *fibers[Slot(handle)];
+}
+
+bool Scheduler::Join(Fiber& fiber, int64_t handle, std::vector<VMValue>& results) {
+    {
+        std::lock_guard lock(fiber.mutex);
+        if (fiber.handle != handle) throw VirtualMachineException("Invalid fiber handle.");
+        if (!fiber.finished) return false;
+        results.swap(fiber.results);
+        fiber.results.clear();
+        fiber.finished = false;
+        fiber.handle = NextHandle(handle);
+    }
+    std::lock_guard lock(fibersMutex);
+    freeSlots.push_back(Slot(handle));
+    return true;
+}
+
+void Scheduler::Work(size_t worker) {
+    currentWorker = worker;
+    while (auto* fiber = Next(worker)) {
+        auto& context = *fiber->context;
+        if (!context.Resume()) {
+            if (context.joining) Block(*fiber, *context.joining, context.joiningHandle);
+            else if (context.waiting) Park(*fiber, *context.waiting, context.waitEpoch);
+            else Ready(*fiber);
+        }
+        else if (!context.error.empty()) Fail(context.error);
+        else Finish(*fiber);
+    }
+}
+
+Fiber* Scheduler::Next(size_t worker) {
+    while (!stopping) {
+        if (auto* fiber = Take(worker)) return fiber;
+
+        std::unique_lock lock(idleMutex);
+        // Only running fibers queue others, so with every thread here and nothing queued
+        // the remaining fibers all wait for each other, or on channels no fiber can change.
+        if (++sleeping == workers.size() && queued == 0 && live > 0 && !stopping) {
+            failure = "Fatal error reported: Every fiber is waiting for another one or on a channel.";
+            stopping = true;
+            idle.notify_all();
+        }
+        idle.wait(lock, [&] { return queued > 0 || live == 0 || stopping; });
+        sleeping--;
+        if (live == 0) return nullptr;
+    }
+    return nullptr;
+}
+
+// Takes the oldest fiber of the own queue, or else steals the newest one of another.
+Fiber* Scheduler::Take(size_t worker) {
+    for (size_t k = 0; k < workers.size(); k++) {
+        auto& from = workers[(worker + k) % workers.size()];
+        std::lock_guard lock(from.mutex);
+        if (from.queue.empty()) continue;
+
+        Fiber* fiber;
+        if (k == 0) {
+            fiber = from.queue.front();
+            from.queue.pop_front();
+        }
+        else {
+            fiber = from.queue.back();
+            from.queue.pop_back();
+        }
+        queued--;
+        return fiber;
+    }
+    return nullptr;
+}
+
+void Scheduler::Ready(Fiber& fiber) {
+    auto& worker = workers[currentWorker];
+    {
+        std::lock_guard lock(worker.mutex);
+        worker.queue.push_back(&fiber);
+    }
+    queued++;
+    if (sleeping > 0) {
+        std::lock_guard lock(idleMutex);
+        idle.notify_one();
+    }
+}
+
+// Once the joined fiber finished, or was joined by another and so got another handle, the join
+// runs again.
+void Scheduler::Block(Fiber& fiber, Fiber& joined, int64_t handle) {
+    {
+        std::lock_guard lock(joined.mutex);
+        if (joined.handle == handle && !joined.finished) {
+            joined.joiners.push_back(&fiber);
+            return;
+        }
+    }
+    Ready(fiber);
+}
+
+// Either the fiber is parked before the queue changes again, and the next Wake finds it, or
+// the change is seen here and it is readied right away.
+void Scheduler::Park(Fiber& fiber, WaitQueue& queue, uint64_t epoch) {
+    {
+        std::lock_guard lock(queue.mutex);
+        queue.count++;
+        if (queue.epoch == epoch) {
+            queue.parked.push_back(&fiber);
+            return;
+        }
+        queue.count--;
+    }
+    Ready(fiber);
+}
+
+void Scheduler::Wake(WaitQueue& queue) {
+    queue.epoch++;
+    if (queue.count == 0) return;
+
+    std::vector<Fiber*> parked;
+    {
+        std::lock_guard lock(queue.mutex);
+        parked.swap(queue.parked);
+        queue.count = 0;
+    }
+    for (auto* fiber : parked) Ready(*fiber);
+}
+
+// Once finished, the fiber may be joined and spawned again right away, so its context is
+// taken out before.
+void Scheduler::Finish(Fiber& fiber) {
+    auto context = std::move(fiber.context);
+    std::vector<Fiber*> joiners;
+    {
+        std::lock_guard lock(fiber.mutex);
+        fiber.results = context->Results();
+        fiber.finished = true;
+        joiners.swap(fiber.joiners);
+    }
+    for (auto* joiner : joiners) Ready(*joiner);
+
+    {
+        std::lock_guard lock(fibersMutex);
+        if (spare.size() < SpareContexts) spare.push_back(std::move(context));
+    }
+
+    if (--live == 0) {
+        std::lock_guard lock(idleMutex);
+        idle.notify_all();
+    }
+}
+
+void Scheduler::Fail(const std::string& error) {
+    std::lock_guard lock(idleMutex);
+    if (!stopping) failure = error;
+    stopping = true;
+    idle.notify_all();
+}
\ No newline at end of file
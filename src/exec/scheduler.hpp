@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "instruction.hpp"
+
+namespace rvm::exec {
+    class VirtualMachine;
+    class ExecutionContext;
+
+    // A function started by spawn, or the entry function, running in a context of its own.
+    // The context is released once the function returned, its results stay until the join.
+    // A joined fiber is used again by a later spawn, under another handle.
+    struct Fiber {
+        std::unique_ptr<ExecutionContext> context;
+        std::mutex mutex;
+        std::atomic<int64_t> handle = 0;
+        bool finished = false;
+        std::vector<VMValue> results;
+        // Fibers waiting in a join for this one to finish.
+        std::vector<Fiber*> joiners;
+    };
+
+    // Fibers parked until something they wait for may have changed, like a channel they could
+    // not send to or receive from. Every change bumps `epoch` and readies all of them to check
+    // again; a fiber that saw another epoch than the current one is not parked at all.
+    struct WaitQueue {
+        std::mutex mutex;
+        std::vector<Fiber*> parked;
+        std::atomic<size_t> count = 0;
+        std::atomic<uint64_t> epoch = 0;
+    };
+
+    // Runs fibers over a number of threads. Every thread runs the fibers in its own queue in
+    // order, and once that is empty takes the most recently queued fiber of another thread.
+    // Fibers switch only where they spawn, yield or join, and any thread may resume a fiber
+    // another one suspended, so the VM must not change while running on more than one thread,
+    // see VirtualMachine::Prepare.
+    class Scheduler {
+    public:
+        // `stackSize` values of stack for every fiber.
+        Scheduler(VirtualMachine& vm, size_t threads, int64_t stackSize);
+        ~Scheduler();
+
+        // Runs `entry` as the first fiber and returns once every fiber finished. If one fails,
+        // the threads stop once the fibers they run suspend, and the first error is reported.
+        void Run(const std::string& entry);
+
+        // Queues a fiber calling the function at code index `index` with `args`, in the order
+        // they were pushed, and returns its handle.
+        int64_t Spawn(size_t index, std::span<const VMValue> args);
+        // Fiber of a handle Spawn returned and not yet joined. Throws VirtualMachineException
+        // for other values.
+        Fiber& Find(int64_t handle);
+        // Takes the results of `fiber` if it finished, after which its handle is no longer
+        // valid. Returns false if it has not finished yet.
+        bool Join(Fiber& fiber, int64_t handle, std::vector<VMValue>& results);
+        // Readies every fiber parked on `queue`.
+        void Wake(WaitQueue& queue);
+
+    private:
+        struct Worker {
+            std::mutex mutex;
+            std::deque<Fiber*> queue;
+        };
+
+        void Work(size_t worker);
+        Fiber* Next(size_t worker);
+        Fiber* Take(size_t worker);
+        void Ready(Fiber& fiber);
+        void Block(Fiber& fiber, Fiber& joined, int64_t handle);
+        void Park(Fiber& fiber, WaitQueue& queue, uint64_t epoch);
+        void Finish(Fiber& fiber);
+        void Fail(const std::string& error);
+
+        VirtualMachine& vm;
+        int64_t stackSize;
+        std::vector<Worker> workers;
+
+        // Fibers by slot, slots of joined fibers and contexts of finished fibers kept for reuse.
+        std::mutex fibersMutex;
+        std::vector<std::unique_ptr<Fiber>> fibers;
+        std::vector<size_t> freeSlots;
+        std::vector<std::unique_ptr<ExecutionContext>> spare;
+
+        // Unfinished fibers, fibers in a queue and threads waiting for one.
+        std::atomic<size_t> live = 0;
+        std::atomic<size_t> queued = 0;
+        std::atomic<size_t> sleeping = 0;
+        std::mutex idleMutex;
+        std::condition_variable idle;
+
+        // First error a fiber failed with, after which no more fibers are run.
+        std::atomic<bool> stopping = false;
+        std::string failure;
+    };
+}
\ No newline at end of file
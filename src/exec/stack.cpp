@@ -0,0 +1,110 @@
+#include "stack.hpp"
+
+#include <mutex>
+#include <new>
+
+#if RVM_STACK_GUARD
+#include <csignal>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using rvm::exec::ValueStack;
+
+#if RVM_STACK_GUARD
+namespace {
+    struct ActiveGuard {
+        const char* begin;
+        const char* end;
+    };
+
+    // Guard page of the stack the current thread runs on, if any.
+    thread_local ActiveGuard* activeGuard = nullptr;
+    struct sigaction previousSegv;
+    struct sigaction previousBus;
+
+    // Only async-signal-safe calls here: the fault may have happened anywhere in the VM.
+    void OnFault(int signal, siginfo_t* info, void* context) {
+        auto* guard = activeGuard;
+        auto* address = (const char*) info->si_addr;
+        if (guard && address >= guard->begin && address < guard->end) {
+            constexpr char message[] = "Fatal error: the value stack overflowed past its bounds checks.\n";
+            auto written = write(STDERR_FILENO, message, sizeof(message) - 1);
+            (void) written;
+            std::abort();
+        }
+
+        // Not ours: hand the fault to whoever handled it before, or return with their action
+        // restored so the faulting access repeats under it.
+        auto& previous = signal == SIGSEGV ? previousSegv : previousBus;
+        if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction) previous.sa_sigaction(signal, info, context);
+        else if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) previous.sa_handler(signal);
+        else sigaction(signal, &previous, nullptr);
+    }
+
+    void InstallFaultHandler() {
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action = {};
+            action.sa_sigaction = OnFault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previousSegv);
+            sigaction(SIGBUS, &action, &previousBus);
+        });
+    }
+
+    size_t PageSize() {
+        static const auto size = size_t(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+}
+#endif
+
+ValueStack::ValueStack(size_t size) {
+#if RVM_STACK_GUARD
+    // The values end where the guard page starts, so the first value past the end faults.
+    auto page = PageSize();
+    auto bytes = (size * sizeof(VMValue) + page - 1) / page * page;
+    mappedSize = bytes + page;
+
+    auto flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
+    if (mprotect((char*) memory + bytes, page, PROT_NONE) != 0) {
+        munmap(memory, mappedSize);
+        throw std::bad_alloc();
+    }
+
+    values = (VMValue*) ((char*) memory + bytes) - size;
+    InstallFaultHandler();
+#else
+    values = new VMValue[size];
+#endif
+}
+
+ValueStack::~ValueStack() {
+#if RVM_STACK_GUARD
+    munmap(memory, mappedSize);
+#else
+    delete[] values;
+#endif
+}
+
+void ValueStack::Guard(const std::function<void()>& body) const {
+#if RVM_STACK_GUARD
+    auto* guardBegin = (const char*) memory + mappedSize - PageSize();
+    ActiveGuard active = {guardBegin, guardBegin + PageSize()};
+
+    struct Restore {
+        ActiveGuard* previous;
+        ~Restore() { activeGuard = previous; }
+    } restore = {activeGuard};
+    activeGuard = &active;
+#endif
+    body();
+}
\ No newline at end of file
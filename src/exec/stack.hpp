@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+#include "instruction.hpp"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(RVM_NO_STACK_GUARD)
+#define RVM_STACK_GUARD 1
+#else
+#define RVM_STACK_GUARD 0
+#endif
+
+namespace rvm::exec {
+    // Value stack of a VM. Where supported its memory is mapped with an inaccessible page right
+    // after the last value, and pages are only committed once the stack grows into them, so
+    // large stacks cost nothing until used.
+    class ValueStack {
+    public:
+        explicit ValueStack(size_t size);
+        ~ValueStack();
+        ValueStack(const ValueStack&) = delete;
+        ValueStack& operator=(const ValueStack&) = delete;
+
+        VMValue* get() const { return values; }
+        VMValue& operator[](size_t index) const { return values[index]; }
+
+        // Runs `body` on the calling thread with this stack as the one it uses. Overflows are
+        // caught by the bounds checks of the VM; writing to the guard page anyway means one is
+        // missing, which is reported before the process aborts.
+        void Guard(const std::function<void()>& body) const;
+
+    private:
+        VMValue* values = nullptr;
+        void* memory = nullptr;
+        size_t mappedSize = 0;
+    };
+}
\ No newline at end of file
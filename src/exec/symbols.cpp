@@ -0,0 +1,153 @@
+#include "symbols.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <cstring>
+
+using rvm::exec::SymbolId;
+using rvm::exec::SymbolTable;
+
+namespace {
+    // Seeds with this bit set give the slot of a bucket's only name.
+    constexpr uint32_t Direct = uint32_t(1) << 31;
+    constexpr uint32_t MaxSeed = uint32_t(1) << 20;
+
+    uint64_t Mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCD;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Takes names eight bytes at a time.
+    uint64_t Hash(std::string_view name, uint64_t salt) {
+        uint64_t hash = (salt + 1) * 0x9E3779B97F4A7C15 ^ name.size();
+        size_t i = 0;
+        for (; i + 8 <= name.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, name.data() + i, 8);
+            hash = Mix(hash ^ word) * 0xC2B2AE3D27D4EB4F;
+        }
+        uint64_t tail = 0;
+        for (size_t shift = 0; i < name.size(); i++, shift += 8) tail |= uint64_t(uint8_t(name[i])) << shift;
+        return Mix(hash ^ tail);
+    }
+
+    uint32_t Slot(uint64_t hash, uint32_t seed, size_t size) {
+        return uint32_t(Mix(hash ^ seed * 0x9E3779B97F4A7C15) % size);
+    }
+
+    size_t BucketCount(size_t size) {
+        return size / 3 + 1;
+    }
+}
+
+SymbolTable::SymbolTable(std::span<const std::string_view> names) {
+    if (names.empty()) return;
+
+    std::vector<std::string_view> keys;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> slots;
+    for (salt = 0; !Unique(names, keys, hashes) || !Place(hashes, slots); salt++) { }
+
+    size_t poolSize = 0;
+    for (auto key : keys) poolSize += key.size();
+    if (poolSize > UINT32_MAX || keys.size() >= Direct) rvm::log::LogError("Too many symbols to intern.");
+
+    std::vector<uint32_t> keyAt(keys.size());
+    for (size_t k = 0; k < keys.size(); k++) keyAt[slots[k]] = uint32_t(k);
+    pool.reserve(poolSize);
+    offsets.reserve(keys.size() + 1);
+    for (auto k : keyAt) {
+        offsets.push_back(uint32_t(pool.size()));
+        pool += keys[k];
+    }
+    offsets.push_back(uint32_t(pool.size()));
+}
+
+// Finds the distinct names by sorting their hashes. Fails if two different names hash alike,
+// which no seed could tell apart.
+bool SymbolTable::Unique(std::span<const std::string_view> names, std::vector<std::string_view>& keys, std::vector<uint64_t>& hashes) const {
+    std::vector<std::pair<uint64_t, uint32_t>> sorted(names.size());
+    for (size_t n = 0; n < names.size(); n++) sorted[n] = {Hash(names[n], salt), uint32_t(n)};
+    std::sort(sorted.begin(), sorted.end());
+
+    keys.clear();
+    hashes.clear();
+    for (size_t n = 0; n < sorted.size(); n++) {
+        auto name = names[sorted[n].second];
+        if (n > 0 && sorted[n].first == sorted[n - 1].first) {
+            if (name != names[sorted[n - 1].second]) return false;
+            continue;
+        }
+        keys.push_back(name);
+        hashes.push_back(sorted[n].first);
+    }
+    return true;
+}
+
+// Hash and displace: the largest buckets are placed first, each trying seeds until all of its
+// names land on free slots. Buckets of one name take the next free slot directly.
+bool SymbolTable::Place(const std::vector<uint64_t>& hashes, std::vector<uint32_t>& slots) {
+    auto size = hashes.size();
+    seeds.assign(BucketCount(size), 0);
+    slots.resize(size);
+
+    // Names grouped by bucket, and buckets by size.
+    std::vector<uint32_t> starts(seeds.size() + 1, 0);
+    for (auto hash : hashes) starts[hash % seeds.size() + 1]++;
+    size_t largest = 0;
+    for (size_t b = 0; b < seeds.size(); b++) {
+        largest = std::max<size_t>(largest, starts[b + 1]);
+        starts[b + 1] += starts[b];
+    }
+    std::vector<uint32_t> members(size);
+    auto fill = starts;
+    for (size_t k = 0; k < size; k++) members[fill[hashes[k] % seeds.size()]++] = uint32_t(k);
+
+    std::vector<std::vector<uint32_t>> bySize(largest + 1);
+    for (size_t b = 0; b < seeds.size(); b++) bySize[starts[b + 1] - starts[b]].push_back(uint32_t(b));
+
+    std::vector<char> taken(size, false);
+    std::vector<uint32_t> tried;
+    size_t free = 0;
+    for (size_t bucketSize = largest; bucketSize > 0; bucketSize--) {
+        for (auto b : bySize[bucketSize]) {
+            auto keys = std::span(members).subspan(starts[b], bucketSize);
+            if (bucketSize == 1) {
+                while (taken[free]) free++;
+                taken[free] = true;
+                slots[keys[0]] = uint32_t(free);
+                seeds[b] = Direct | uint32_t(free);
+                continue;
+            }
+
+            uint32_t seed = 0;
+            for (; seed < MaxSeed; seed++) {
+                tried.clear();
+                for (auto k : keys) {
+                    auto slot = Slot(hashes[k], seed, size);
+                    if (taken[slot] || std::find(tried.begin(), tried.end(), slot) != tried.end()) break;
+                    tried.push_back(slot);
+                }
+                if (tried.size() == keys.size()) break;
+            }
+            if (seed == MaxSeed) return false;
+
+            for (size_t n = 0; n < keys.size(); n++) {
+                taken[tried[n]] = true;
+                slots[keys[n]] = tried[n];
+            }
+            seeds[b] = seed;
+        }
+    }
+    return true;
+}
+
+SymbolId SymbolTable::Find(std::string_view name) const {
+    if (seeds.empty()) return NoSymbol;
+
+    auto hash = Hash(name, salt);
+    auto seed = seeds[hash % seeds.size()];
+    SymbolId id = seed & Direct ? seed & ~Direct : Slot(hash, seed, Size());
+    return Name(id) == name ? id : NoSymbol;
+}
\ No newline at end of file
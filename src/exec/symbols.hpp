@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rvm::exec {
+    using SymbolId = uint32_t;
+    constexpr SymbolId NoSymbol = ~SymbolId(0);
+
+    // Interned names with a minimal perfect hash over them: the names are stored once, in one
+    // pool, and a symbol id is the slot the hash puts its name in. Ids run from 0 to Size() - 1.
+    class SymbolTable {
+    public:
+        SymbolTable() = default;
+        // Interns `names`, each only once however often it appears.
+        explicit SymbolTable(std::span<const std::string_view> names);
+
+        SymbolId Find(std::string_view name) const;
+        std::string_view Name(SymbolId id) const {
+            return std::string_view(pool).substr(offsets[id], offsets[id + 1] - offsets[id]);
+        }
+        size_t Size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    private:
+        bool Unique(std::span<const std::string_view> names, std::vector<std::string_view>& keys, std::vector<uint64_t>& hashes) const;
+        bool Place(const std::vector<uint64_t>& hashes, std::vector<uint32_t>& slots);
+
+        std::string pool;
+        // Pool offset of every name, and the end of the pool.
+        std::vector<uint32_t> offsets;
+        // Hash displacement of each bucket, or the slot of its only name.
+        std::vector<uint32_t> seeds;
+        uint64_t salt = 0;
+    };
+}
\ No newline at end of file
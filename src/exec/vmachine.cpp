@@ -1,74 +1,262 @@
 #include "vmachine.hpp"
 #include "instruction.hpp"
+#include "scheduler.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <stdexcept>
 #include <string_view>
 #include <iostream>
+#include <thread>
 #include "../log/log.hpp"
 
 using rvm::exec::VirtualMachine;
+using rvm::exec::ExecutionContext;
 using namespace std::literals;
 
 VirtualMachine::VirtualMachine() : VirtualMachine(8192, 8192) { }
 
-VirtualMachine::VirtualMachine(int64_t stack, int64_t localSize) : stackSize(stack) {
+VirtualMachine::VirtualMachine(int64_t stack, int64_t localSize) : stackSize(stack + localSize) {
     log::LogInfo("Creating VM instance.");
-    locals.reserve(localSize);
-    valueStack = std::make_unique<VMValue[]>(stackSize);
     SetupBuiltInFuncs();
     log::LogInfo("VM created.");
 }
 
+ExecutionContext::ExecutionContext(VirtualMachine& vm, int64_t stackSize)
+    : vm(vm), valueStack(size_t(stackSize)), stackSize(stackSize), maxFrames(size_t(stackSize)) { }
+
 void VirtualMachine::LoadBytecode(const std::vector<loading::GlobalDataUnit>& datums) {
     log::LogInfo("Loading bytecode.");
-    size_t reserveSize = 0;
+    if (image) {
+        instructionStorage.assign(instructions.begin(), instructions.end());
+        image.reset();
+    }
+
+    size_t reserveSize = instructionStorage.size();
     for (auto &d : datums) {
         reserveSize += d.dataVector.size();
     }
-    instructions.reserve(reserveSize);
+    instructionStorage.reserve(reserveSize);
 
+    std::vector<std::string_view> names;
+    names.reserve(units.size() + datums.size());
+    for (auto& unit : units) names.push_back(symbols.Name(unit.symbol));
     for (auto& data : datums) {
-        auto fIndex = instructions.size();
-        for (auto& ins : data.dataVector) {
-            instructions.emplace_back(ins);
-        }
-        globalDataMap.insert_or_assign(data.name, &instructions[fIndex]);
+        auto fIndex = instructionStorage.size();
+        instructionStorage.insert(instructionStorage.end(), data.dataVector.begin(), data.dataVector.end());
+        units.push_back({NoSymbol, fIndex, instructionStorage.size()});
+        names.push_back(data.name);
+    }
+    instructions = instructionStorage;
+    InternSymbols(names);
+    FinishLoading();
+}
+
+void VirtualMachine::LoadImage(std::unique_ptr<loading::MappedImage> mapped, std::string_view resolutions) {
+    log::LogInfo("Loading mapped executable.");
+    image = std::move(mapped);
+    instructions = image->Code();
+    instructionStorage.clear();
+    units.clear();
+
+    std::vector<std::string_view> names;
+    names.reserve(image->Units().size());
+    for (auto& unit : image->Units()) {
+        units.push_back({NoSymbol, unit.begin, unit.end});
+        names.push_back(unit.name);
+    }
+    InternSymbols(names);
+    FinishLoading(resolutions);
+}
+
+void VirtualMachine::InternSymbols(const std::vector<std::string_view>& names) {
+    auto all = names;
+    for (auto& builtIn : builtInFunctions) all.push_back(builtIn.name);
+    // `names` may point into the current table, so it is only replaced once done with them.
+    SymbolTable table(all);
+    std::vector<SymbolBinding> bound(table.Size());
+    // Units loaded later take over the names of earlier ones.
+    for (size_t u = 0; u < units.size(); u++) {
+        units[u].symbol = table.Find(names[u]);
+        bound[units[u].symbol].unit = uint32_t(u);
     }
+    for (size_t b = 0; b < builtInFunctions.size(); b++) {
+        bound[table.Find(builtInFunctions[b].name)].builtIn = uint32_t(b);
+    }
+    symbols = std::move(table);
+    bindings = std::move(bound);
+    log::LogInfo("Interned "s + std::to_string(symbols.Size()) + " symbols.");
+}
+
+size_t VirtualMachine::UnitNamed(std::string_view name) const {
+    auto id = symbols.Find(name);
+    if (id == NoSymbol || bindings[id].unit == SymbolBinding::None) throw std::out_of_range("Global unit not found.");
+    return units[bindings[id].unit].begin;
+}
+
+size_t VirtualMachine::EntryPoint(const std::string& name) const {
+    auto id = symbols.Find(name);
+    if (id == NoSymbol || bindings[id].unit == SymbolBinding::None) {
+        log::LogError("Unable to find entry function: "s + name + ".");
+    }
+    return units[bindings[id].unit].begin;
+}
+
+std::string VirtualMachine::UnitName(const GlobalUnitInfo& unit) const {
+    return std::string(symbols.Name(unit.symbol));
+}
+
+rvm::exec::InstructionUnit* VirtualMachine::GlobalAddress(SymbolId id) const {
+    if (id >= bindings.size() || bindings[id].unit == SymbolBinding::None) return nullptr;
+    return instructions.data() + units[bindings[id].unit].begin;
+}
+
+void VirtualMachine::FinishLoading(std::string_view resolutions) {
+    if (lazyLoading) IndexUnits();
+    else if (!resolutions.empty() && RestoreResolutions(resolutions)) {
+        for (auto& unit : units) unit.loaded = true;
+    }
+    else {
+        Link();
+        Verify();
+        for (auto& unit : units) unit.loaded = true;
+    }
+
+    if (engine == ExecutionEngine::THREADED) DecodeUnits();
     log::LogInfo("Finished loading bytecode.");
 }
 
 void VirtualMachine::Run(const std::string& entry) {
-    log::LogInfo("Running VM.");
-    if (!globalDataMap.contains(entry)) {
-        log::LogError("Unable to find entry function: "s + entry + ".");
+    // Profiled runs count into one table, so they stay on one thread.
+    auto count = pairProfiling ? 1 : threads;
+    if (count > 1) Prepare();
+    Scheduler(*this, count, stackSize).Run(entry);
+}
+
+void VirtualMachine::Prepare() {
+    if (lazyLoading) {
+        for (auto& unit : units) LoadUnit(unit);
+        lazyLoading = false;
+    }
+    if (engine == ExecutionEngine::THREADED && !pairProfiling) {
+        if (decoded.size() != instructions.size() + 1) DecodeUnits();
+        for (auto& unit : units) PromoteUnit(unit);
     }
-    insIndex = globalDataMap.at(entry) - &instructions[0];
-    valueIndexStack.push(valuesFrameBaseIndex);
+    // Nothing is counted once everything is promoted.
+    tierThreshold = 0;
+    log::LogInfo("Prepared VM.");
+}
+
+void ExecutionContext::Run(const std::string& entry) {
+    log::LogInfo("Running VM.");
+    Enter(vm.EntryPoint(entry), {});
+    Resume();
+    if (!error.empty()) log::LogError(error);
+    log::LogInfo("Finished VM program.");
+}
+
+void ExecutionContext::Enter(size_t index, std::span<const VMValue> args) {
+    if (int64_t(args.size()) > stackSize) throw VirtualMachineException("Stack overflow error.");
+
+    // Like a call, the argument pushed last becomes local 0.
+    std::reverse_copy(args.begin(), args.end(), valueStack.get());
+    insIndex = std::min(index, vm.instructions.size());
+    localFrameBaseIndex = 0;
+    valuesFrameBaseIndex = args.size();
+    stackIndex = int64_t(args.size()) - 1;
+    frames.clear();
+    running = true;
+    started = false;
+    lastOpCode = OpCode::NOP;
+    returned = 0;
+    error.clear();
+}
+
+bool ExecutionContext::Resume() {
+    auto threaded = vm.engine == ExecutionEngine::THREADED && !vm.pairProfiling;
+    if (threaded && vm.decoded.size() != vm.instructions.size() + 1) vm.DecodeUnits();
+    if (!started && vm.lazyLoading) vm.LoadUnitAt(insIndex);
+    yielded = false;
+    joining = nullptr;
+    waiting = nullptr;
     try {
-        ExecutionLoop();
+        valueStack.Guard([&] {
+            if (threaded && !started) CheckFunctionEntry(int32_t(valuesFrameBaseIndex));
+            started = true;
+            if (threaded) ThreadedLoop();
+            else ExecutionLoop();
+        });
     }
     catch (std::out_of_range& e) {
-        log::LogError("Global unit not found.");
+        error = "Global unit not found.";
     }
     catch (std::exception& e) {
-        log::LogError("Fatal error reported: "s + e.what());
+        error = "Fatal error reported: "s + e.what();
     }
-    log::LogInfo("Finished VM program.");
+    if (!error.empty()) {
+        running = false;
+        return true;
+    }
+    return !yielded && !joining;
+}
+
+std::vector<rvm::exec::VMValue> ExecutionContext::Results() const {
+    auto count = std::clamp<int64_t>(returned, 0, stackIndex + 1);
+    return std::vector<VMValue>(&valueStack[stackIndex + 1 - count], &valueStack[stackIndex + 1]);
 }
 
-const rvm::exec::InstructionUnit& VirtualMachine::FetchIns() {
-    return instructions[insIndex++];
+void VirtualMachine::SetEngine(ExecutionEngine e) {
+    engine = e;
 }
 
-void VirtualMachine::ExecutionLoop() {
-    while (insIndex < instructions.size() && running) {
+void VirtualMachine::SetJit(bool enabled) {
+    jit = enabled;
+}
+
+void VirtualMachine::SetTierThreshold(uint32_t count) {
+    tierThreshold = count;
+}
+
+void VirtualMachine::SetThreads(size_t count) {
+    if (count == 0) count = std::thread::hardware_concurrency();
+    threads = std::max<size_t>(count, 1);
+}
+
+void VirtualMachine::SetHeapSize(size_t bytes) {
+    heap = std::make_unique<SharedHeap>(bytes);
+}
+
+void VirtualMachine::SetPairProfiling(bool enabled) {
+    pairProfiling = enabled;
+    pairCounts.assign(enabled ? OpCodeCount * OpCodeCount : 0, 0);
+}
+
+std::vector<rvm::exec::OpCodePairCount> VirtualMachine::GetPairProfile() const {
+    std::vector<OpCodePairCount> out;
+    for (size_t i = 0; i < pairCounts.size(); i++) {
+        if (pairCounts[i] == 0) continue;
+        out.push_back({OpCode(i / OpCodeCount), OpCode(i % OpCodeCount), pairCounts[i]});
+    }
+    std::sort(out.begin(), out.end(), [] (auto& a, auto& b) { return a.count > b.count; });
+    return out;
+}
+
+const rvm::exec::InstructionUnit& ExecutionContext::FetchIns() {
+    return vm.instructions[insIndex++];
+}
+
+void ExecutionContext::ExecutionLoop() {
+    while (insIndex < vm.instructions.size() && running) {
         auto ins = FetchIns();
+        if (vm.pairProfiling && size_t(ins.ins.code) < OpCodeCount) {
+            vm.pairCounts[size_t(lastOpCode) * OpCodeCount + size_t(ins.ins.code)]++;
+            lastOpCode = ins.ins.code;
+        }
         if (!ExecuteInstruction(ins)) break;
     }
 
 }
 
-bool VirtualMachine::ExecuteInstruction(const InstructionUnit& ins) {
+bool ExecutionContext::ExecuteInstruction(const InstructionUnit& ins) {
     using Op = OpCode;
     switch (ins.ins.code) {
         default:
@@ -161,6 +349,7 @@ bool VirtualMachine::ExecuteInstruction(const InstructionUnit& ins) {
             break;
         case Op::CALL:
             hCall(ins.ins.data);
+            if (yielded) return false;
             break;
         case Op::RET:
             hRet(ins.ins.data);
@@ -171,12 +360,39 @@ bool VirtualMachine::ExecuteInstruction(const InstructionUnit& ins) {
         case Op::GETGLOBAL:
             hGetGlobal();
             break;
+        case Op::SPAWN:
+            hSpawn(ins.ins.data);
+            break;
+        case Op::YIELD:
+            hYield();
+            return false;
+        case Op::JOIN:
+            if (!hJoin(ins.ins.data)) {
+                insIndex--;
+                return false;
+            }
+            break;
+        case Op::ATOMICLOAD:
+            hAtomicLoad(ins.ins.optype[0], ins.ins.data);
+            break;
+        case Op::ATOMICSTORE:
+            hAtomicStore(ins.ins.optype[0], ins.ins.data);
+            break;
+        case Op::ATOMICADD:
+            hAtomicAdd(ins.ins.optype[0], ins.ins.data);
+            break;
+        case Op::ATOMICCAS:
+            hAtomicCas(ins.ins.optype[0], ins.ins.data);
+            break;
+        case Op::FENCE:
+            hFence(ins.ins.data);
+            break;
     }
     return true;
 }
 
-const char* VirtualMachine::ConsumeStringViewFromIns() {
-    auto* insPtr = (char*) &instructions[insIndex];
+const char* ExecutionContext::ConsumeStringViewFromIns() {
+    auto* insPtr = (char*) &vm.instructions[insIndex];
     std::string_view out {insPtr};
 
     uint64_t len = out.length();
@@ -185,7 +401,7 @@ const char* VirtualMachine::ConsumeStringViewFromIns() {
     return out.data();
 }
 
-rvm::exec::VMValue VirtualMachine::PopValue() {
+rvm::exec::VMValue ExecutionContext::PopValue() {
     if (stackIndex < std::bit_cast<int64_t>(valuesFrameBaseIndex)) {
         throw VirtualMachineException("Value stack operation fell outside of function frame.");
     }
@@ -193,18 +409,50 @@ rvm::exec::VMValue VirtualMachine::PopValue() {
     return val;
 }
 
-void VirtualMachine::PushValue(rvm::exec::VMValue value) { 
+void ExecutionContext::PushValue(rvm::exec::VMValue value) { 
     if (stackIndex >= stackSize - 1) {
         throw VirtualMachineException("Stack overflow error.");
     }
     valueStack[++stackIndex] = value;
 }
 
-rvm::exec::VMValue& VirtualMachine::GetLocalAtIndex(int32_t index) {
-    return locals[index + localFrameBaseIndex];
+rvm::exec::VMValue& ExecutionContext::GetLocalAtIndex(int32_t index) {
+    if (index < 0 || index + localFrameBaseIndex >= valuesFrameBaseIndex) {
+        throw VirtualMachineException("Local index out of range.");
+    }
+    return valueStack[index + localFrameBaseIndex];
 }
 
-std::vector<rvm::exec::VMValue> VirtualMachine::GetValueStackSnapshot() {
+const VirtualMachine::GlobalUnitInfo* VirtualMachine::FindUnit(size_t index) const {
+    auto it = std::upper_bound(units.begin(), units.end(), index, [] (size_t i, const GlobalUnitInfo& unit) {
+        return i < unit.begin;
+    });
+    if (it == units.begin() || index >= (it - 1)->end) return nullptr;
+    return &*(it - 1);
+}
+
+// Calls whose target is only known at run time must still meet the assumptions a verified
+// callee was checked under before the threaded engine runs it unchecked.
+void ExecutionContext::CheckFunctionEntry(int32_t argnum) {
+    auto* unit = vm.FindUnit(insIndex);
+    if (unit && vm.lazyLoading) {
+        // Only the call sites linked so far went into the argument count the unit was verified for.
+        vm.LoadUnit(vm.units[unit - vm.units.data()]);
+        if (unit->verified && insIndex == unit->begin) vm.AddCallSite(unit - vm.units.data(), argnum);
+    }
+    if (!unit || !unit->verified) return;
+    if (insIndex != unit->begin) {
+        throw VirtualMachineException("Call into the middle of a verified function.");
+    }
+    if (std::max(argnum, 0) != unit->args) {
+        throw VirtualMachineException("Call does not match the argument count of the callee.");
+    }
+    if (stackIndex + 1 + unit->maxStack > stackSize) {
+        throw VirtualMachineException("Stack overflow error.");
+    }
+}
+
+std::vector<rvm::exec::VMValue> ExecutionContext::GetValueStackSnapshot() {
     std::vector<VMValue> out;
     for (unsigned i = 0; i < stackSize; i++) {
         out.push_back(valueStack[i]);
@@ -212,49 +460,71 @@ std::vector<rvm::exec::VMValue> VirtualMachine::GetValueStackSnapshot() {
     return out;
 }
 
+void VirtualMachine::RegisterBuiltIn(const std::string& name, int32_t pops, int32_t pushes, std::function<void(ExecutionContext&, int)> func) {
+    BuiltInFunction builtIn {name, std::move(func), pops, pushes};
+    for (auto& existing : builtInFunctions) {
+        if (existing.name == name) {
+            existing = std::move(builtIn);
+            return;
+        }
+    }
+    builtInFunctions.push_back(std::move(builtIn));
+}
+
 void VirtualMachine::SetupBuiltInFuncs() {
 
-    builtInFunctions.insert_or_assign("__printchar", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printchar", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.i8;
     });
 
-    builtInFunctions.insert_or_assign("__printi8", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printi8", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << int(val.i8);
     });
 
-    builtInFunctions.insert_or_assign("__printi16", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printi16", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.i16;
     });
 
-    builtInFunctions.insert_or_assign("__printi32", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printi32", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.i32;
     });
 
-    builtInFunctions.insert_or_assign("__printi64", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printi64", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.i64;
     });
 
-    builtInFunctions.insert_or_assign("__printf32", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printf32", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.f32;
     });
 
-    builtInFunctions.insert_or_assign("__printf64", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printf64", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << val.i64;
     });
 
-    builtInFunctions.insert_or_assign("__printstr", [this] (int) {
-        auto val = PopValue();
+    RegisterBuiltIn("__printstr", 1, 0, [] (ExecutionContext& context, int) {
+        auto val = context.PopValue();
         std::cout << (char*) val.ptr;
     });
 
-    builtInFunctions.insert_or_assign("__printnl", [] (int) {
+    RegisterBuiltIn("__printnl", 0, 0, [] (ExecutionContext&, int) {
         std::cout << std::endl;
     });
+
+    // Pushes a pointer to a zeroed block of the given number of bytes on the shared heap.
+    RegisterBuiltIn("__heapalloc", 1, 1, [this] (ExecutionContext& context, int) {
+        auto bytes = context.PopValue().i64;
+        if (bytes < 0) throw VirtualMachineException("Negative heap allocation size.");
+        auto* block = heap->Allocate(size_t(bytes));
+        if (!block) throw VirtualMachineException("Shared heap exhausted.");
+        context.PushValue(VMValue(block));
+    });
+
+    SetupChannelBuiltIns();
 }
\ No newline at end of file
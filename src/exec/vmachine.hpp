@@ -3,14 +3,23 @@
 #include <cstddef>
 #include <cstdint>
 #include <exception>
-#include <stack>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
+#include <span>
 #include <unordered_map>
 #include <functional>
+#include <mutex>
 
 #include "instruction.hpp"
+#include "channel.hpp"
+#include "decoded.hpp"
+#include "heap.hpp"
+#include "stack.hpp"
+#include "symbols.hpp"
+#include "x64.hpp"
+#include "zeroed.hpp"
 #include "../loading/loading.hpp"
 
 namespace rvm::exec {
@@ -24,44 +33,296 @@ namespace rvm::exec {
         std::string msg;
     };
 
+    enum class ExecutionEngine {
+        SWITCH,
+        THREADED
+    };
+
+    struct OpCodePairCount {
+        OpCode first;
+        OpCode second;
+        uint64_t count;
+    };
+
+    class ExecutionContext;
+    class Scheduler;
+    struct Fiber;
+
+    // Loaded code and everything derived from it. Execution state lives in ExecutionContexts,
+    // so many of them can share one VirtualMachine, see Prepare.
     class VirtualMachine {
     private:
-        std::vector<InstructionUnit> instructions;
-        std::unique_ptr<VMValue[]> valueStack;
-        std::stack<size_t, std::vector<size_t>> returnStack, frameIndexStack, valueIndexStack;
-        std::unordered_map<std::string, InstructionUnit*> globalDataMap;
-        std::unordered_map<std::string, std::function<void(int)>> builtInFunctions;
+        struct GlobalUnitInfo {
+            SymbolId symbol = NoSymbol;
+            size_t begin = 0;
+            size_t end = 0;
+            bool code = false;
 
-        std::vector<VMValue> locals;
+            // Filled by the verifier. A verified function takes `args` arguments, always returns
+            // `returns` values and never needs more than `maxStack` slots above its arguments.
+            bool verified = false;
+            int32_t args = 0;
+            int32_t returns = 0;
+            int32_t maxStack = 0;
 
-        size_t insIndex = 0;
-        size_t localFrameBaseIndex = 0;
-        size_t valuesFrameBaseIndex = 0;
+            // Set once the threaded engine replaced its decoded instructions with an optimized form.
+            bool promoted = false;
+
+            // Set once the unit is linked and verified, and once it was entered and is ready to
+            // run. Both are set for every unit unless loading lazily.
+            bool linked = false;
+            bool loaded = false;
+        };
+
+        struct BuiltInFunction {
+            std::string name;
+            std::function<void(ExecutionContext&, int)> function;
+            int32_t pops = 0;
+            int32_t pushes = 0;
+        };
+
+        // What a symbol names: the last unit loaded under it and a built-in function, if any.
+        struct SymbolBinding {
+            static constexpr uint32_t None = ~uint32_t(0);
+
+            uint32_t unit = None;
+            uint32_t builtIn = None;
+        };
+
+        // Link result for a call or getglobal instruction, indexed like `instructions`.
+        struct LinkedSymbol {
+            enum class Kind : uint8_t {
+                NONE,
+                UNIT,
+                BUILTIN
+            };
 
+            Kind kind = Kind::NONE;
+            bool tail = false;
+            uint32_t length = 0;
+            size_t target = 0;
+        };
+
+        // Code of all loaded units, either in `instructionStorage` or in place in `image`.
+        std::span<InstructionUnit> instructions;
+        std::vector<InstructionUnit> instructionStorage;
+        std::unique_ptr<loading::MappedImage> image;
+        ZeroedVector<DecodedInstruction> decoded;
+        std::vector<GlobalUnitInfo> units;
+        SymbolTable symbols;
+        std::vector<SymbolBinding> bindings;
+        std::vector<BuiltInFunction> builtInFunctions;
+        ZeroedVector<LinkedSymbol> links;
+        // Operand stack depth and number of locals before each instruction of a verified
+        // function, -1 depth for instructions it never reaches.
+        ZeroedVector<int32_t> stackDepths;
+        ZeroedVector<int32_t> localCounts;
+        std::vector<uint64_t> pairCounts;
+        std::vector<x64::ExecutableCode> nativeCode;
+        // Argument counts of the direct calls linked so far and value counts of the rets of
+        // each unit, when loading lazily.
+        std::vector<int32_t> lazyArities;
+        std::vector<int32_t> lazyReturns;
+        bool lazyLoading = false;
+        // Calls into functions and taken backward branches, indexed like `instructions`.
+        ZeroedVector<uint32_t> hotCounts;
+
+        // Value stack size of the contexts Run creates.
         int64_t stackSize = 8192;
-        int64_t stackIndex = -1;
+        uint32_t tierThreshold = 1000;
+        size_t threads = 1;
 
-        bool running = true;
+        // Memory the atomic instructions work on and channels made by the program, shared by
+        // every context running it.
+        std::unique_ptr<SharedHeap> heap = std::make_unique<SharedHeap>(size_t(16) << 20);
+        std::mutex channelsMutex;
+        std::vector<std::unique_ptr<Channel>> channels;
+
+        bool pairProfiling = false;
+        bool jit = false;
+        ExecutionEngine engine = ExecutionEngine::SWITCH;
+
+        friend class ExecutionContext;
+        friend class Scheduler;
+        template <bool Checked>
+        friend struct ThreadedOps;
     public:
         VirtualMachine();
         VirtualMachine(int64_t stack, int64_t localSize);
         ~VirtualMachine() = default;
-        
+
         void LoadBytecode(const std::vector<loading::GlobalDataUnit>& functions);
+        // Runs the units of a mapped executable without copying their code. Replaces anything
+        // loaded before. Resolutions saved for the same code skip linking and verifying it.
+        void LoadImage(std::unique_ptr<loading::MappedImage> mapped, std::string_view resolutions = {});
+        // Link and verification results of everything loaded, empty when loading lazily.
+        std::string SaveResolutions() const;
+        // Names the layout of saved resolutions and the built-ins they refer to, which a cache
+        // of them has to be keyed by as well as by the code.
+        std::string ResolutionsKey() const;
+        // Runs `entry` as the first fiber of a new Scheduler, with the stack size the VM was
+        // created with, until every fiber it spawns finished.
+        void Run(const std::string& entry = "main");
+        // Loads, decodes and optimizes up front everything running would otherwise do on first
+        // use, after which the code does not change anymore. From then on, until more code is
+        // loaded, contexts on any number of threads may run the VM at the same time.
+        void Prepare();
+        void SetEngine(ExecutionEngine e);
+        // Compiles verified functions to native code where supported. Threaded engine only.
+        void SetJit(bool enabled);
+        // Number of calls into a function, or iterations of one of its loops, before the threaded
+        // engine optimizes it. 0 optimizes every function when it is loaded.
+        void SetTierThreshold(uint32_t count);
+        // Links, verifies and decodes each unit only once it is first entered, instead of the
+        // whole program at load time. Applies to code loaded afterwards.
+        void SetLazyLoading(bool enabled);
+        // Number of threads Run runs fibers on, 0 for one per core. With more than one, Run
+        // prepares the VM first.
+        void SetThreads(size_t count);
+        // Size in bytes of the heap the atomic instructions work on, 16 MB by default. Replaces
+        // the heap, so it is only set before running.
+        void SetHeapSize(size_t bytes);
+
+        // Counts executed opcode pairs. Profiled runs always use the switch engine, and only
+        // one context at a time may run a profiled VM.
+        void SetPairProfiling(bool enabled);
+        std::vector<OpCodePairCount> GetPairProfile() const;
+
+        // Names of all loaded units and built-in functions. Loading more code interns them anew,
+        // which changes their ids.
+        const SymbolTable& Symbols() const { return symbols; }
+        // Address of the unit a symbol names, or nullptr if it names none.
+        InstructionUnit* GlobalAddress(SymbolId id) const;
+
+    private:
+        void DecodeUnits();
+        void DecodeUnit(const GlobalUnitInfo& range);
+        void PromoteUnit(GlobalUnitInfo& range);
+        void PromoteUnitAt(size_t index);
+        void StubUnit(const GlobalUnitInfo& range);
+        void FuseUnit(const GlobalUnitInfo& range);
+        bool TranslateUnit(const GlobalUnitInfo& range);
+        bool CompileUnit(const GlobalUnitInfo& range);
+        bool IsTailCall(size_t next, size_t target, int32_t argnum) const;
+
+        void SetupBuiltInFuncs();
+        void SetupChannelBuiltIns();
+        void RegisterBuiltIn(const std::string& name, int32_t pops, int32_t pushes, std::function<void(ExecutionContext&, int)> func);
+        // Interns the names of `units`, given in the same order, and of the built-in functions.
+        void InternSymbols(const std::vector<std::string_view>& names);
+        // Code index of the unit named `name`. Throws std::out_of_range if there is none.
+        size_t UnitNamed(std::string_view name) const;
+        // Code index of the entry function `name`, which must exist.
+        size_t EntryPoint(const std::string& name) const;
+        std::string UnitName(const GlobalUnitInfo& unit) const;
+        // Links, verifies and decodes what LoadBytecode or LoadImage put in `instructions`.
+        void FinishLoading(std::string_view resolutions = {});
+        void Link();
+        void LinkUnit(GlobalUnitInfo& range);
+        bool RestoreResolutions(std::string_view resolutions);
+        void Verify();
+        bool VerifyUnit(GlobalUnitInfo& unit, const std::vector<int32_t>& arities, const std::vector<int32_t>& returns);
+        const GlobalUnitInfo* FindUnit(size_t index) const;
+
+        void IndexUnits();
+        void ScanUnit(size_t index);
+        void LinkLazily(size_t index);
+        void AddCallSite(size_t callee, int32_t argnum);
+        void AddAddressUse(size_t unit);
+        void Deoptimize(GlobalUnitInfo& unit);
+        void LoadUnit(GlobalUnitInfo& unit);
+        void LoadUnitAt(size_t index);
+    };
+
+    // State of one execution of the code loaded in a VirtualMachine: value stack, call frames
+    // and position. A context can run any number of times, each run starting afresh. Contexts
+    // run by a Scheduler are fibers, which can spawn, yield to and join other fibers.
+    class ExecutionContext {
+    private:
+        // Saved state of a caller. Locals and operands of a frame live on the value stack:
+        // locals start at `localBase`, operands at `valueBase`, both as value stack indices.
+        struct CallFrame {
+            size_t returnIndex;
+            size_t localBase;
+            size_t valueBase;
+        };
+
+        VirtualMachine& vm;
+        ValueStack valueStack;
+        std::vector<CallFrame> frames;
+
+        size_t insIndex = 0;
+        size_t localFrameBaseIndex = 0;
+        size_t valuesFrameBaseIndex = 0;
+
+        int64_t stackSize;
+        int64_t stackIndex = -1;
+        size_t maxFrames;
+
+        bool running = true;
+        bool started = false;
+        OpCode lastOpCode = OpCode::NOP;
+
+        // Set when run as a fiber. A fiber that suspends either yielded, waits for `joining`
+        // to finish, or waits on `waiting` to change from `waitEpoch`. Once finished, it
+        // returned `returned` values.
+        Scheduler* scheduler = nullptr;
+        Fiber* fiber = nullptr;
+        bool yielded = false;
+        Fiber* joining = nullptr;
+        int64_t joiningHandle = 0;
+        WaitQueue* waiting = nullptr;
+        uint64_t waitEpoch = 0;
+        int32_t returned = 0;
+        // Set when the run stopped on an error, which finishes it. Reporting it is up to
+        // whoever resumed the context.
+        std::string error;
+
+        friend class VirtualMachine;
+        friend class Scheduler;
+        template <bool Checked>
+        friend struct ThreadedOps;
+    public:
+        // `stackSize` values of stack, shared by locals and operands.
+        ExecutionContext(VirtualMachine& vm, int64_t stackSize);
+
         void Run(const std::string& entry = "main");
+        std::vector<VMValue> GetValueStackSnapshot();
 
     private:
+        // Sets up a call of the function at code index `index` with `args`, in the order they
+        // were pushed, as the bottom frame.
+        void Enter(size_t index, std::span<const VMValue> args);
+        // Runs from where the context is until the bottom frame returns, fails with `error`, or
+        // suspends as a fiber. Returns true once finished.
+        bool Resume();
+        // Values the bottom frame returned.
+        std::vector<VMValue> Results() const;
+
         const InstructionUnit& FetchIns();
         void ExecutionLoop();
         bool ExecuteInstruction(const InstructionUnit& ins);
         const char* ConsumeStringViewFromIns();
 
+        void ThreadedLoop();
+        void PushCallFrame(int32_t argnum);
+        void ReplaceCallFrame(int32_t argnum);
+        void CallByName(std::string_view name, int32_t argnum, size_t callIndex);
+        void CallBuiltIn(uint32_t index, int32_t argnum, size_t callIndex);
+        // For built-in functions that can not finish until `queue` changes, which then return
+        // leaving the stack as they found it: the fiber is parked and its call runs again once
+        // the queue was woken after `epoch`, read before they found they have to wait. Returns
+        // false outside of a scheduler, where they have to wait on their own.
+        bool RetryCall(WaitQueue& queue, uint64_t epoch);
+        // Readies the fibers parked on `queue`, after a change they may wait for.
+        void Wake(WaitQueue& queue);
+        void CheckFunctionEntry(int32_t argnum);
+        void CountCallEntry();
+
         VMValue PopValue();
         void PushValue(VMValue value);
         VMValue& GetLocalAtIndex(int32_t index);
 
-        void SetupBuiltInFuncs();
-
 
         // Instruction handlers
 
@@ -103,7 +364,16 @@ namespace rvm::exec {
         void hCallIndirect(int32_t argnumber);
         void hGetGlobal();
 
-    public:
-        std::vector<VMValue> GetValueStackSnapshot();
+        void hSpawn(int32_t argnumber);
+        void hYield();
+        // Returns false, leaving the stack as it was, if the fiber has to wait.
+        bool hJoin(int32_t count);
+
+        // Typed by `t` with ordering `order` (see MemoryOrder), on a pointer into the heap.
+        void hAtomicLoad(DataType t, int32_t order);
+        void hAtomicStore(DataType t, int32_t order);
+        void hAtomicAdd(DataType t, int32_t order);
+        void hAtomicCas(DataType t, int32_t order);
+        void hFence(int32_t order);
     };
 }
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "vmachine.hpp"
+#include "channel.hpp"
+#include <algorithm>
+#include <thread>
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::ExecutionContext;
+using rvm::exec::Channel;
+using rvm::exec::VMValue;
+
+namespace {
+    Channel& ChannelOf(VMValue value) {
+        if (!value.ptr) throw rvm::exec::VirtualMachineException("Invalid channel.");
+        return *(Channel*) value.ptr;
+    }
+}
+
+// Channels are passed around as pointers and live as long as the VM. The channel is the first
+// argument, at the top of the stack. A call that has to wait puts back what it popped and runs
+// again once the channel changed, see ExecutionContext::RetryCall.
+void VirtualMachine::SetupChannelBuiltIns() {
+    // Pushes a channel holding up to `capacity` values, any number if it is 0 or less.
+    RegisterBuiltIn("__chanmake", 1, 1, [this] (ExecutionContext& context, int) {
+        auto capacity = context.PopValue().i64;
+        auto channel = std::make_unique<Channel>(size_t(std::max<int64_t>(capacity, 0)));
+        auto* made = channel.get();
+        {
+            std::lock_guard lock(channelsMutex);
+            channels.push_back(std::move(channel));
+        }
+        context.PushValue(VMValue((void*) made));
+    });
+
+    // Sends a value, waiting while the channel is full. Pushes 1, or 0 if the channel is closed.
+    RegisterBuiltIn("__chansend", 2, 1, [] (ExecutionContext& context, int) {
+        auto channel = context.PopValue();
+        auto value = context.PopValue();
+        auto& target = ChannelOf(channel);
+        auto epoch = target.waiters.epoch.load();
+        auto sent = target.TrySend(value);
+        while (!sent && !target.Closed()) {
+            if (context.RetryCall(target.waiters, epoch)) {
+                context.PushValue(value);
+                context.PushValue(channel);
+                return;
+            }
+            std::this_thread::yield();
+            epoch = target.waiters.epoch.load();
+            sent = target.TrySend(value);
+        }
+        if (sent) context.Wake(target.waiters);
+        context.PushValue(VMValue(int64_t(sent)));
+    });
+
+    // Receives a value, waiting while the channel is empty. Pushes the value and then 1, or 0
+    // and 0 once the channel is closed and every value sent was received.
+    RegisterBuiltIn("__chanrecv", 1, 2, [] (ExecutionContext& context, int) {
+        auto channel = context.PopValue();
+        auto& source = ChannelOf(channel);
+        auto epoch = source.waiters.epoch.load();
+        VMValue value;
+        auto received = source.TryReceive(value);
+        while (!received) {
+            // Values sent before the channel was closed are still there.
+            if (source.Closed()) {
+                received = source.TryReceive(value);
+                break;
+            }
+            if (context.RetryCall(source.waiters, epoch)) {
+                context.PushValue(channel);
+                return;
+            }
+            std::this_thread::yield();
+            epoch = source.waiters.epoch.load();
+            received = source.TryReceive(value);
+        }
+        if (received) context.Wake(source.waiters);
+        context.PushValue(received ? value : VMValue());
+        context.PushValue(VMValue(int64_t(received)));
+    });
+
+    // Like __chanrecv, but pushes 0 and 0 right away if no value is there.
+    RegisterBuiltIn("__chantryrecv", 1, 2, [] (ExecutionContext& context, int) {
+        auto& source = ChannelOf(context.PopValue());
+        VMValue value;
+        auto received = source.TryReceive(value);
+        if (received) context.Wake(source.waiters);
+        context.PushValue(received ? value : VMValue());
+        context.PushValue(VMValue(int64_t(received)));
+    });
+
+    RegisterBuiltIn("__chanclose", 1, 0, [] (ExecutionContext& context, int) {
+        auto& channel = ChannelOf(context.PopValue());
+        channel.Close();
+        context.Wake(channel.waiters);
+    });
+}
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include "instruction.hpp"
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+
+namespace {
+    bool IsNumeric(rvm::exec::DataType t) {
+        return t >= rvm::exec::DataType::I8 && t <= rvm::exec::DataType::F64;
+    }
+
+    int NumericIndex(rvm::exec::DataType t) {
+        return int(t) - int(rvm::exec::DataType::I8);
+    }
+
+    DecodedOp Offset(DecodedOp first, int index) {
+        return DecodedOp(int(first) + index);
+    }
+
+    // Picks the monomorphic form of a type parameterized instruction, following the
+    // defaults of the generic handlers (I64 arithmetic, PTR comparison).
+    DecodedOp Quicken(const rvm::exec::DecodedInstruction& ins) {
+        using rvm::exec::DataType;
+        auto t = ins.optype[0];
+        int arithmetic = IsNumeric(t) ? NumericIndex(t) : NumericIndex(DataType::I64);
+        int compared = IsNumeric(t) ? NumericIndex(t) : NumericIndex(DataType::F64) + 1;
+
+        switch (ins.op) {
+            case DecodedOp::ADD: return Offset(DecodedOp::ADD_I8, arithmetic);
+            case DecodedOp::SUB: return Offset(DecodedOp::SUB_I8, arithmetic);
+            case DecodedOp::MUL: return Offset(DecodedOp::MUL_I8, arithmetic);
+            case DecodedOp::DIV: return Offset(DecodedOp::DIV_I8, arithmetic);
+            case DecodedOp::GT: return Offset(DecodedOp::GT_I8, compared);
+            case DecodedOp::GEQ: return Offset(DecodedOp::GEQ_I8, compared);
+            case DecodedOp::LT: return Offset(DecodedOp::LT_I8, compared);
+            case DecodedOp::LEQ: return Offset(DecodedOp::LEQ_I8, compared);
+            case DecodedOp::EQ: return Offset(DecodedOp::EQ_I8, compared);
+            case DecodedOp::NOTEQ: return Offset(DecodedOp::NOTEQ_I8, compared);
+            case DecodedOp::CONVERT: {
+                auto from = ins.optype[0];
+                auto to = ins.optype[1];
+                if (from == to || to == DataType::PTR) return DecodedOp::NOP;
+                if (!IsNumeric(from) || !IsNumeric(to)) return DecodedOp::CONVERT_DROP;
+                return Offset(DecodedOp::CONVERT_I8_I8, NumericIndex(from) * 6 + NumericIndex(to));
+            }
+            default:
+                return ins.op;
+        }
+    }
+}
+
+void VirtualMachine::DecodeUnit(const GlobalUnitInfo& range) {
+    for (size_t i = range.begin; i < range.end; i++) {
+        decoded[i] = DecodedInstruction();
+        decoded[i].handler = GetThreadedHandler(DecodedOp::UNKNOWN);
+    }
+
+    using Op = OpCode;
+    size_t index = range.begin;
+    while (index < range.end) {
+        auto& header = instructions[index].ins;
+        auto& out = decoded[index];
+        auto length = InstructionUnit::InstructionLength(instructions, index);
+        if (length == 0) {
+            index++;
+            continue;
+        }
+
+        out.op = DecodedOp(header.code);
+        out.data = header.data;
+        out.optype[0] = header.optype[0];
+        out.optype[1] = header.optype[1];
+        out.length = length;
+
+        switch (header.code) {
+            case Op::LOADCONST:
+            case Op::STORECONST:
+                out.operand = instructions[index + 1].data;
+                break;
+            case Op::CALL:
+            case Op::GETGLOBAL:
+                out.operand = VMValue((void*) &instructions[index + 1]);
+                break;
+            case Op::JMP:
+            case Op::JMPIF: {
+                // Jumps leaving the program land on the trailing HALT, like running off the end does.
+                auto target = int64_t(index) + header.data;
+                if (target < 0 || target >= int64_t(instructions.size())) {
+                    target = instructions.size();
+                }
+                out.data = int32_t(target - int64_t(index));
+                break;
+            }
+            default:
+                break;
+        }
+
+        index += out.length;
+    }
+
+    bool afterIndirect = false;
+    for (size_t i = range.begin; i < range.end; i += decoded[i].length) {
+        auto& ins = decoded[i];
+        ins.op = Quicken(ins);
+        auto checked = !range.verified || (afterIndirect && ins.op == DecodedOp::RET);
+        afterIndirect = ins.op == DecodedOp::CALLINDIRECT;
+
+        auto& link = links[i];
+        if (ins.op == DecodedOp::CALL && link.kind == LinkedSymbol::Kind::UNIT) {
+            // A verified callee needs at most `aux` slots, checked once at the call.
+            auto* callee = FindUnit(link.target);
+            ins.op = link.tail ? DecodedOp::TAILCALL_DIRECT : DecodedOp::CALL_DIRECT;
+            ins.operand = VMValue(int64_t(link.target));
+            ins.aux = callee && callee->verified ? callee->maxStack : 0;
+        }
+        else if (ins.op == DecodedOp::CALL && link.kind == LinkedSymbol::Kind::BUILTIN) {
+            ins.op = DecodedOp::CALL_BUILTIN;
+            ins.operand = VMValue(int64_t(link.target));
+        }
+        else if (ins.op == DecodedOp::GETGLOBAL && link.kind == LinkedSymbol::Kind::UNIT) {
+            ins.op = DecodedOp::LOADCONST;
+            ins.operand = VMValue((void*) &instructions[link.target]);
+        }
+        else if ((ins.op == DecodedOp::JMP || ins.op == DecodedOp::JMPIF) && ins.data <= 0) {
+            ins.op = ins.op == DecodedOp::JMP ? DecodedOp::JMP_COUNTED : DecodedOp::JMPIF_COUNTED;
+        }
+        ins.handler = GetThreadedHandler(ins.op, checked);
+    }
+}
\ No newline at end of file
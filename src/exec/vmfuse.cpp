@@ -0,0 +1,107 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+
+namespace {
+    struct FusionRule {
+        DecodedOp sequence[4];
+        size_t size;
+        DecodedOp fused;
+    };
+
+    // Picked from --profile-pairs runs over the examples: load -> loadconst is by far the most
+    // frequent pair, followed by loadconst -> comparison or arithmetic, comparison -> jmpif and
+    // store -> load. Longer rules come first so they win over their prefixes.
+    #define RVM_COMPARISON_RULES(cmp) \
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::cmp##_I64, DecodedOp::JMPIF}, 4, DecodedOp::JMPIF_LOCAL_CONST_##cmp##_I64}, \
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::cmp##_I64}, 3, DecodedOp::LOCAL_CONST_##cmp##_I64}, \
+        {{DecodedOp::cmp##_I64, DecodedOp::JMPIF}, 2, DecodedOp::JMPIF_##cmp##_I64},
+
+    const FusionRule rules[] = {
+        RVM_COMPARISON_RULES(GT)
+        RVM_COMPARISON_RULES(GEQ)
+        RVM_COMPARISON_RULES(LT)
+        RVM_COMPARISON_RULES(LEQ)
+        RVM_COMPARISON_RULES(EQ)
+        RVM_COMPARISON_RULES(NOTEQ)
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::ADD_I64, DecodedOp::STORE}, 4, DecodedOp::STORE_LOCAL_CONST_ADD_I64},
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::SUB_I64, DecodedOp::STORE}, 4, DecodedOp::STORE_LOCAL_CONST_SUB_I64},
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::ADD_I64}, 3, DecodedOp::LOCAL_CONST_ADD_I64},
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::SUB_I64}, 3, DecodedOp::LOCAL_CONST_SUB_I64},
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST, DecodedOp::MUL_I64}, 3, DecodedOp::LOCAL_CONST_MUL_I64},
+        {{DecodedOp::LOAD, DecodedOp::LOADCONST}, 2, DecodedOp::LOAD_LOADCONST},
+        {{DecodedOp::LOAD, DecodedOp::LOAD}, 2, DecodedOp::LOAD_LOAD},
+        {{DecodedOp::STORE, DecodedOp::LOAD}, 2, DecodedOp::STORE_LOAD},
+    };
+
+    #undef RVM_COMPARISON_RULES
+}
+
+// Replaces the head of each matched sequence with its superinstruction. A sequence is only
+// fused when no jump lands inside it past the head, so control can only enter it there.
+void VirtualMachine::FuseUnit(const GlobalUnitInfo& range) {
+    std::vector<bool> targets(range.end - range.begin, false);
+    for (size_t i = range.begin; i < range.end; i += decoded[i].length) {
+        auto& ins = decoded[i];
+        if (ins.op != DecodedOp::JMP && ins.op != DecodedOp::JMPIF) continue;
+
+        auto target = int64_t(i) + ins.data;
+        if (target >= int64_t(range.begin) && target < int64_t(range.end)) targets[target - range.begin] = true;
+    }
+
+    // First rule matching at `start`, with the index just past the sequence it covers.
+    auto matchAt = [&] (size_t start, size_t& end) -> const FusionRule* {
+        for (auto& rule : rules) {
+            end = start;
+            size_t k = 0;
+            while (k < rule.size && end < range.end && decoded[end].op == rule.sequence[k]) {
+                if (k > 0 && targets[end - range.begin]) break;
+                end += decoded[end].length;
+                k++;
+            }
+            if (k == rule.size) return &rule;
+        }
+        return nullptr;
+    };
+
+    size_t i = range.begin;
+    while (i < range.end) {
+        size_t end = i;
+        size_t nextEnd = i;
+        auto* match = matchAt(i, end);
+        auto* next = match ? matchAt(i + decoded[i].length, nextEnd) : nullptr;
+
+        // Leave the head alone when the sequence starting right after it is longer, as in
+        // store; load; loadconst; add; store.
+        if (!match || (next && next->size > match->size)) {
+            i += decoded[i].length;
+            continue;
+        }
+
+        auto fused = decoded[i];
+        fused.op = match->fused;
+        fused.length = end - i;
+        for (size_t p = i; p < end; p += decoded[p].length) {
+            auto& part = decoded[p];
+            switch (part.op) {
+                case DecodedOp::LOADCONST:
+                    fused.operand = part.operand;
+                    break;
+                case DecodedOp::JMPIF:
+                    fused.aux = int32_t(int64_t(p) + part.data - int64_t(i));
+                    break;
+                case DecodedOp::LOAD:
+                case DecodedOp::STORE:
+                    if (p != i) fused.aux = part.data;
+                    break;
+                default:
+                    break;
+            }
+        }
+        fused.handler = GetThreadedHandler(fused.op, !range.verified);
+        decoded[i] = fused;
+        i = end;
+    }
+}
\ No newline at end of file
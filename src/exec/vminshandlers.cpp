@@ -1,31 +1,36 @@
 #include "instruction.hpp"
 #include "vmachine.hpp"
+#include "scheduler.hpp"
 #include "../log/log.hpp"
 #include <cstdint>
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 
 using rvm::exec::VirtualMachine;
+using rvm::exec::ExecutionContext;
+using rvm::exec::SharedHeap;
 
-void VirtualMachine::hLoad(int32_t index) {
+void ExecutionContext::hLoad(int32_t index) {
     PushValue(GetLocalAtIndex(index));
 }
 
-void VirtualMachine::hStore(int32_t index) {
+void ExecutionContext::hStore(int32_t index) {
     auto data = PopValue();
     GetLocalAtIndex(index) = data;
 }
 
-void VirtualMachine::hLoadConst() {
+void ExecutionContext::hLoadConst() {
     auto data = FetchIns().data;
     PushValue(data);
 }
 
-void VirtualMachine::hStoreConst(int32_t index) {
+void ExecutionContext::hStoreConst(int32_t index) {
     auto data = FetchIns().data;
     GetLocalAtIndex(index) = data;
 }
 
-void VirtualMachine::hConvert(DataType from, DataType to) {
+void ExecutionContext::hConvert(DataType from, DataType to) {
     if (from == to || to == DataType::PTR) return;
 
     auto data = PopValue();
@@ -187,7 +192,7 @@ void VirtualMachine::hConvert(DataType from, DataType to) {
     }
 }
 
-void VirtualMachine::hAdd(DataType t) {
+void ExecutionContext::hAdd(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -219,7 +224,7 @@ void VirtualMachine::hAdd(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hSub(DataType t) {
+void ExecutionContext::hSub(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -251,7 +256,7 @@ void VirtualMachine::hSub(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hMul(DataType t) {
+void ExecutionContext::hMul(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -283,7 +288,7 @@ void VirtualMachine::hMul(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hDiv(DataType t) {
+void ExecutionContext::hDiv(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -315,7 +320,7 @@ void VirtualMachine::hDiv(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hLand() {
+void ExecutionContext::hLand() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -324,7 +329,7 @@ void VirtualMachine::hLand() {
     PushValue(result);
 }
 
-void VirtualMachine::hLor() {
+void ExecutionContext::hLor() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -333,14 +338,14 @@ void VirtualMachine::hLor() {
     PushValue(result);
 }
 
-void VirtualMachine::hLnot() {
+void ExecutionContext::hLnot() {
     auto data = PopValue();
     VMValue result;
     result.i8 = !data.i8;
     PushValue(result);
 }
 
-void VirtualMachine::hGt(DataType t) {
+void ExecutionContext::hGt(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -372,7 +377,7 @@ void VirtualMachine::hGt(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hGeq(DataType t) {
+void ExecutionContext::hGeq(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -404,7 +409,7 @@ void VirtualMachine::hGeq(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hLt(DataType t) {
+void ExecutionContext::hLt(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -436,7 +441,7 @@ void VirtualMachine::hLt(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hLeq(DataType t) {
+void ExecutionContext::hLeq(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -468,7 +473,7 @@ void VirtualMachine::hLeq(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hEq(DataType t) {
+void ExecutionContext::hEq(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -500,7 +505,7 @@ void VirtualMachine::hEq(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hNotEq(DataType t) {
+void ExecutionContext::hNotEq(DataType t) {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -532,7 +537,7 @@ void VirtualMachine::hNotEq(DataType t) {
     PushValue(result);
 }
 
-void VirtualMachine::hBand() {
+void ExecutionContext::hBand() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -541,7 +546,7 @@ void VirtualMachine::hBand() {
     PushValue(result);
 }
 
-void VirtualMachine::hBor() {
+void ExecutionContext::hBor() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -550,7 +555,7 @@ void VirtualMachine::hBor() {
     PushValue(result);
 }
 
-void VirtualMachine::hBxor() {
+void ExecutionContext::hBxor() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -559,12 +564,12 @@ void VirtualMachine::hBxor() {
     PushValue(result);
 }
 
-void VirtualMachine::hBnot() {
+void ExecutionContext::hBnot() {
     auto data = PopValue();
     PushValue(VMValue(~data.i64));
 }
 
-void VirtualMachine::hLshift() {
+void ExecutionContext::hLshift() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -573,7 +578,7 @@ void VirtualMachine::hLshift() {
     PushValue(result);
 }
 
-void VirtualMachine::hRshift() {
+void ExecutionContext::hRshift() {
     auto rhs = PopValue();
     auto lhs = PopValue();
 
@@ -582,93 +587,315 @@ void VirtualMachine::hRshift() {
     PushValue(result);
 }
 
-void VirtualMachine::hJmp(int32_t offset) {
+void ExecutionContext::hJmp(int32_t offset) {
     insIndex += offset - 1;
 }
 
-void VirtualMachine::hJmpIf(int32_t offset) {
+void ExecutionContext::hJmpIf(int32_t offset) {
     auto flag = PopValue();
     if (flag.i8) insIndex += offset - 1;
 }
 
-void VirtualMachine::hCreateLocals(int32_t number) {
+void ExecutionContext::hCreateLocals(int32_t number) {
+    if (number <= 0) return;
+    if (stackIndex + number >= stackSize) {
+        throw VirtualMachineException("Stack overflow error.");
+    }
+
+    // New locals go right after the existing ones, so operands already pushed move up.
+    for (int64_t i = stackIndex; i >= int64_t(valuesFrameBaseIndex); i--) {
+        valueStack[i + number] = valueStack[i];
+    }
     for (int i = 0; i < number; i++) {
-        locals.emplace_back();
+        valueStack[valuesFrameBaseIndex + i] = VMValue();
     }
+    valuesFrameBaseIndex += number;
+    stackIndex += number;
 }
 
-void VirtualMachine::hCall(int32_t argnum) {
-    auto name = std::string(ConsumeStringViewFromIns());
+void ExecutionContext::hCall(int32_t argnum) {
+    auto callIndex = insIndex - 1;
+    auto& link = vm.links[callIndex];
+    if (link.kind == VirtualMachine::LinkedSymbol::Kind::NONE) {
+        CallByName(ConsumeStringViewFromIns(), argnum, callIndex);
+        return;
+    }
 
-    if (builtInFunctions.contains(name)) {
-        builtInFunctions.at(name)(argnum);
+    insIndex += link.length - 1;
+    if (link.kind == VirtualMachine::LinkedSymbol::Kind::BUILTIN) {
+        CallBuiltIn(link.target, argnum, callIndex);
         return;
     }
 
-    returnStack.push(insIndex);
-    frameIndexStack.push(localFrameBaseIndex);
-    localFrameBaseIndex = locals.size();
+    if (link.tail) ReplaceCallFrame(argnum);
+    else PushCallFrame(argnum);
+    insIndex = link.target;
+    if (vm.lazyLoading) vm.LoadUnitAt(insIndex);
+}
 
-    for (int i = 0; i < argnum; i++) {
-        locals.push_back(PopValue());
+void ExecutionContext::CallByName(std::string_view name, int32_t argnum, size_t callIndex) {
+    auto id = vm.symbols.Find(name);
+    if (id != NoSymbol && vm.bindings[id].builtIn != VirtualMachine::SymbolBinding::None) {
+        CallBuiltIn(vm.bindings[id].builtIn, argnum, callIndex);
+        return;
     }
 
-    valueIndexStack.push(stackIndex);
-    valuesFrameBaseIndex = stackIndex;
+    auto target = vm.UnitNamed(name);
+    PushCallFrame(argnum);
+    insIndex = target;
+    if (vm.lazyLoading) vm.LoadUnitAt(insIndex);
+}
+
+void ExecutionContext::CallBuiltIn(uint32_t index, int32_t argnum, size_t callIndex) {
+    vm.builtInFunctions[index].function(*this, argnum);
+    if (!waiting) return;
+    yielded = true;
+    insIndex = callIndex;
+}
+
+bool ExecutionContext::RetryCall(WaitQueue& queue, uint64_t epoch) {
+    if (!scheduler) return false;
+    waiting = &queue;
+    waitEpoch = epoch;
+    return true;
+}
+
+void ExecutionContext::Wake(WaitQueue& queue) {
+    if (scheduler) scheduler->Wake(queue);
+}
+
+void ExecutionContext::PushCallFrame(int32_t argnum) {
+    argnum = std::max(argnum, 0);
+    auto base = stackIndex + 1 - argnum;
+    if (base < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
+    }
+    if (frames.size() >= maxFrames) {
+        throw VirtualMachineException("Call stack overflow error.");
+    }
 
-    insIndex = globalDataMap.at(name) - &instructions[0];
+    // The arguments become the callee locals in place, first argument (top of the stack) as local 0.
+    std::reverse(&valueStack[base], &valueStack[stackIndex + 1]);
+    frames.push_back({insIndex, localFrameBaseIndex, valuesFrameBaseIndex});
+    localFrameBaseIndex = base;
+    valuesFrameBaseIndex = stackIndex + 1;
 }
 
-void VirtualMachine::hRet(int32_t num) {
-    if (num > 16) {
-        rvm::log::LogError("Attempted to return more than 16 values.");
+// Reuses the current frame for a call whose results are returned unchanged, moving the
+// arguments down to the frame base as the new locals.
+void ExecutionContext::ReplaceCallFrame(int32_t argnum) {
+    argnum = std::max(argnum, 0);
+    auto first = stackIndex + 1 - argnum;
+    if (first < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
     }
-    if (returnStack.empty()) {
+
+    std::reverse(&valueStack[first], &valueStack[stackIndex + 1]);
+    std::copy(&valueStack[first], &valueStack[stackIndex + 1], &valueStack[localFrameBaseIndex]);
+    stackIndex = localFrameBaseIndex + argnum - 1;
+    valuesFrameBaseIndex = stackIndex + 1;
+}
+
+// A call is in tail position when the next instruction returns exactly the values the
+// callee returns. Every `ret` of the callee has to agree on that count, which is negative
+// otherwise, and a verified callee must also take the arguments it was verified with.
+bool VirtualMachine::IsTailCall(size_t next, size_t target, int32_t argnum) const {
+    if (next >= instructions.size() || instructions[next].ins.code != OpCode::RET) return false;
+
+    auto* callee = FindUnit(target);
+    return callee && callee->code && callee->begin == target
+        && (!callee->verified || callee->args == std::max(argnum, 0))
+        && callee->returns == std::max(instructions[next].ins.data, 0);
+}
+
+void ExecutionContext::hRet(int32_t num) {
+    if (frames.empty()) {
+        returned = std::max(num, 0);
         running = false;
         return;
     }
-    auto retLoc = returnStack.top();
-    returnStack.pop();
-    
-    auto previousBase = frameIndexStack.top();
-    frameIndexStack.pop();
-    locals.erase(locals.begin() + previousBase + 1, locals.end());
-    localFrameBaseIndex = previousBase;
 
-    std::array<VMValue, 16> retvals;
+    num = std::max(num, 0);
+    auto first = stackIndex + 1 - num;
+    if (first < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
+    }
 
     for (int i = 0; i < num; i++) {
-        retvals[i] = PopValue();
+        valueStack[localFrameBaseIndex + i] = valueStack[first + i];
     }
+    stackIndex = localFrameBaseIndex + num - 1;
 
-    auto previousValueBase = valueIndexStack.top();
-    valueIndexStack.pop();
-    valuesFrameBaseIndex = previousValueBase;
+    auto& frame = frames.back();
+    insIndex = frame.returnIndex;
+    localFrameBaseIndex = frame.localBase;
+    valuesFrameBaseIndex = frame.valueBase;
+    frames.pop_back();
+}
+
+void ExecutionContext::hCallIndirect(int32_t argnum) {
+    argnum = std::max(argnum, 0);
+    auto pointerIndex = stackIndex - argnum;
+    if (pointerIndex < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
+    }
 
-    for (int i = num - 1; i >= 0; i--) {
-        PushValue(retvals[i]);
+    auto target = (InstructionUnit*) valueStack[pointerIndex].ptr;
+    for (auto i = pointerIndex; i < stackIndex; i++) {
+        valueStack[i] = valueStack[i + 1];
     }
+    stackIndex--;
 
-    insIndex = retLoc;
+    auto targetIndex = size_t(target - &vm.instructions[0]);
+    if (vm.lazyLoading) vm.LoadUnitAt(targetIndex);
+    if (vm.IsTailCall(insIndex, targetIndex, argnum)) ReplaceCallFrame(argnum);
+    else PushCallFrame(argnum);
+    insIndex = targetIndex;
 }
 
-void VirtualMachine::hCallIndirect(int32_t argnum) {
-    returnStack.push(insIndex);
-    frameIndexStack.push(localFrameBaseIndex);
-    localFrameBaseIndex = locals.size();
+void ExecutionContext::hGetGlobal() {
+    auto& link = vm.links[insIndex - 1];
+    if (link.kind == VirtualMachine::LinkedSymbol::Kind::UNIT) {
+        insIndex += link.length - 1;
+        PushValue(VMValue((void*) &vm.instructions[link.target]));
+        return;
+    }
+
+    auto target = vm.UnitNamed(ConsumeStringViewFromIns());
+    PushValue(VMValue((void*) &vm.instructions[target]));
+}
 
-    for (int i = 0; i < argnum; i++) {
-        locals.push_back(PopValue());
+void ExecutionContext::hSpawn(int32_t argnum) {
+    if (!scheduler) throw VirtualMachineException("Fiber instruction outside of a scheduler.");
+    argnum = std::max(argnum, 0);
+    auto pointerIndex = stackIndex - argnum;
+    if (pointerIndex < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
     }
 
-    valueIndexStack.push(stackIndex);
-    valuesFrameBaseIndex = stackIndex;
+    auto target = (InstructionUnit*) valueStack[pointerIndex].ptr;
+    auto handle = scheduler->Spawn(size_t(target - &vm.instructions[0]), {&valueStack[pointerIndex + 1], size_t(argnum)});
+    stackIndex = pointerIndex - 1;
+    PushValue(VMValue(handle));
+}
+
+void ExecutionContext::hYield() {
+    if (!scheduler) throw VirtualMachineException("Fiber instruction outside of a scheduler.");
+    yielded = true;
+}
+
+bool ExecutionContext::hJoin(int32_t count) {
+    if (!scheduler) throw VirtualMachineException("Fiber instruction outside of a scheduler.");
+    if (stackIndex < int64_t(valuesFrameBaseIndex)) {
+        throw VirtualMachineException("Value stack operation fell outside of function frame.");
+    }
+
+    auto handle = valueStack[stackIndex].i64;
+    auto& joined = scheduler->Find(handle);
+    if (&joined == fiber) throw VirtualMachineException("Fiber joins itself.");
+    std::vector<VMValue> results;
+    if (!scheduler->Join(joined, handle, results)) {
+        joining = &joined;
+        joiningHandle = handle;
+        return false;
+    }
+
+    count = std::max(count, 0);
+    if (size_t(count) > results.size()) {
+        throw VirtualMachineException("Joined fiber returned fewer values than expected.");
+    }
+    PopValue();
+    for (int i = 0; i < count; i++) PushValue(results[i]);
+    return true;
+}
+
+namespace {
+    std::memory_order AtomicOrder(rvm::exec::OpCode code, int32_t order) {
+        if (!rvm::exec::AllowsMemoryOrder(code, order)) {
+            throw rvm::exec::VirtualMachineException("Bad memory order for atomic instruction.");
+        }
+        constexpr std::memory_order orders[] = {
+            std::memory_order_seq_cst, std::memory_order_relaxed, std::memory_order_acquire,
+            std::memory_order_release, std::memory_order_acq_rel
+        };
+        return orders[order];
+    }
+
+    // Calls `f` with a value of the integer type that atomic instructions typed `t` work on.
+    template <typename F>
+    void WithAtomicType(rvm::exec::DataType t, F f) {
+        using enum rvm::exec::DataType;
+        switch (t) {
+            case I8:
+                return f(int8_t());
+            case I16:
+                return f(int16_t());
+            case I32:
+                return f(int32_t());
+            case I64:
+            case PTR:
+                return f(int64_t());
+            default:
+                throw rvm::exec::VirtualMachineException("Atomic instruction on a non-integer type.");
+        }
+    }
+
+    template <typename T>
+    std::atomic_ref<T> AtomicAt(const SharedHeap& heap, rvm::exec::VMValue pointer) {
+        if (!heap.Contains(pointer.ptr, sizeof(T))) {
+            throw rvm::exec::VirtualMachineException("Atomic access outside of the shared heap.");
+        }
+        if (uintptr_t(pointer.ptr) % std::atomic_ref<T>::required_alignment != 0) {
+            throw rvm::exec::VirtualMachineException("Misaligned atomic access.");
+        }
+        return std::atomic_ref<T>(*(T*) pointer.ptr);
+    }
+}
+
+void ExecutionContext::hAtomicLoad(DataType t, int32_t order) {
+    auto memoryOrder = AtomicOrder(OpCode::ATOMICLOAD, order);
+    auto pointer = PopValue();
+    WithAtomicType(t, [&] <typename T> (T) {
+        VMValue result;
+        result.As<T>() = AtomicAt<T>(*vm.heap, pointer).load(memoryOrder);
+        PushValue(result);
+    });
+}
+
+void ExecutionContext::hAtomicStore(DataType t, int32_t order) {
+    auto memoryOrder = AtomicOrder(OpCode::ATOMICSTORE, order);
+    auto value = PopValue();
+    auto pointer = PopValue();
+    WithAtomicType(t, [&] <typename T> (T) {
+        AtomicAt<T>(*vm.heap, pointer).store(value.As<T>(), memoryOrder);
+    });
+}
+
+void ExecutionContext::hAtomicAdd(DataType t, int32_t order) {
+    auto memoryOrder = AtomicOrder(OpCode::ATOMICADD, order);
+    auto value = PopValue();
+    auto pointer = PopValue();
+    WithAtomicType(t, [&] <typename T> (T) {
+        VMValue result;
+        result.As<T>() = AtomicAt<T>(*vm.heap, pointer).fetch_add(value.As<T>(), memoryOrder);
+        PushValue(result);
+    });
+}
 
-    insIndex = (InstructionUnit*) PopValue().ptr - &instructions[0];
+void ExecutionContext::hAtomicCas(DataType t, int32_t order) {
+    auto memoryOrder = AtomicOrder(OpCode::ATOMICCAS, order);
+    auto desired = PopValue();
+    auto expected = PopValue();
+    auto pointer = PopValue();
+    WithAtomicType(t, [&] <typename T> (T) {
+        // Pushes the value found, which equals `expected` exactly when it was replaced.
+        VMValue result;
+        result.As<T>() = expected.As<T>();
+        AtomicAt<T>(*vm.heap, pointer).compare_exchange_strong(result.As<T>(), desired.As<T>(), memoryOrder);
+        PushValue(result);
+    });
 }
 
-void VirtualMachine::hGetGlobal() {
-    auto name = std::string(ConsumeStringViewFromIns());
-    auto val = globalDataMap.at(name);
-    PushValue(VMValue((void*) val));
+void ExecutionContext::hFence(int32_t order) {
+    std::atomic_thread_fence(AtomicOrder(OpCode::FENCE, order));
 }
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include "x64.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <string>
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+using namespace rvm::exec::x64;
+using namespace std::literals;
+
+#if RVM_JIT
+namespace {
+    bool InRange(DecodedOp op, DecodedOp first, DecodedOp last) {
+        return op >= first && op <= last;
+    }
+
+    // Quickened ops come in runs of I8, I16, I32, I64, F32, F64 (and PTR for comparisons).
+    int TypeIndex(DecodedOp op, DecodedOp first) {
+        return (int(op) - int(first)) % 6;
+    }
+
+    int Bytes(int typeIndex) {
+        const int bytes[] = {1, 2, 4, 8};
+        return typeIndex < 4 ? bytes[typeIndex] : 8;
+    }
+
+    constexpr int F32 = 4;
+    constexpr int F64 = 5;
+
+    enum class Compare {
+        GT,
+        GEQ,
+        LT,
+        LEQ,
+        EQ,
+        NOTEQ
+    };
+
+    Condition IntegerCondition(Compare c, bool isSigned) {
+        switch (c) {
+            case Compare::GT: return isSigned ? Condition::G : Condition::A;
+            case Compare::GEQ: return isSigned ? Condition::GE : Condition::AE;
+            case Compare::LT: return isSigned ? Condition::L : Condition::B;
+            case Compare::LEQ: return isSigned ? Condition::LE : Condition::BE;
+            case Compare::EQ: return Condition::E;
+            default: return Condition::NE;
+        }
+    }
+}
+#endif
+
+// Baseline template JIT: every instruction of a verified function is replaced by a fixed
+// snippet of machine code working on the same value slots the interpreter uses, at the
+// fp-relative positions the verifier assigned. Calls, returns, integer division and
+// everything else without a template return to the interpreter, which runs that one
+// instruction and re-enters native code at the next one through a JIT_ENTER instruction.
+// Native code never calls out, so it needs no stack frame and no unwind information.
+bool VirtualMachine::CompileUnit(const GlobalUnitInfo& range) {
+#if RVM_JIT
+    auto begin = range.begin;
+    auto end = range.end;
+
+    auto compiles = [&] (DecodedOp op) {
+        switch (op) {
+            case DecodedOp::NOP:
+            case DecodedOp::CONVERT_DROP:
+            case DecodedOp::LOAD:
+            case DecodedOp::STORE:
+            case DecodedOp::LOADCONST:
+            case DecodedOp::STORECONST:
+            case DecodedOp::LAND:
+            case DecodedOp::LOR:
+            case DecodedOp::LNOT:
+            case DecodedOp::BAND:
+            case DecodedOp::BOR:
+            case DecodedOp::BXOR:
+            case DecodedOp::BNOT:
+            case DecodedOp::LSHIFT:
+            case DecodedOp::RSHIFT:
+            case DecodedOp::JMP:
+            case DecodedOp::JMPIF:
+                return true;
+            default:
+                break;
+        }
+        if (InRange(op, DecodedOp::ADD_I8, DecodedOp::MUL_F64)) return TypeIndex(op, DecodedOp::ADD_I8) != F32;
+        if (InRange(op, DecodedOp::DIV_I8, DecodedOp::DIV_F64)) return op == DecodedOp::DIV_F64;
+        if (InRange(op, DecodedOp::GT_I8, DecodedOp::NOTEQ_PTR)) {
+            return (int(op) - int(DecodedOp::GT_I8)) % 7 != F32;
+        }
+        if (InRange(op, DecodedOp::CONVERT_I8_I8, DecodedOp::CONVERT_F64_F64)) {
+            auto index = int(op) - int(DecodedOp::CONVERT_I8_I8);
+            return index / 6 != F32 && index % 6 != F32;
+        }
+        return false;
+    };
+
+    std::vector<size_t> labels(end - begin, 0);
+    std::vector<std::pair<size_t, size_t>> jumps;
+    Assembler a;
+    size_t compiled = 0;
+
+    for (size_t i = begin; i < end; i += decoded[i].length) {
+        auto& ins = decoded[i];
+        labels[i - begin] = a.Size();
+        if (stackDepths[i] < 0) continue;
+
+        auto locals = localCounts[i];
+        auto depth = stackDepths[i];
+        auto top = locals + depth - 1;
+        auto op = ins.op;
+        auto next = i + ins.length;
+
+        if (!compiles(op)) {
+            a.Return(uint32_t(i));
+            continue;
+        }
+        compiled++;
+
+        switch (op) {
+            case DecodedOp::NOP:
+            case DecodedOp::CONVERT_DROP:
+                continue;
+            case DecodedOp::LOAD:
+                a.LoadSlot(Reg::RAX, ins.data);
+                a.StoreSlot(top + 1, Reg::RAX);
+                continue;
+            case DecodedOp::STORE:
+                a.LoadSlot(Reg::RAX, top);
+                a.StoreSlot(ins.data, Reg::RAX);
+                continue;
+            case DecodedOp::LOADCONST:
+                a.LoadImmediate(Reg::RAX, ins.operand.i64);
+                a.StoreSlot(top + 1, Reg::RAX);
+                continue;
+            case DecodedOp::STORECONST:
+                a.LoadImmediate(Reg::RAX, ins.operand.i64);
+                a.StoreSlot(ins.data, Reg::RAX);
+                continue;
+            case DecodedOp::LAND:
+            case DecodedOp::LOR:
+                a.CompareSlotByte(top - 1, 0);
+                a.SetCondition(Condition::NE, Reg::RAX);
+                a.CompareSlotByte(top, 0);
+                a.SetCondition(Condition::NE, Reg::RCX);
+                a.Alu(op == DecodedOp::LAND ? AluOp::AND : AluOp::OR, Reg::RAX, Reg::RCX, false);
+                a.ZeroExtend(Reg::RAX, 1);
+                a.StoreSlot(top - 1, Reg::RAX);
+                continue;
+            case DecodedOp::LNOT:
+                a.CompareSlotByte(top, 0);
+                a.SetCondition(Condition::E, Reg::RAX);
+                a.ZeroExtend(Reg::RAX, 1);
+                a.StoreSlot(top, Reg::RAX);
+                continue;
+            case DecodedOp::BNOT:
+                a.LoadSlot(Reg::RAX, top);
+                a.Not(Reg::RAX);
+                a.StoreSlot(top, Reg::RAX);
+                continue;
+            case DecodedOp::BAND:
+            case DecodedOp::BOR:
+            case DecodedOp::BXOR:
+            case DecodedOp::LSHIFT:
+            case DecodedOp::RSHIFT:
+                a.LoadSlot(Reg::RAX, top - 1);
+                a.LoadSlot(Reg::RCX, top);
+                if (op == DecodedOp::BAND) a.Alu(AluOp::AND, Reg::RAX, Reg::RCX);
+                else if (op == DecodedOp::BOR) a.Alu(AluOp::OR, Reg::RAX, Reg::RCX);
+                else if (op == DecodedOp::BXOR) a.Alu(AluOp::XOR, Reg::RAX, Reg::RCX);
+                else if (op == DecodedOp::LSHIFT) a.ShiftLeft(Reg::RAX);
+                else a.ShiftRight(Reg::RAX);
+                a.StoreSlot(top - 1, Reg::RAX);
+                continue;
+            case DecodedOp::JMP:
+                jumps.push_back({a.Jump(), size_t(int64_t(i) + ins.data)});
+                continue;
+            case DecodedOp::JMPIF:
+                a.CompareSlotByte(top, 0);
+                jumps.push_back({a.JumpIf(Condition::NE), size_t(int64_t(i) + ins.data)});
+                continue;
+            default:
+                break;
+        }
+
+        if (InRange(op, DecodedOp::ADD_I8, DecodedOp::DIV_F64)) {
+            auto type = TypeIndex(op, DecodedOp::ADD_I8);
+            auto kind = (int(op) - int(DecodedOp::ADD_I8)) / 6;
+            if (type == F64) {
+                const SseOp ops[] = {SseOp::ADD, SseOp::SUB, SseOp::MUL, SseOp::DIV};
+                a.LoadSlot(Xmm::XMM0, top - 1);
+                a.LoadSlot(Xmm::XMM1, top);
+                a.Sse(ops[kind], Xmm::XMM0, Xmm::XMM1);
+                a.StoreSlot(top - 1, Xmm::XMM0);
+                continue;
+            }
+
+            // The low bytes of a 64 bit sum, difference or product do not depend on the
+            // bytes above them, so every width is computed in full and then truncated.
+            a.LoadSlot(Reg::RAX, top - 1);
+            a.LoadSlot(Reg::RCX, top);
+            if (kind == 0) a.Alu(AluOp::ADD, Reg::RAX, Reg::RCX);
+            else if (kind == 1) a.Alu(AluOp::SUB, Reg::RAX, Reg::RCX);
+            else a.Multiply(Reg::RAX, Reg::RCX);
+            a.ZeroExtend(Reg::RAX, Bytes(type));
+            a.StoreSlot(top - 1, Reg::RAX);
+            continue;
+        }
+
+        if (InRange(op, DecodedOp::GT_I8, DecodedOp::NOTEQ_PTR)) {
+            auto type = (int(op) - int(DecodedOp::GT_I8)) % 7;
+            auto compare = Compare((int(op) - int(DecodedOp::GT_I8)) / 7);
+
+            // A comparison consumed by the jmpif right after it branches on the flags. Only
+            // JMP and JMPIF jump inside native code, and the jmpif is no target of them.
+            bool branch = next < end && decoded[next].op == DecodedOp::JMPIF && type != F64;
+            for (size_t k = begin; branch && k < end; k += decoded[k].length) {
+                auto& other = decoded[k];
+                bool jump = other.op == DecodedOp::JMP || other.op == DecodedOp::JMPIF;
+                if (jump && int64_t(k) + other.data == int64_t(next)) branch = false;
+            }
+
+            Condition cc;
+            if (type == F64) {
+                // ucomisd reports unordered as below and equal, so a < b is tested as b > a
+                // and equality also has to check the parity flag.
+                auto swap = compare == Compare::LT || compare == Compare::LEQ;
+                a.LoadSlot(Xmm::XMM0, swap ? top : top - 1);
+                a.LoadSlot(Xmm::XMM1, swap ? top - 1 : top);
+                a.CompareF64(Xmm::XMM0, Xmm::XMM1);
+                if (compare == Compare::EQ || compare == Compare::NOTEQ) {
+                    auto equal = compare == Compare::EQ;
+                    a.SetCondition(equal ? Condition::E : Condition::NE, Reg::RAX);
+                    a.SetCondition(equal ? Condition::NP : Condition::P, Reg::RCX);
+                    a.Alu(equal ? AluOp::AND : AluOp::OR, Reg::RAX, Reg::RCX, false);
+                    a.ZeroExtend(Reg::RAX, 1);
+                    a.StoreSlot(top - 1, Reg::RAX);
+                    continue;
+                }
+                cc = compare == Compare::GT || compare == Compare::LT ? Condition::A : Condition::AE;
+            }
+            else {
+                a.LoadSlot(Reg::RAX, top - 1, Bytes(type));
+                a.LoadSlot(Reg::RCX, top, Bytes(type));
+                a.Alu(AluOp::CMP, Reg::RAX, Reg::RCX);
+                cc = IntegerCondition(compare, type != 6);
+            }
+
+            if (branch) {
+                jumps.push_back({a.JumpIf(cc), size_t(int64_t(next) + decoded[next].data)});
+                labels[next - begin] = a.Size();
+                i = next;
+                continue;
+            }
+            a.SetCondition(cc, Reg::RAX);
+            a.ZeroExtend(Reg::RAX, 1);
+            a.StoreSlot(top - 1, Reg::RAX);
+            continue;
+        }
+
+        // Conversions, with the result zero extended like the VMValue constructors do.
+        auto index = int(op) - int(DecodedOp::CONVERT_I8_I8);
+        auto from = index / 6;
+        auto to = index % 6;
+        if (from == F64) a.LoadSlot(Xmm::XMM0, top);
+        else a.LoadSlot(Reg::RAX, top, Bytes(from));
+
+        if (to == F64) {
+            if (from != F64) a.ConvertToF64(Xmm::XMM0, Reg::RAX);
+            a.StoreSlot(top, Xmm::XMM0);
+            continue;
+        }
+        if (from == F64) a.ConvertF64(Reg::RAX, Xmm::XMM0, to == 3);
+        a.ZeroExtend(Reg::RAX, Bytes(to));
+        a.StoreSlot(top, Reg::RAX);
+    }
+
+    if (compiled == 0) return false;
+    for (auto& [at, target] : jumps) a.Patch(at, labels[target - begin]);
+
+    ExecutableCode native(a.Code());
+    if (!native.Valid()) return false;
+
+    // Native code is entered at the start of the function and wherever the interpreter
+    // hands control back, which is right after an instruction it ran. Jump targets are
+    // entries too, so a function promoted while inside a loop continues natively.
+    std::vector<bool> targets(end - begin, false);
+    for (auto& jump : jumps) targets[jump.second - begin] = true;
+
+    bool entry = true;
+    for (size_t i = begin; i < end; i += decoded[i].length) {
+        auto& ins = decoded[i];
+        auto inlined = compiles(ins.op);
+        if (!inlined) ins.sp = localCounts[i] + std::max(stackDepths[i], 0);
+
+        if (inlined && (entry || targets[i - begin]) && stackDepths[i] >= 0) {
+            ins.op = DecodedOp::JIT_ENTER;
+            ins.operand.ptr = native.At(labels[i - begin]);
+            ins.handler = GetThreadedHandler(DecodedOp::JIT_ENTER, false);
+        }
+        entry = !inlined;
+    }
+
+    log::LogInfo("Compiled unit \""s + UnitName(range) + "\" to " + std::to_string(a.Size()) + " bytes of native code.");
+    nativeCode.push_back(std::move(native));
+    return true;
+#else
+    return false;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include "instruction.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+using namespace std::literals;
+
+namespace {
+    constexpr int32_t Addressed = -4;
+    constexpr int32_t Unscanned = -3;
+    constexpr int32_t NotSeen = -2;
+    constexpr int32_t Conflicting = -1;
+
+    void Merge(int32_t& current, int32_t value) {
+        if (current == Addressed) return;
+        if (current == NotSeen) current = value;
+        else if (current != value) current = Conflicting;
+    }
+}
+
+// Lazy loading only sets up the unit table. A unit is linked and verified once a unit calling
+// it is entered, so calls into it are known when its caller is decoded, and decoded once it is
+// entered itself. Verification then only knows about the call sites linked so far: a unit that
+// turns out to be called with another argument count is decoded again to run checked.
+void VirtualMachine::IndexUnits() {
+    log::LogInfo("Indexed "s + std::to_string(units.size()) + " units for lazy loading.");
+    // Zero links read as unlinked. Depths and locals only count for verified units, which the
+    // verifier fills in when it gets to them.
+    links = ZeroedVector<LinkedSymbol>(instructions.size());
+    stackDepths = ZeroedVector<int32_t>(instructions.size());
+    localCounts = ZeroedVector<int32_t>(instructions.size());
+    lazyArities.assign(units.size(), NotSeen);
+    lazyReturns.assign(units.size(), Unscanned);
+    for (auto& unit : units) {
+        unit.code = unit.verified = unit.linked = unit.loaded = false;
+    }
+}
+
+// Finds out whether a unit is code and how many values it returns, all its callers need to
+// know to be verified.
+void VirtualMachine::ScanUnit(size_t index) {
+    if (lazyReturns[index] != Unscanned) return;
+    lazyReturns[index] = NotSeen;
+
+    auto& unit = units[index];
+    size_t i = unit.begin;
+    while (i < unit.end) {
+        auto length = InstructionUnit::InstructionLength(instructions, i);
+        if (length == 0) break;
+        if (instructions[i].ins.code == OpCode::RET) Merge(lazyReturns[index], std::max(instructions[i].ins.data, 0));
+        i += length;
+    }
+    unit.code = i == unit.end;
+}
+
+void VirtualMachine::LinkLazily(size_t index) {
+    auto& unit = units[index];
+    if (unit.linked) return;
+    LinkUnit(unit);
+    ScanUnit(index);
+    if (!unit.code) return;
+
+    for (size_t i = unit.begin; i < unit.end; i += InstructionUnit::InstructionLength(instructions, i)) {
+        auto& link = links[i];
+        auto code = instructions[i].ins.code;
+        if ((code != OpCode::CALL && code != OpCode::GETGLOBAL) || link.kind != LinkedSymbol::Kind::UNIT) continue;
+
+        auto* callee = FindUnit(link.target);
+        if (!callee) continue;
+        auto c = size_t(callee - units.data());
+        ScanUnit(c);
+        if (!callee->code || callee->begin != link.target) continue;
+        if (code == OpCode::CALL) AddCallSite(c, instructions[i].ins.data);
+        else AddAddressUse(c);
+    }
+    unit.verified = VerifyUnit(unit, lazyArities, lazyReturns);
+}
+
+void VirtualMachine::AddCallSite(size_t callee, int32_t argnum) {
+    argnum = std::max(argnum, 0);
+    Merge(lazyArities[callee], argnum);
+
+    auto& unit = units[callee];
+    if (unit.verified && unit.args != argnum) Deoptimize(unit);
+}
+
+// The unit may now be called indirectly or spawned with any argument count.
+void VirtualMachine::AddAddressUse(size_t unit) {
+    lazyArities[unit] = Addressed;
+    if (units[unit].verified) Deoptimize(units[unit]);
+}
+
+// Decoded instructions keep their indices in every form, so the running frames of the unit
+// continue in the checked code from their return addresses.
+void VirtualMachine::Deoptimize(GlobalUnitInfo& unit) {
+    log::LogInfo("Unit \""s + UnitName(unit) + "\" may be called with another argument count, running it checked.");
+    unit.verified = false;
+    if (!unit.loaded || decoded.size() != instructions.size() + 1) return;
+
+    std::fill(hotCounts.begin() + unit.begin, hotCounts.begin() + unit.end, 0);
+    unit.promoted = false;
+    DecodeUnit(unit);
+}
+
+void VirtualMachine::LoadUnit(GlobalUnitInfo& unit) {
+    if (unit.loaded) return;
+    LinkLazily(&unit - units.data());
+    unit.loaded = true;
+
+    if (unit.code) {
+        for (size_t i = unit.begin; i < unit.end; i += InstructionUnit::InstructionLength(instructions, i)) {
+            auto& link = links[i];
+            auto* callee = link.kind == LinkedSymbol::Kind::UNIT ? FindUnit(link.target) : nullptr;
+            if (callee && instructions[i].ins.code == OpCode::CALL) LinkLazily(callee - units.data());
+        }
+        for (size_t i = unit.begin; i < unit.end; i += InstructionUnit::InstructionLength(instructions, i)) {
+            auto& link = links[i];
+            if (link.kind == LinkedSymbol::Kind::UNIT && instructions[i].ins.code == OpCode::CALL) {
+                link.tail = IsTailCall(i + link.length, link.target, instructions[i].ins.data);
+            }
+        }
+    }
+
+    if (decoded.size() == instructions.size() + 1) {
+        DecodeUnit(unit);
+        // Only the first instruction of a unit not loaded is stubbed, so the units that jumps
+        // lead into, which only unverified units have, are loaded along with this one.
+        for (size_t i = unit.begin; i < unit.end && !unit.verified; i += decoded[i].length) {
+            auto op = decoded[i].op;
+            auto target = i + decoded[i].data;
+            if ((op == DecodedOp::JMP_COUNTED || op == DecodedOp::JMPIF_COUNTED || op == DecodedOp::JMP || op == DecodedOp::JMPIF)
+                && (target < unit.begin || target >= unit.end)) {
+                LoadUnitAt(target);
+            }
+        }
+        if (tierThreshold == 0 || hotCounts[unit.begin] >= tierThreshold) PromoteUnit(unit);
+    }
+    log::LogInfo("Loaded unit \""s + UnitName(unit) + "\".");
+}
+
+void VirtualMachine::LoadUnitAt(size_t index) {
+    auto* unit = FindUnit(index);
+    if (unit && !unit->loaded) LoadUnit(units[unit - units.data()]);
+}
+
+// Calls, running off the unit before and indirect calls, after loading their target, all
+// enter a unit at its first instruction.
+void VirtualMachine::StubUnit(const GlobalUnitInfo& range) {
+    if (range.begin == range.end) return;
+    auto& stub = decoded[range.begin];
+    stub = DecodedInstruction();
+    stub.op = DecodedOp::LOAD_UNIT;
+    stub.handler = GetThreadedHandler(DecodedOp::LOAD_UNIT);
+}
+
+void VirtualMachine::SetLazyLoading(bool enabled) {
+    lazyLoading = enabled;
+}
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "vmachine.hpp"
+#include "instruction.hpp"
+#include "../log/log.hpp"
+#include <cstring>
+
+using rvm::exec::VirtualMachine;
+using namespace std::literals;
+
+namespace {
+    // Data units are not marked as such, so a unit is only linked if it reads as a valid instruction stream.
+    bool IsCodeUnit(std::span<const rvm::exec::InstructionUnit> code, size_t begin, size_t end) {
+        size_t index = begin;
+        while (index < end) {
+            auto length = rvm::exec::InstructionUnit::InstructionLength(code, index);
+            if (length == 0) return false;
+            index += length;
+        }
+        return index == end;
+    }
+
+    // Changes whenever the linker or the verifier would save other results for the same code.
+    constexpr int ResolutionsVersion = 3;
+
+    struct ResolutionHeader {
+        uint64_t units;
+        uint64_t instructions;
+        uint64_t links;
+    };
+
+    struct UnitResolution {
+        uint8_t code;
+        uint8_t verified;
+        int32_t args;
+        int32_t returns;
+        int32_t maxStack;
+    };
+
+    template <class T>
+    void Append(std::string& out, const T* data, size_t count) {
+        if (count) out.append((const char*) data, count * sizeof(T));
+    }
+
+    template <class T>
+    bool Take(std::string_view& in, T* data, size_t count) {
+        if (in.size() / sizeof(T) < count) return false;
+        if (count) std::memcpy((void*) data, in.data(), count * sizeof(T));
+        in.remove_prefix(count * sizeof(T));
+        return true;
+    }
+}
+
+void VirtualMachine::Link() {
+    log::LogInfo("Linking symbols.");
+    links.assign(instructions.size(), LinkedSymbol());
+    for (auto& range : units) LinkUnit(range);
+    log::LogInfo("Finished linking.");
+}
+
+void VirtualMachine::LinkUnit(GlobalUnitInfo& range) {
+    range.linked = true;
+    range.code = IsCodeUnit(instructions, range.begin, range.end);
+    if (!range.code) return;
+
+    size_t index = range.begin;
+    while (index < range.end) {
+        auto length = InstructionUnit::InstructionLength(instructions, index);
+        auto code = instructions[index].ins.code;
+
+        if (code == OpCode::CALL || code == OpCode::GETGLOBAL) {
+            auto name = std::string_view((const char*) &instructions[index + 1]);
+            auto id = symbols.Find(name);
+            auto& link = links[index];
+            link.length = length;
+
+            if (code == OpCode::CALL && id != NoSymbol && bindings[id].builtIn != SymbolBinding::None) {
+                link.kind = LinkedSymbol::Kind::BUILTIN;
+                link.target = bindings[id].builtIn;
+            }
+            else if (id != NoSymbol && bindings[id].unit != SymbolBinding::None) {
+                link.kind = LinkedSymbol::Kind::UNIT;
+                link.target = units[bindings[id].unit].begin;
+            }
+            else {
+                log::LogError("Unresolved symbol \""s + std::string(name) + "\" referenced in \"" + UnitName(range) + "\".");
+            }
+        }
+        index += length;
+    }
+}
+
+
+// Results are kept as they are in memory, with built-ins by their index, so they only fit
+// the code they were saved with and a VM that has the same ResolutionsKey. Flow states are only kept where instructions of verified units start.
+std::string VirtualMachine::SaveResolutions() const {
+    if (lazyLoading) return {};
+
+    std::string out;
+    ResolutionHeader header {units.size(), instructions.size(), 0};
+    for (auto& link : links) {
+        if (link.kind != LinkedSymbol::Kind::NONE) header.links++;
+    }
+    Append(out, &header, 1);
+    for (auto& unit : units) {
+        UnitResolution resolution {unit.code, unit.verified, unit.args, unit.returns, unit.maxStack};
+        Append(out, &resolution, 1);
+    }
+    for (uint64_t i = 0; i < links.size(); i++) {
+        if (links[i].kind == LinkedSymbol::Kind::NONE) continue;
+        Append(out, &i, 1);
+        Append(out, &links[i], 1);
+    }
+    for (auto& unit : units) {
+        if (!unit.verified) continue;
+        for (size_t i = unit.begin; i < unit.end; i += InstructionUnit::InstructionLength(instructions, i)) {
+            Append(out, &stackDepths[i], 1);
+            Append(out, &localCounts[i], 1);
+        }
+    }
+    return out;
+}
+
+std::string VirtualMachine::ResolutionsKey() const {
+    auto key = "resolutions "s + std::to_string(ResolutionsVersion) + " " + std::to_string(sizeof(LinkedSymbol))
+        + " " + std::to_string(sizeof(UnitResolution)) + " " + std::to_string(sizeof(void*));
+    for (auto& builtIn : builtInFunctions) {
+        key += " " + builtIn.name + "/" + std::to_string(builtIn.pops) + "/" + std::to_string(builtIn.pushes);
+    }
+    return key;
+}
+
+bool VirtualMachine::RestoreResolutions(std::string_view resolutions) {
+    ResolutionHeader header;
+    if (!Take(resolutions, &header, 1) || header.units != units.size() || header.instructions != instructions.size()) {
+        log::LogWarning("Saved resolutions do not match the loaded code.");
+        return false;
+    }
+
+    std::vector<UnitResolution> saved(units.size());
+    links = ZeroedVector<LinkedSymbol>(instructions.size());
+    stackDepths.assign(instructions.size(), -1);
+    localCounts = ZeroedVector<int32_t>(instructions.size());
+    bool valid = Take(resolutions, saved.data(), saved.size());
+    for (uint64_t n = 0; valid && n < header.links; n++) {
+        uint64_t i;
+        LinkedSymbol link;
+        valid = Take(resolutions, &i, 1) && Take(resolutions, &link, 1) && i < links.size()
+            && ((link.kind == LinkedSymbol::Kind::UNIT && link.target < instructions.size())
+            || (link.kind == LinkedSymbol::Kind::BUILTIN && link.target < builtInFunctions.size()));
+        if (valid) links[i] = link;
+    }
+    for (size_t u = 0; valid && u < units.size(); u++) {
+        if (!saved[u].verified) continue;
+        for (size_t i = units[u].begin; valid && i < units[u].end; i += InstructionUnit::InstructionLength(instructions, i)) {
+            valid = InstructionUnit::InstructionLength(instructions, i) != 0 && Take(resolutions, &stackDepths[i], 1) && Take(resolutions, &localCounts[i], 1);
+        }
+    }
+    if (!valid || !resolutions.empty()) {
+        log::LogWarning("Saved resolutions are malformed.");
+        return false;
+    }
+
+    for (size_t u = 0; u < units.size(); u++) {
+        auto& unit = units[u];
+        unit.linked = true;
+        unit.code = saved[u].code;
+        unit.verified = unit.code && saved[u].verified;
+        unit.args = saved[u].args;
+        unit.returns = saved[u].returns;
+        unit.maxStack = saved[u].maxStack;
+    }
+    log::LogInfo("Restored link and verification results.");
+    return true;
+}
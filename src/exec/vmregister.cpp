@@ -0,0 +1,385 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include <algorithm>
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+using rvm::exec::DecodedInstruction;
+using rvm::exec::VMValue;
+
+namespace {
+    // Where a value of the modeled operand stack currently is. Loads and constants are only
+    // materialized into their stack slot when something needs them there.
+    struct Operand {
+        enum class Kind : uint8_t {
+            SLOT,
+            LOCAL,
+            CONST
+        };
+
+        Kind kind = Kind::SLOT;
+        int32_t slot = 0;
+        VMValue value;
+    };
+
+    bool InRange(DecodedOp op, DecodedOp first, DecodedOp last) {
+        return op >= first && op <= last;
+    }
+
+    DecodedOp Offset(DecodedOp first, int index) {
+        return DecodedOp(int(first) + index);
+    }
+
+    // Calls, and the fiber instructions that may suspend, are left as they are and end a group.
+    bool IsCall(DecodedOp op) {
+        switch (op) {
+            case DecodedOp::CALL:
+            case DecodedOp::CALL_DIRECT:
+            case DecodedOp::TAILCALL_DIRECT:
+            case DecodedOp::CALL_BUILTIN:
+            case DecodedOp::CALLINDIRECT:
+            case DecodedOp::SPAWN:
+            case DecodedOp::YIELD:
+            case DecodedOp::JOIN:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    int UntypedIndex(DecodedOp op) {
+        switch (op) {
+            case DecodedOp::LAND: return 0;
+            case DecodedOp::LOR: return 1;
+            case DecodedOp::BAND: return 2;
+            case DecodedOp::BOR: return 3;
+            case DecodedOp::BXOR: return 4;
+            case DecodedOp::LSHIFT: return 5;
+            case DecodedOp::RSHIFT: return 6;
+            default: return -1;
+        }
+    }
+
+    bool IsBinary(DecodedOp op) {
+        return InRange(op, DecodedOp::ADD_I8, DecodedOp::NOTEQ_PTR) || UntypedIndex(op) >= 0;
+    }
+
+    DecodedOp RegisterForm(DecodedOp op, bool immediate) {
+        if (InRange(op, DecodedOp::ADD_I8, DecodedOp::NOTEQ_PTR)) {
+            return Offset(DecodedOp::R_ADD_I8, 2 * (int(op) - int(DecodedOp::ADD_I8)) + immediate);
+        }
+        return Offset(immediate ? DecodedOp::RI_LAND_I64 : DecodedOp::R_LAND_I64, UntypedIndex(op));
+    }
+
+    DecodedOp BranchForm(DecodedOp op, bool immediate) {
+        const DecodedOp compares[] = {
+            DecodedOp::GT_I64, DecodedOp::GEQ_I64, DecodedOp::LT_I64,
+            DecodedOp::LEQ_I64, DecodedOp::EQ_I64, DecodedOp::NOTEQ_I64
+        };
+        for (int i = 0; i < 6; i++) {
+            if (op == compares[i]) return Offset(immediate ? DecodedOp::BRI_GT_I64 : DecodedOp::BR_GT_I64, i);
+        }
+        return DecodedOp::UNKNOWN;
+    }
+}
+
+// Rewrites a verified function so operands are addressed as frame slots instead of going
+// through the operand stack. Stack slot k of an instruction with L locals is frame slot L + k,
+// which the verifier fixed for every instruction. Code is translated in groups starting at
+// jump targets and return points, each of which begins with every operand in its slot, and
+// a group's register instructions are packed at its start. Returns false, leaving the
+// decoded stream as it was, if a group needs more instructions than it has units.
+bool VirtualMachine::TranslateUnit(const GlobalUnitInfo& range) {
+    auto begin = range.begin;
+    auto end = range.end;
+    std::vector<DecodedInstruction> source(decoded.begin() + begin, decoded.begin() + end);
+    auto at = [&] (size_t i) -> const DecodedInstruction& { return source[i - begin]; };
+
+    std::vector<bool> starts(end - begin, false);
+    starts[0] = true;
+    for (size_t i = begin; i < end; i += at(i).length) {
+        auto& ins = at(i);
+        if (ins.op == DecodedOp::JMP || ins.op == DecodedOp::JMPIF) {
+            auto target = int64_t(i) + ins.data;
+            if (target >= int64_t(begin) && target < int64_t(end)) starts[target - begin] = true;
+        }
+        if (IsCall(ins.op) && i + ins.length < end) starts[i + ins.length - begin] = true;
+        // A join that has to wait, or a built-in function call that has to, runs again later
+        // from its own index.
+        if (IsCall(ins.op)) starts[i - begin] = true;
+    }
+
+    std::vector<Operand> stack;
+    std::vector<DecodedInstruction> out;
+    std::vector<int64_t> targets;
+    int32_t locals = 0;
+    int64_t producer = -1;
+
+    auto emit = [&] (DecodedOp op) -> DecodedInstruction& {
+        DecodedInstruction ins;
+        ins.op = op;
+        ins.sp = locals + int32_t(stack.size());
+        out.push_back(ins);
+        targets.push_back(-1);
+        producer = -1;
+        return out.back();
+    };
+    auto copy = [&] (size_t i, int64_t target = -1) {
+        out.push_back(at(i));
+        targets.push_back(target);
+        producer = -1;
+    };
+    auto materialize = [&] (size_t k) {
+        auto& operand = stack[k];
+        auto slot = locals + int32_t(k);
+        if (operand.kind == Operand::Kind::LOCAL) {
+            auto& ins = emit(DecodedOp::R_MOV);
+            ins.data = slot;
+            ins.aux = operand.slot;
+        }
+        else if (operand.kind == Operand::Kind::CONST) {
+            auto& ins = emit(DecodedOp::R_CONST);
+            ins.data = slot;
+            ins.operand = operand.value;
+        }
+        stack[k] = {Operand::Kind::SLOT, slot, VMValue()};
+    };
+    auto flush = [&] (size_t count) {
+        for (size_t k = 0; k < count; k++) materialize(k);
+    };
+    // Pending loads of a local have to be done before it is overwritten.
+    auto flushLocal = [&] (int32_t local) {
+        for (size_t k = 0; k < stack.size(); k++) {
+            if (stack[k].kind == Operand::Kind::LOCAL && stack[k].slot == local) materialize(k);
+        }
+    };
+    auto place = [&] (size_t groupStart, size_t groupEnd, bool live) {
+        if (live) flush(stack.size());
+        if (out.empty()) emit(DecodedOp::NOP);
+        if (out.size() > groupEnd - groupStart) return false;
+
+        for (size_t k = 0; k < out.size(); k++) {
+            auto p = groupStart + k;
+            auto ins = out[k];
+            ins.length = k + 1 == out.size() && ins.handler ? groupEnd - p : 1;
+            if (targets[k] >= 0) ins.data = int32_t(targets[k] - int64_t(p));
+            if (!ins.handler) ins.handler = GetThreadedHandler(ins.op, false);
+            decoded[p] = ins;
+        }
+        // Register forms fall through to the next entry, which skips the unused rest.
+        for (auto p = groupStart + out.size(); p < groupEnd; p++) {
+            decoded[p] = DecodedInstruction();
+            decoded[p].handler = GetThreadedHandler(DecodedOp::UNKNOWN);
+        }
+        if (out.size() < groupEnd - groupStart) {
+            auto& skip = decoded[groupStart + out.size()];
+            skip.op = DecodedOp::NOP;
+            skip.length = groupEnd - groupStart - out.size();
+            skip.handler = GetThreadedHandler(DecodedOp::NOP, false);
+        }
+        out.clear();
+        targets.clear();
+        return true;
+    };
+    auto fail = [&] {
+        std::copy(source.begin(), source.end(), decoded.begin() + begin);
+        return false;
+    };
+
+    size_t groupStart = begin;
+    bool afterIndirect = false;
+    while (groupStart < end) {
+        auto groupEnd = groupStart + 1;
+        while (groupEnd < end && !starts[groupEnd - begin]) groupEnd++;
+
+        auto live = stackDepths[groupStart] >= 0;
+        stack.clear();
+        // The ret after a callindirect runs whenever the call was not a tail call, with its
+        // checked handler, so it is kept even where no depth was recorded for it.
+        if (!live && afterIndirect && at(groupStart).op == DecodedOp::RET) copy(groupStart);
+        if (live) {
+            locals = localCounts[groupStart];
+            for (int32_t k = 0; k < stackDepths[groupStart]; k++) {
+                stack.push_back({Operand::Kind::SLOT, locals + k, VMValue()});
+            }
+        }
+
+        for (size_t i = groupStart; live && i < groupEnd; i += at(i).length) {
+            auto& ins = at(i);
+            locals = localCounts[i];
+            auto next = i + ins.length;
+
+            switch (ins.op) {
+                case DecodedOp::NOP:
+                    break;
+                case DecodedOp::LOAD:
+                    stack.push_back({Operand::Kind::LOCAL, ins.data, VMValue()});
+                    break;
+                case DecodedOp::LOADCONST:
+                    stack.push_back({Operand::Kind::CONST, 0, ins.operand});
+                    break;
+                case DecodedOp::STORE: {
+                    auto value = stack.back();
+                    stack.pop_back();
+                    if (value.kind == Operand::Kind::LOCAL && value.slot == ins.data) break;
+
+                    bool read = false;
+                    for (auto& operand : stack) {
+                        read = read || (operand.kind == Operand::Kind::LOCAL && operand.slot == ins.data);
+                    }
+                    // The instruction that computed the value can write the local directly.
+                    if (!read && value.kind == Operand::Kind::SLOT && producer >= 0 && producer == int64_t(out.size()) - 1
+                        && out.back().data == value.slot) {
+                        out.back().data = ins.data;
+                        out.back().sp = locals + int32_t(stack.size());
+                        producer = -1;
+                        break;
+                    }
+
+                    flushLocal(ins.data);
+                    auto& store = emit(value.kind == Operand::Kind::CONST ? DecodedOp::R_CONST : DecodedOp::R_MOV);
+                    store.data = ins.data;
+                    store.aux = value.slot;
+                    store.operand = value.value;
+                    break;
+                }
+                case DecodedOp::STORECONST: {
+                    flushLocal(ins.data);
+                    auto& store = emit(DecodedOp::R_CONST);
+                    store.data = ins.data;
+                    store.operand = ins.operand;
+                    break;
+                }
+                case DecodedOp::CONVERT_DROP:
+                    stack.pop_back();
+                    break;
+                case DecodedOp::LNOT:
+                case DecodedOp::BNOT: {
+                    auto k = stack.size() - 1;
+                    if (stack[k].kind == Operand::Kind::CONST) materialize(k);
+                    auto source = stack[k].slot;
+                    stack[k] = {Operand::Kind::SLOT, locals + int32_t(k), VMValue()};
+
+                    auto& unary = emit(ins.op == DecodedOp::LNOT ? DecodedOp::R_LNOT : DecodedOp::R_BNOT);
+                    unary.data = locals + int32_t(k);
+                    unary.aux = source;
+                    producer = int64_t(out.size()) - 1;
+                    break;
+                }
+                case DecodedOp::JMP:
+                    flush(stack.size());
+                    copy(i, int64_t(i) + ins.data);
+                    live = false;
+                    break;
+                case DecodedOp::JMPIF: {
+                    auto k = stack.size() - 1;
+                    flush(k);
+                    if (stack[k].kind == Operand::Kind::CONST) materialize(k);
+                    auto condition = stack[k].slot;
+                    stack.pop_back();
+
+                    auto& branch = emit(DecodedOp::R_JMPIF);
+                    branch.aux = condition;
+                    targets.back() = int64_t(i) + ins.data;
+                    break;
+                }
+                case DecodedOp::RET:
+                case DecodedOp::HALT:
+                    flush(stack.size());
+                    copy(i);
+                    live = false;
+                    break;
+                case DecodedOp::CREATELOCALS:
+                    flush(stack.size());
+                    copy(i);
+                    for (size_t k = 0; k < stack.size(); k++) {
+                        stack[k].slot = locals + std::max(ins.data, 0) + int32_t(k);
+                    }
+                    break;
+                case DecodedOp::GETGLOBAL:
+                    flush(stack.size());
+                    copy(i);
+                    stack.push_back({Operand::Kind::SLOT, locals + int32_t(stack.size()), VMValue()});
+                    break;
+                case DecodedOp::ATOMICLOAD:
+                case DecodedOp::ATOMICSTORE:
+                case DecodedOp::ATOMICADD:
+                case DecodedOp::ATOMICCAS:
+                case DecodedOp::FENCE: {
+                    // Left as they are, working on operands written to their stack slots first.
+                    const size_t effects[][2] = {{1, 1}, {2, 0}, {2, 1}, {3, 1}, {0, 0}};
+                    auto& [pops, pushes] = effects[int(ins.op) - int(DecodedOp::ATOMICLOAD)];
+                    flush(stack.size());
+                    copy(i);
+                    stack.resize(stack.size() - pops);
+                    for (size_t k = 0; k < pushes; k++) {
+                        stack.push_back({Operand::Kind::SLOT, locals + int32_t(stack.size()), VMValue()});
+                    }
+                    break;
+                }
+                case DecodedOp::CALL:
+                case DecodedOp::CALL_DIRECT:
+                case DecodedOp::TAILCALL_DIRECT:
+                case DecodedOp::CALL_BUILTIN:
+                case DecodedOp::CALLINDIRECT:
+                case DecodedOp::SPAWN:
+                case DecodedOp::YIELD:
+                case DecodedOp::JOIN:
+                    // Always last in its group, the next one starts from the verified depths.
+                    flush(stack.size());
+                    copy(i);
+                    stack.clear();
+                    break;
+                default: {
+                    if (InRange(ins.op, DecodedOp::CONVERT_I8_I8, DecodedOp::CONVERT_F64_F64)) {
+                        auto k = stack.size() - 1;
+                        if (stack[k].kind == Operand::Kind::CONST) materialize(k);
+                        auto source = stack[k].slot;
+                        stack[k] = {Operand::Kind::SLOT, locals + int32_t(k), VMValue()};
+
+                        auto& convert = emit(Offset(DecodedOp::R_CONVERT_I8_I8, int(ins.op) - int(DecodedOp::CONVERT_I8_I8)));
+                        convert.data = locals + int32_t(k);
+                        convert.aux = source;
+                        producer = int64_t(out.size()) - 1;
+                        break;
+                    }
+                    if (!IsBinary(ins.op)) return fail();
+
+                    auto k = stack.size() - 2;
+                    auto rhs = stack[k + 1];
+                    auto immediate = rhs.kind == Operand::Kind::CONST;
+
+                    // A compare and the jmpif consuming it become one branch.
+                    auto branch = BranchForm(ins.op, immediate);
+                    bool fuse = branch != DecodedOp::UNKNOWN && next < groupEnd && at(next).op == DecodedOp::JMPIF;
+                    if (fuse) flush(k);
+
+                    if (stack[k].kind == Operand::Kind::CONST) materialize(k);
+                    auto lhs = stack[k].slot;
+                    stack.pop_back();
+                    stack.pop_back();
+                    if (!fuse) stack.push_back({Operand::Kind::SLOT, locals + int32_t(k), VMValue()});
+
+                    auto& binary = emit(fuse ? branch : RegisterForm(ins.op, immediate));
+                    binary.aux = lhs;
+                    if (immediate) binary.operand = rhs.value;
+                    else binary.extra = rhs.slot;
+                    if (fuse) {
+                        targets.back() = int64_t(next) + at(next).data;
+                        i = next;
+                    }
+                    else {
+                        binary.data = locals + int32_t(k);
+                        producer = int64_t(out.size()) - 1;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (!place(groupStart, groupEnd, live)) return fail();
+        for (auto i = groupStart; i < groupEnd; i += at(i).length) afterIndirect = at(i).op == DecodedOp::CALLINDIRECT;
+        groupStart = groupEnd;
+    }
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,928 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include "instruction.hpp"
+#include <algorithm>
+#include <array>
+#include <string>
+
+#if defined(__GNUC__)
+#define RVM_INLINE inline __attribute__((always_inline))
+#define RVM_COLD __attribute__((noinline, cold))
+#else
+#define RVM_INLINE inline
+#define RVM_COLD
+#endif
+
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define RVM_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::ExecutionContext;
+using rvm::exec::VMValue;
+using rvm::exec::DataType;
+using rvm::exec::DecodedOp;
+using rvm::exec::DecodedInstruction;
+using rvm::exec::ThreadedHandler;
+using rvm::exec::NativeCode;
+
+struct rvm::exec::ThreadedRegs {
+    VirtualMachine* vm;
+    ExecutionContext* context;
+    const DecodedInstruction* code;
+    const DecodedInstruction* ip;
+    VMValue* stack;
+    VMValue* sp;
+    VMValue* vb;
+    VMValue* limit;
+    VMValue* fp;
+#if !RVM_COMPUTED_GOTO
+    // Handler table positioned at the checked UNKNOWN handler.
+    const rvm::exec::ThreadedFunction* handlers;
+#endif
+};
+
+using rvm::exec::ThreadedRegs;
+
+// Instruction bodies shared by the computed goto loop and the handler fallback.
+// Each one leaves `ip` at the next instruction and returns false to leave the loop.
+// The unchecked instantiation runs verified functions, whose stack and local accesses
+// were proven in bounds at load time.
+template <bool Checked>
+struct rvm::exec::ThreadedOps {
+    [[noreturn]] RVM_COLD static void Fail(const char* msg) {
+        throw VirtualMachineException(msg);
+    }
+
+    RVM_INLINE static void Save(ThreadedRegs& r, const DecodedInstruction* next) {
+        auto* context = r.context;
+        context->insIndex = next - r.code;
+        context->stackIndex = r.sp - r.stack - 1;
+        context->localFrameBaseIndex = r.fp - r.stack;
+        context->valuesFrameBaseIndex = r.vb - r.stack;
+    }
+
+    RVM_INLINE static void Restore(ThreadedRegs& r) {
+        auto* context = r.context;
+        r.code = r.vm->decoded.data();
+        r.ip = r.code + context->insIndex;
+        r.stack = context->valueStack.get();
+        r.sp = r.stack + context->stackIndex + 1;
+        r.vb = r.stack + context->valuesFrameBaseIndex;
+        r.limit = r.stack + context->stackSize;
+        r.fp = r.stack + context->localFrameBaseIndex;
+    }
+
+    RVM_INLINE static VMValue Pop(ThreadedRegs& r) {
+        if (Checked && r.sp <= r.vb) Fail("Value stack operation fell outside of function frame.");
+        return *--r.sp;
+    }
+
+    RVM_INLINE static void Push(ThreadedRegs& r, VMValue value) {
+        if (Checked && r.sp >= r.limit) Fail("Stack overflow error.");
+        *r.sp++ = value;
+    }
+
+    RVM_INLINE static VMValue& Local(ThreadedRegs& r, int32_t index) {
+        if (Checked && (index < 0 || r.fp + index >= r.vb)) Fail("Local index out of range.");
+        return r.fp[index];
+    }
+
+    // Functions start out unoptimized and count calls into them and taken backward branches.
+    // Once one of the counts gets hot the whole function is promoted in place; all forms
+    // share instruction indices, so execution simply continues in the promoted code.
+    RVM_INLINE static void Count(ThreadedRegs& r, size_t index) {
+        auto* vm = r.vm;
+        auto& count = vm->hotCounts[index];
+        if (count < vm->tierThreshold && ++count == vm->tierThreshold) vm->PromoteUnitAt(index);
+    }
+
+    template <typename T, typename F>
+    RVM_INLINE static void Binary(ThreadedRegs& r, F f) {
+        auto rhs = Pop(r);
+        auto lhs = Pop(r);
+        VMValue result;
+        result.As<T>() = f(lhs.As<T>(), rhs.As<T>());
+        Push(r, result);
+    }
+
+    template <typename T, typename F>
+    RVM_INLINE static void Compare(ThreadedRegs& r, F f) {
+        auto rhs = Pop(r);
+        auto lhs = Pop(r);
+        VMValue result;
+        result.i8 = f(lhs.As<T>(), rhs.As<T>());
+        Push(r, result);
+    }
+
+    template <DecodedOp Op>
+    static constexpr auto Operation() {
+        if constexpr (Op == DecodedOp::ADD) return [] (auto a, auto b) { return a + b; };
+        else if constexpr (Op == DecodedOp::SUB) return [] (auto a, auto b) { return a - b; };
+        else if constexpr (Op == DecodedOp::MUL) return [] (auto a, auto b) { return a * b; };
+        else if constexpr (Op == DecodedOp::DIV) return [] (auto a, auto b) { return a / b; };
+        else if constexpr (Op == DecodedOp::GT) return [] (auto a, auto b) { return a > b; };
+        else if constexpr (Op == DecodedOp::GEQ) return [] (auto a, auto b) { return a >= b; };
+        else if constexpr (Op == DecodedOp::LT) return [] (auto a, auto b) { return a < b; };
+        else if constexpr (Op == DecodedOp::LEQ) return [] (auto a, auto b) { return a <= b; };
+        else if constexpr (Op == DecodedOp::EQ) return [] (auto a, auto b) { return a == b; };
+        else if constexpr (Op == DecodedOp::LAND) return [] (auto a, auto b) { return a && b; };
+        else if constexpr (Op == DecodedOp::LOR) return [] (auto a, auto b) { return a || b; };
+        else if constexpr (Op == DecodedOp::BAND) return [] (auto a, auto b) { return a & b; };
+        else if constexpr (Op == DecodedOp::BOR) return [] (auto a, auto b) { return a | b; };
+        else if constexpr (Op == DecodedOp::BXOR) return [] (auto a, auto b) { return a ^ b; };
+        else if constexpr (Op == DecodedOp::LSHIFT) return [] (auto a, auto b) { return a << (b % 64); };
+        else if constexpr (Op == DecodedOp::RSHIFT) return [] (auto a, auto b) { return a >> (b % 64); };
+        else return [] (auto a, auto b) { return a != b; };
+    }
+
+    template <DecodedOp Op>
+    static constexpr bool IsArithmetic = Op == DecodedOp::ADD || Op == DecodedOp::SUB || Op == DecodedOp::MUL || Op == DecodedOp::DIV;
+
+    template <DecodedOp Op>
+    static constexpr bool IsLogical = Op == DecodedOp::LAND || Op == DecodedOp::LOR;
+
+    // Quickened instruction with its type parameter resolved at load time.
+    template <DecodedOp Op, typename T>
+    RVM_INLINE static bool Typed(ThreadedRegs& r) {
+        if constexpr (IsArithmetic<Op>) Binary<T>(r, Operation<Op>());
+        else Compare<T>(r, Operation<Op>());
+        r.ip++;
+        return true;
+    }
+
+    template <typename From, typename To>
+    RVM_INLINE static bool Converted(ThreadedRegs& r) {
+        auto data = Pop(r);
+        Push(r, VMValue((To) data.As<From>()));
+        r.ip++;
+        return true;
+    }
+
+    template <typename F>
+    RVM_INLINE static bool Arithmetic(ThreadedRegs& r, F f) {
+        switch (r.ip->optype[0]) {
+            case DataType::I8: Binary<int8_t>(r, f); break;
+            case DataType::I16: Binary<int16_t>(r, f); break;
+            case DataType::I32: Binary<int32_t>(r, f); break;
+            case DataType::F32: Binary<float>(r, f); break;
+            case DataType::F64: Binary<double>(r, f); break;
+            default: Binary<int64_t>(r, f); break;
+        }
+        r.ip++;
+        return true;
+    }
+
+    template <typename F>
+    RVM_INLINE static bool Comparison(ThreadedRegs& r, F f) {
+        switch (r.ip->optype[0]) {
+            case DataType::I8: Compare<int8_t>(r, f); break;
+            case DataType::I16: Compare<int16_t>(r, f); break;
+            case DataType::I32: Compare<int32_t>(r, f); break;
+            case DataType::I64: Compare<int64_t>(r, f); break;
+            case DataType::F32: Compare<float>(r, f); break;
+            case DataType::F64: Compare<double>(r, f); break;
+            default: Compare<void*>(r, f); break;
+        }
+        r.ip++;
+        return true;
+    }
+
+    template <typename From>
+    RVM_INLINE static void ConvertFrom(ThreadedRegs& r, VMValue data, DataType to) {
+        auto value = data.As<From>();
+        switch (to) {
+            case DataType::I8: Push(r, VMValue((int8_t) value)); return;
+            case DataType::I16: Push(r, VMValue((int16_t) value)); return;
+            case DataType::I32: Push(r, VMValue((int32_t) value)); return;
+            case DataType::I64: Push(r, VMValue((int64_t) value)); return;
+            case DataType::F32: Push(r, VMValue((float) value)); return;
+            case DataType::F64: Push(r, VMValue((double) value)); return;
+            default: return;
+        }
+    }
+
+    RVM_INLINE static bool Op_NOP(ThreadedRegs& r) {
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_HALT(ThreadedRegs& r) {
+        Save(r, r.ip + 1);
+        return false;
+    }
+
+    RVM_INLINE static bool Op_LOAD(ThreadedRegs& r) {
+        Push(r, Local(r, r.ip->data));
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_STORE(ThreadedRegs& r) {
+        auto value = Pop(r);
+        Local(r, r.ip->data) = value;
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LOADCONST(ThreadedRegs& r) {
+        Push(r, r.ip->operand);
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_STORECONST(ThreadedRegs& r) {
+        Local(r, r.ip->data) = r.ip->operand;
+        r.ip += 2;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CONVERT(ThreadedRegs& r) {
+        auto from = r.ip->optype[0];
+        auto to = r.ip->optype[1];
+        r.ip++;
+        if (from == to || to == DataType::PTR) return true;
+
+        auto data = Pop(r);
+        switch (from) {
+            case DataType::I8: ConvertFrom<int8_t>(r, data, to); break;
+            case DataType::I16: ConvertFrom<int16_t>(r, data, to); break;
+            case DataType::I32: ConvertFrom<int32_t>(r, data, to); break;
+            case DataType::I64: ConvertFrom<int64_t>(r, data, to); break;
+            case DataType::F32: ConvertFrom<float>(r, data, to); break;
+            case DataType::F64: ConvertFrom<double>(r, data, to); break;
+            default: break;
+        }
+        return true;
+    }
+
+    RVM_INLINE static bool Op_ADD(ThreadedRegs& r) {
+        return Arithmetic(r, Operation<DecodedOp::ADD>());
+    }
+
+    RVM_INLINE static bool Op_SUB(ThreadedRegs& r) {
+        return Arithmetic(r, Operation<DecodedOp::SUB>());
+    }
+
+    RVM_INLINE static bool Op_MUL(ThreadedRegs& r) {
+        return Arithmetic(r, Operation<DecodedOp::MUL>());
+    }
+
+    RVM_INLINE static bool Op_DIV(ThreadedRegs& r) {
+        return Arithmetic(r, Operation<DecodedOp::DIV>());
+    }
+
+    RVM_INLINE static bool Op_LAND(ThreadedRegs& r) {
+        Compare<int8_t>(r, [] (auto a, auto b) { return a && b; });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LOR(ThreadedRegs& r) {
+        Compare<int8_t>(r, [] (auto a, auto b) { return a || b; });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LNOT(ThreadedRegs& r) {
+        auto data = Pop(r);
+        VMValue result;
+        result.i8 = !data.i8;
+        Push(r, result);
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_GT(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::GT>());
+    }
+
+    RVM_INLINE static bool Op_GEQ(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::GEQ>());
+    }
+
+    RVM_INLINE static bool Op_LT(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::LT>());
+    }
+
+    RVM_INLINE static bool Op_LEQ(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::LEQ>());
+    }
+
+    RVM_INLINE static bool Op_EQ(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::EQ>());
+    }
+
+    RVM_INLINE static bool Op_NOTEQ(ThreadedRegs& r) {
+        return Comparison(r, Operation<DecodedOp::NOTEQ>());
+    }
+
+    RVM_INLINE static bool Op_BAND(ThreadedRegs& r) {
+        Binary<int64_t>(r, [] (auto a, auto b) { return a & b; });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_BOR(ThreadedRegs& r) {
+        Binary<int64_t>(r, [] (auto a, auto b) { return a | b; });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_BXOR(ThreadedRegs& r) {
+        Binary<int64_t>(r, [] (auto a, auto b) { return a ^ b; });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_BNOT(ThreadedRegs& r) {
+        auto data = Pop(r);
+        Push(r, VMValue(~data.i64));
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LSHIFT(ThreadedRegs& r) {
+        Binary<int64_t>(r, [] (auto a, auto b) { return a << (b % 64); });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_RSHIFT(ThreadedRegs& r) {
+        Binary<int64_t>(r, [] (auto a, auto b) { return a >> (b % 64); });
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_JMP(ThreadedRegs& r) {
+        r.ip += r.ip->data;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_JMPIF(ThreadedRegs& r) {
+        auto flag = Pop(r);
+        r.ip += flag.i8 ? r.ip->data : 1;
+        return true;
+    }
+
+    // Backward branches of functions that were not promoted yet. Promotion may rewrite the
+    // branch itself, so its target is taken first.
+    RVM_INLINE static bool Op_JMP_COUNTED(ThreadedRegs& r) {
+        auto* target = r.ip + r.ip->data;
+        Count(r, r.ip - r.code);
+        r.ip = target;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_JMPIF_COUNTED(ThreadedRegs& r) {
+        auto flag = Pop(r);
+        if (!flag.i8) {
+            r.ip++;
+            return true;
+        }
+
+        auto* target = r.ip + r.ip->data;
+        Count(r, r.ip - r.code);
+        r.ip = target;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CREATELOCALS(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hCreateLocals(r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CALL(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        auto argnum = ins->data;
+        Save(r, ins + ins->length);
+        r.context->CallByName(std::string_view((const char*) ins->operand.ptr), argnum, ins - r.code);
+        if (r.context->yielded) return false;
+        r.context->CheckFunctionEntry(argnum);
+        r.context->CountCallEntry();
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_RET(ThreadedRegs& r) {
+        auto* context = r.context;
+        auto& frames = context->frames;
+        if (frames.empty()) {
+            Save(r, r.ip + 1);
+            context->returned = std::max(r.ip->data, 0);
+            context->running = false;
+            return false;
+        }
+
+        auto num = std::max(r.ip->data, 0);
+        auto* first = r.sp - num;
+        if (Checked && first < r.vb) Fail("Value stack operation fell outside of function frame.");
+        for (int i = 0; i < num; i++) {
+            r.fp[i] = first[i];
+        }
+        r.sp = r.fp + num;
+
+        auto& frame = frames.back();
+        r.ip = r.code + frame.returnIndex;
+        r.fp = r.stack + frame.localBase;
+        r.vb = r.stack + frame.valueBase;
+        frames.pop_back();
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CALLINDIRECT(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        auto* context = r.context;
+        auto argnum = r.ip->data;
+        context->hCallIndirect(argnum);
+        if (context->insIndex >= r.vm->instructions.size()) context->insIndex = r.vm->instructions.size();
+        context->CheckFunctionEntry(argnum);
+        context->CountCallEntry();
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_GETGLOBAL(ThreadedRegs& r) {
+        auto target = r.vm->UnitNamed((const char*) r.ip->operand.ptr);
+        Push(r, VMValue((void*) &r.vm->instructions[target]));
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_SPAWN(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hSpawn(r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_YIELD(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hYield();
+        return false;
+    }
+
+    // A join that has to wait runs again once the fiber is resumed.
+    RVM_INLINE static bool Op_JOIN(ThreadedRegs& r) {
+        Save(r, r.ip);
+        if (!r.context->hJoin(r.ip->data)) return false;
+        Restore(r);
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_ATOMICLOAD(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hAtomicLoad(r.ip->optype[0], r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_ATOMICSTORE(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hAtomicStore(r.ip->optype[0], r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_ATOMICADD(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hAtomicAdd(r.ip->optype[0], r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_ATOMICCAS(ThreadedRegs& r) {
+        Save(r, r.ip + r.ip->length);
+        r.context->hAtomicCas(r.ip->optype[0], r.ip->data);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_FENCE(ThreadedRegs& r) {
+        r.context->hFence(r.ip->data);
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_UNKNOWN(ThreadedRegs& r) {
+        Fail("Unknown instruction.");
+    }
+
+    RVM_INLINE static bool Op_CONVERT_DROP(ThreadedRegs& r) {
+        Pop(r);
+        r.ip++;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CALL_DIRECT(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        auto& frames = r.context->frames;
+        auto* base = r.sp - std::max(ins->data, 0);
+        if (Checked && base < r.vb) Fail("Value stack operation fell outside of function frame.");
+        if (frames.size() >= r.context->maxFrames) Fail("Call stack overflow error.");
+        if (r.sp + ins->aux > r.limit) Fail("Stack overflow error.");
+
+        std::reverse(base, r.sp);
+        frames.push_back({size_t(ins + ins->length - r.code), size_t(r.fp - r.stack), size_t(r.vb - r.stack)});
+        r.fp = base;
+        r.vb = r.sp;
+        r.ip = r.code + ins->operand.i64;
+        Count(r, ins->operand.i64);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_TAILCALL_DIRECT(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        auto num = std::max(ins->data, 0);
+        auto* first = r.sp - num;
+        if (Checked && first < r.vb) Fail("Value stack operation fell outside of function frame.");
+        if (r.fp + num + ins->aux > r.limit) Fail("Stack overflow error.");
+
+        std::reverse(first, r.sp);
+        std::copy(first, r.sp, r.fp);
+        r.sp = r.fp + num;
+        r.vb = r.sp;
+        r.ip = r.code + ins->operand.i64;
+        Count(r, ins->operand.i64);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LOAD_LOAD(ThreadedRegs& r) {
+        Push(r, Local(r, r.ip->data));
+        Push(r, Local(r, r.ip->aux));
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_LOAD_LOADCONST(ThreadedRegs& r) {
+        Push(r, Local(r, r.ip->data));
+        Push(r, r.ip->operand);
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    RVM_INLINE static bool Op_STORE_LOAD(ThreadedRegs& r) {
+        auto value = Pop(r);
+        Local(r, r.ip->data) = value;
+        Push(r, Local(r, r.ip->aux));
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    // Superinstructions over I64 values. `data` holds the local, `operand` the constant and
+    // `aux` the branch offset or the local stored to.
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_JMPIF(ThreadedRegs& r) {
+        auto rhs = Pop(r);
+        auto lhs = Pop(r);
+        r.ip += Operation<Op>()(lhs.i64, rhs.i64) ? r.ip->aux : int32_t(r.ip->length);
+        return true;
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_LOCAL_CONST(ThreadedRegs& r) {
+        auto value = Operation<Op>()(Local(r, r.ip->data).i64, r.ip->operand.i64);
+        VMValue result;
+        if constexpr (IsArithmetic<Op>) result.i64 = value;
+        else result.i8 = value;
+        Push(r, result);
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_JMPIF_LOCAL_CONST(ThreadedRegs& r) {
+        auto taken = Operation<Op>()(Local(r, r.ip->data).i64, r.ip->operand.i64);
+        r.ip += taken ? r.ip->aux : int32_t(r.ip->length);
+        return true;
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_STORE_LOCAL_CONST(ThreadedRegs& r) {
+        auto value = Operation<Op>()(Local(r, r.ip->data).i64, r.ip->operand.i64);
+        Local(r, r.ip->aux) = VMValue(int64_t(value));
+        r.ip += r.ip->length;
+        return true;
+    }
+
+    // Register forms of translated verified functions. They always continue with the next
+    // entry, which keeps a load of `length` off the dependency chain of `ip`.
+    RVM_INLINE static void Advance(ThreadedRegs& r) {
+        r.sp = r.fp + r.ip->sp;
+        r.ip++;
+    }
+
+    RVM_INLINE static void Branch(ThreadedRegs& r, bool taken) {
+        r.sp = r.fp + r.ip->sp;
+        r.ip += taken ? r.ip->data : 1;
+    }
+
+    RVM_INLINE static bool Op_R_MOV(ThreadedRegs& r) {
+        r.fp[r.ip->data] = r.fp[r.ip->aux];
+        Advance(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_R_CONST(ThreadedRegs& r) {
+        r.fp[r.ip->data] = r.ip->operand;
+        Advance(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_R_JMPIF(ThreadedRegs& r) {
+        Branch(r, r.fp[r.ip->aux].i8);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_R_LNOT(ThreadedRegs& r) {
+        VMValue result;
+        result.i8 = !r.fp[r.ip->aux].i8;
+        r.fp[r.ip->data] = result;
+        Advance(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_R_BNOT(ThreadedRegs& r) {
+        r.fp[r.ip->data] = VMValue(~r.fp[r.ip->aux].i64);
+        Advance(r);
+        return true;
+    }
+
+    template <DecodedOp Op, typename T, bool Immediate>
+    RVM_INLINE static bool Register(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        auto lhs = r.fp[ins->aux];
+        auto rhs = Immediate ? ins->operand : r.fp[ins->extra];
+        VMValue result;
+        if constexpr (IsArithmetic<Op>) result.As<T>() = Operation<Op>()(lhs.As<T>(), rhs.As<T>());
+        else result.i8 = Operation<Op>()(lhs.As<T>(), rhs.As<T>());
+        r.fp[ins->data] = result;
+        Advance(r);
+        return true;
+    }
+
+    template <DecodedOp Op, bool Immediate>
+    RVM_INLINE static bool RegisterUntyped(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        auto lhs = r.fp[ins->aux];
+        auto rhs = Immediate ? ins->operand : r.fp[ins->extra];
+        VMValue result;
+        if constexpr (IsLogical<Op>) result.i8 = Operation<Op>()(lhs.i8, rhs.i8);
+        else result.i64 = Operation<Op>()(lhs.i64, rhs.i64);
+        r.fp[ins->data] = result;
+        Advance(r);
+        return true;
+    }
+
+    template <typename From, typename To>
+    RVM_INLINE static bool RegisterConverted(ThreadedRegs& r) {
+        auto value = r.fp[r.ip->aux];
+        r.fp[r.ip->data] = VMValue((To) value.As<From>());
+        Advance(r);
+        return true;
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_R(ThreadedRegs& r) {
+        return RegisterUntyped<Op, false>(r);
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_RI(ThreadedRegs& r) {
+        return RegisterUntyped<Op, true>(r);
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_BR(ThreadedRegs& r) {
+        Branch(r, Operation<Op>()(r.fp[r.ip->aux].i64, r.fp[r.ip->extra].i64));
+        return true;
+    }
+
+    template <DecodedOp Op>
+    RVM_INLINE static bool Fused_BRI(ThreadedRegs& r) {
+        Branch(r, Operation<Op>()(r.fp[r.ip->aux].i64, r.ip->operand.i64));
+        return true;
+    }
+
+    RVM_INLINE static bool Op_JIT_ENTER(ThreadedRegs& r) {
+        auto native = reinterpret_cast<NativeCode>(r.ip->operand.ptr);
+        r.ip = r.code + native(r.fp);
+        r.sp = r.fp + r.ip->sp;
+        return true;
+    }
+
+    // Entry into a unit not loaded yet. Once loaded, the same instruction runs decoded.
+    RVM_INLINE static bool Op_LOAD_UNIT(ThreadedRegs& r) {
+        Save(r, r.ip);
+        r.vm->LoadUnitAt(r.ip - r.code);
+        Restore(r);
+        return true;
+    }
+
+    RVM_INLINE static bool Op_CALL_BUILTIN(ThreadedRegs& r) {
+        auto* ins = r.ip;
+        Save(r, ins + ins->length);
+        r.context->CallBuiltIn(uint32_t(ins->operand.i64), ins->data, ins - r.code);
+        if (r.context->yielded) return false;
+        Restore(r);
+        return true;
+    }
+};
+
+using rvm::exec::ThreadedOps;
+
+// Both tables hold the checked handlers first and the unchecked ones after them.
+#if RVM_COMPUTED_GOTO
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+namespace {
+    template <size_t N>
+    std::array<ThreadedHandler, N> Offsets(const void* const (&labels)[N], const void* base) {
+        std::array<ThreadedHandler, N> out;
+        for (size_t i = 0; i < N; i++) out[i] = ThreadedHandler((const char*) labels[i] - (const char*) base);
+        return out;
+    }
+
+    const ThreadedHandler* Execute(ThreadedRegs* regs) {
+        static const void* const labels[] = {
+            #define RVM_THREADED_LABEL(name) &&L_##name,
+            #define RVM_THREADED_LABEL_TYPED(op, T, ctype) &&L_##op##_##T,
+            #define RVM_THREADED_LABEL_CONVERSION(F, ftype, T, ttype) &&L_CONVERT_##F##_##T,
+            #define RVM_THREADED_LABEL_FUSED(kind, op) &&L_##kind##_##op##_I64,
+            #define RVM_THREADED_LABEL_REGISTER(op, T, ctype) &&L_R_##op##_##T, &&L_RI_##op##_##T,
+            #define RVM_THREADED_LABEL_REGISTER_CONVERSION(F, ftype, T, ttype) &&L_R_CONVERT_##F##_##T,
+            RVM_ALL_DECODED_OPS(RVM_THREADED_LABEL)
+            #undef RVM_THREADED_LABEL
+            #undef RVM_THREADED_LABEL_TYPED
+            #undef RVM_THREADED_LABEL_CONVERSION
+            #undef RVM_THREADED_LABEL_FUSED
+            #undef RVM_THREADED_LABEL_REGISTER
+            #undef RVM_THREADED_LABEL_REGISTER_CONVERSION
+            #define RVM_THREADED_LABEL(name) &&LU_##name,
+            #define RVM_THREADED_LABEL_TYPED(op, T, ctype) &&LU_##op##_##T,
+            #define RVM_THREADED_LABEL_CONVERSION(F, ftype, T, ttype) &&LU_CONVERT_##F##_##T,
+            #define RVM_THREADED_LABEL_FUSED(kind, op) &&LU_##kind##_##op##_I64,
+            #define RVM_THREADED_LABEL_REGISTER(op, T, ctype) &&LU_R_##op##_##T, &&LU_RI_##op##_##T,
+            #define RVM_THREADED_LABEL_REGISTER_CONVERSION(F, ftype, T, ttype) &&LU_R_CONVERT_##F##_##T,
+            RVM_ALL_DECODED_OPS(RVM_THREADED_LABEL)
+            #undef RVM_THREADED_LABEL
+            #undef RVM_THREADED_LABEL_TYPED
+            #undef RVM_THREADED_LABEL_CONVERSION
+            #undef RVM_THREADED_LABEL_FUSED
+            #undef RVM_THREADED_LABEL_REGISTER
+            #undef RVM_THREADED_LABEL_REGISTER_CONVERSION
+        };
+        // Handlers may be placed in different sections, so their distances are only known at run time.
+        static const auto offsets = Offsets(labels, &&L_UNKNOWN);
+        if (!regs) return offsets.data();
+
+        #define RVM_THREADED_NEXT goto *((char*) &&L_UNKNOWN + r.ip->handler)
+        ThreadedRegs r = *regs;
+        RVM_THREADED_NEXT;
+
+        #define RVM_THREADED_TARGET(name) \
+            L_##name: if (ThreadedOps<true>::Op_##name(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_##name: if (ThreadedOps<false>::Op_##name(r)) RVM_THREADED_NEXT; goto exit;
+        #define RVM_THREADED_TARGET_TYPED(op, T, ctype) \
+            L_##op##_##T: if (ThreadedOps<true>::Typed<DecodedOp::op, ctype>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_##op##_##T: if (ThreadedOps<false>::Typed<DecodedOp::op, ctype>(r)) RVM_THREADED_NEXT; goto exit;
+        #define RVM_THREADED_TARGET_CONVERSION(F, ftype, T, ttype) \
+            L_CONVERT_##F##_##T: if (ThreadedOps<true>::Converted<ftype, ttype>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_CONVERT_##F##_##T: if (ThreadedOps<false>::Converted<ftype, ttype>(r)) RVM_THREADED_NEXT; goto exit;
+        #define RVM_THREADED_TARGET_FUSED(kind, op) \
+            L_##kind##_##op##_I64: if (ThreadedOps<true>::Fused_##kind<DecodedOp::op>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_##kind##_##op##_I64: if (ThreadedOps<false>::Fused_##kind<DecodedOp::op>(r)) RVM_THREADED_NEXT; goto exit;
+        #define RVM_THREADED_TARGET_REGISTER(op, T, ctype) \
+            L_R_##op##_##T: if (ThreadedOps<true>::Register<DecodedOp::op, ctype, false>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_R_##op##_##T: if (ThreadedOps<false>::Register<DecodedOp::op, ctype, false>(r)) RVM_THREADED_NEXT; goto exit; \
+            L_RI_##op##_##T: if (ThreadedOps<true>::Register<DecodedOp::op, ctype, true>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_RI_##op##_##T: if (ThreadedOps<false>::Register<DecodedOp::op, ctype, true>(r)) RVM_THREADED_NEXT; goto exit;
+        #define RVM_THREADED_TARGET_REGISTER_CONVERSION(F, ftype, T, ttype) \
+            L_R_CONVERT_##F##_##T: if (ThreadedOps<true>::RegisterConverted<ftype, ttype>(r)) RVM_THREADED_NEXT; goto exit; \
+            LU_R_CONVERT_##F##_##T: if (ThreadedOps<false>::RegisterConverted<ftype, ttype>(r)) RVM_THREADED_NEXT; goto exit;
+        RVM_ALL_DECODED_OPS(RVM_THREADED_TARGET)
+        #undef RVM_THREADED_TARGET
+        #undef RVM_THREADED_TARGET_TYPED
+        #undef RVM_THREADED_TARGET_CONVERSION
+        #undef RVM_THREADED_TARGET_FUSED
+        #undef RVM_THREADED_TARGET_REGISTER
+        #undef RVM_THREADED_TARGET_REGISTER_CONVERSION
+        #undef RVM_THREADED_NEXT
+
+    exit:
+        *regs = r;
+        return offsets.data();
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+#ifdef RVM_MUSTTAIL
+#define RVM_TAIL_DISPATCH(r) RVM_MUSTTAIL return r.handlers[r.ip->handler](r)
+#else
+#define RVM_TAIL_DISPATCH(r) return
+#endif
+
+namespace {
+    #define RVM_THREADED_HANDLER_BODY(name, call) \
+        void name(ThreadedRegs& r) { \
+            if (call) RVM_TAIL_DISPATCH(r); \
+            r.ip = nullptr; \
+        }
+    #define RVM_THREADED_HANDLER(name) \
+        RVM_THREADED_HANDLER_BODY(H_##name, ThreadedOps<true>::Op_##name(r)) \
+        RVM_THREADED_HANDLER_BODY(HU_##name, ThreadedOps<false>::Op_##name(r))
+    #define RVM_THREADED_HANDLER_TYPED(op, T, ctype) \
+        RVM_THREADED_HANDLER_BODY(H_##op##_##T, (ThreadedOps<true>::Typed<DecodedOp::op, ctype>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_##op##_##T, (ThreadedOps<false>::Typed<DecodedOp::op, ctype>(r)))
+    #define RVM_THREADED_HANDLER_CONVERSION(F, ftype, T, ttype) \
+        RVM_THREADED_HANDLER_BODY(H_CONVERT_##F##_##T, (ThreadedOps<true>::Converted<ftype, ttype>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_CONVERT_##F##_##T, (ThreadedOps<false>::Converted<ftype, ttype>(r)))
+    #define RVM_THREADED_HANDLER_FUSED(kind, op) \
+        RVM_THREADED_HANDLER_BODY(H_##kind##_##op##_I64, (ThreadedOps<true>::Fused_##kind<DecodedOp::op>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_##kind##_##op##_I64, (ThreadedOps<false>::Fused_##kind<DecodedOp::op>(r)))
+    #define RVM_THREADED_HANDLER_REGISTER(op, T, ctype) \
+        RVM_THREADED_HANDLER_BODY(H_R_##op##_##T, (ThreadedOps<true>::Register<DecodedOp::op, ctype, false>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_R_##op##_##T, (ThreadedOps<false>::Register<DecodedOp::op, ctype, false>(r))) \
+        RVM_THREADED_HANDLER_BODY(H_RI_##op##_##T, (ThreadedOps<true>::Register<DecodedOp::op, ctype, true>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_RI_##op##_##T, (ThreadedOps<false>::Register<DecodedOp::op, ctype, true>(r)))
+    #define RVM_THREADED_HANDLER_REGISTER_CONVERSION(F, ftype, T, ttype) \
+        RVM_THREADED_HANDLER_BODY(H_R_CONVERT_##F##_##T, (ThreadedOps<true>::RegisterConverted<ftype, ttype>(r))) \
+        RVM_THREADED_HANDLER_BODY(HU_R_CONVERT_##F##_##T, (ThreadedOps<false>::RegisterConverted<ftype, ttype>(r)))
+    RVM_ALL_DECODED_OPS(RVM_THREADED_HANDLER)
+    #undef RVM_THREADED_HANDLER_BODY
+    #undef RVM_THREADED_HANDLER
+    #undef RVM_THREADED_HANDLER_TYPED
+    #undef RVM_THREADED_HANDLER_CONVERSION
+    #undef RVM_THREADED_HANDLER_FUSED
+    #undef RVM_THREADED_HANDLER_REGISTER
+    #undef RVM_THREADED_HANDLER_REGISTER_CONVERSION
+
+    const ThreadedHandler* Execute(ThreadedRegs* regs) {
+        using rvm::exec::ThreadedFunction;
+        static const ThreadedFunction handlers[] = {
+            #define RVM_THREADED_ENTRY(name) &H_##name,
+            #define RVM_THREADED_ENTRY_TYPED(op, T, ctype) &H_##op##_##T,
+            #define RVM_THREADED_ENTRY_CONVERSION(F, ftype, T, ttype) &H_CONVERT_##F##_##T,
+            #define RVM_THREADED_ENTRY_FUSED(kind, op) &H_##kind##_##op##_I64,
+            #define RVM_THREADED_ENTRY_REGISTER(op, T, ctype) &H_R_##op##_##T, &H_RI_##op##_##T,
+            #define RVM_THREADED_ENTRY_REGISTER_CONVERSION(F, ftype, T, ttype) &H_R_CONVERT_##F##_##T,
+            RVM_ALL_DECODED_OPS(RVM_THREADED_ENTRY)
+            #undef RVM_THREADED_ENTRY
+            #undef RVM_THREADED_ENTRY_TYPED
+            #undef RVM_THREADED_ENTRY_CONVERSION
+            #undef RVM_THREADED_ENTRY_FUSED
+            #undef RVM_THREADED_ENTRY_REGISTER
+            #undef RVM_THREADED_ENTRY_REGISTER_CONVERSION
+            #define RVM_THREADED_ENTRY(name) &HU_##name,
+            #define RVM_THREADED_ENTRY_TYPED(op, T, ctype) &HU_##op##_##T,
+            #define RVM_THREADED_ENTRY_CONVERSION(F, ftype, T, ttype) &HU_CONVERT_##F##_##T,
+            #define RVM_THREADED_ENTRY_FUSED(kind, op) &HU_##kind##_##op##_I64,
+            #define RVM_THREADED_ENTRY_REGISTER(op, T, ctype) &HU_R_##op##_##T, &HU_RI_##op##_##T,
+            #define RVM_THREADED_ENTRY_REGISTER_CONVERSION(F, ftype, T, ttype) &HU_R_CONVERT_##F##_##T,
+            RVM_ALL_DECODED_OPS(RVM_THREADED_ENTRY)
+            #undef RVM_THREADED_ENTRY
+            #undef RVM_THREADED_ENTRY_TYPED
+            #undef RVM_THREADED_ENTRY_CONVERSION
+            #undef RVM_THREADED_ENTRY_FUSED
+            #undef RVM_THREADED_ENTRY_REGISTER
+            #undef RVM_THREADED_ENTRY_REGISTER_CONVERSION
+        };
+        static const auto offsets = [] {
+            std::array<ThreadedHandler, std::size(handlers)> out;
+            for (size_t i = 0; i < out.size(); i++) out[i] = ThreadedHandler(i) - ThreadedHandler(DecodedOp::UNKNOWN);
+            return out;
+        }();
+        if (!regs) return offsets.data();
+
+        ThreadedRegs r = *regs;
+        r.handlers = handlers + size_t(DecodedOp::UNKNOWN);
+        while (r.ip) r.handlers[r.ip->handler](r);
+        *regs = r;
+        return offsets.data();
+    }
+}
+
+#endif
+
+rvm::exec::ThreadedHandler rvm::exec::GetThreadedHandler(DecodedOp op, bool checked) {
+    static const ThreadedHandler* table = Execute(nullptr);
+    return table[(checked ? 0 : size_t(DecodedOp::COUNT)) + size_t(op)];
+}
+
+void ExecutionContext::ThreadedLoop() {
+    ThreadedRegs r;
+    r.vm = &vm;
+    r.context = this;
+    ThreadedOps<true>::Restore(r);
+    Execute(&r);
+}
\ No newline at end of file
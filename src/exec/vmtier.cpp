@@ -0,0 +1,66 @@
+#include "vmachine.hpp"
+#include "decoded.hpp"
+#include "../log/log.hpp"
+
+using rvm::exec::VirtualMachine;
+using rvm::exec::DecodedOp;
+using namespace std::literals;
+
+void VirtualMachine::DecodeUnits() {
+    // Every unit is either decoded or stubbed, the memory for anything else is never touched.
+    if (decoded.size() != instructions.size() + 1) {
+        decoded = ZeroedVector<DecodedInstruction>(instructions.size() + 1);
+        decoded.back() = DecodedInstruction();
+        decoded.back().op = DecodedOp::HALT;
+        decoded.back().handler = GetThreadedHandler(DecodedOp::HALT);
+    }
+
+    hotCounts = ZeroedVector<uint32_t>(instructions.size() + 1);
+    for (auto& range : units) {
+        range.promoted = false;
+        if (range.loaded) DecodeUnit(range);
+        else StubUnit(range);
+    }
+    if (tierThreshold == 0) {
+        for (auto& range : units) PromoteUnit(range);
+    }
+}
+
+// Replaces the decoded instructions of a function with the best form available for it. The
+// function may be running: every form keeps instruction indices and frame layout, and both
+// return addresses and loop headers are valid entries into each of them.
+void VirtualMachine::PromoteUnit(GlobalUnitInfo& range) {
+    if (range.promoted || !range.loaded) return;
+    range.promoted = true;
+    hotCounts[range.begin] = tierThreshold;
+    if (!range.code) return;
+
+    for (size_t i = range.begin; i < range.end; i++) {
+        auto& ins = decoded[i];
+        if (ins.op != DecodedOp::JMP_COUNTED && ins.op != DecodedOp::JMPIF_COUNTED) continue;
+        ins.op = ins.op == DecodedOp::JMP_COUNTED ? DecodedOp::JMP : DecodedOp::JMPIF;
+        ins.handler = GetThreadedHandler(ins.op, !range.verified);
+    }
+
+    const char* tier;
+    if (range.verified && jit && CompileUnit(range)) tier = "native code";
+    else if (range.verified && TranslateUnit(range)) tier = "register form";
+    else {
+        FuseUnit(range);
+        tier = "superinstructions";
+    }
+    log::LogInfo("Promoted unit \""s + UnitName(range) + "\" to " + tier + ".");
+}
+
+void VirtualMachine::PromoteUnitAt(size_t index) {
+    auto* unit = FindUnit(index);
+    if (unit) PromoteUnit(units[unit - units.data()]);
+}
+
+// Counts calls whose target was resolved at run time, now that insIndex holds it.
+void rvm::exec::ExecutionContext::CountCallEntry() {
+    auto* unit = vm.FindUnit(insIndex);
+    if (!unit || unit->begin != insIndex) return;
+    auto& count = vm.hotCounts[insIndex];
+    if (count < vm.tierThreshold && ++count == vm.tierThreshold) vm.PromoteUnitAt(insIndex);
+}
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include "vmachine.hpp"
+#include "instruction.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+using rvm::exec::VirtualMachine;
+using namespace std::literals;
+
+namespace {
+    constexpr int32_t Addressed = -4;
+    constexpr int32_t NotSeen = -2;
+    constexpr int32_t Conflicting = -1;
+
+    void Merge(int32_t& current, int32_t value) {
+        if (current == Addressed) return;
+        if (current == NotSeen) current = value;
+        else if (current != value) current = Conflicting;
+    }
+
+    struct FlowState {
+        int32_t depth = -1;
+        int32_t locals = 0;
+    };
+
+    bool IsNumeric(rvm::exec::DataType t) {
+        return t >= rvm::exec::DataType::I8 && t <= rvm::exec::DataType::F64;
+    }
+}
+
+void VirtualMachine::Verify() {
+    log::LogInfo("Verifying bytecode.");
+    stackDepths.assign(instructions.size(), -1);
+    localCounts.assign(instructions.size(), 0);
+
+    std::unordered_map<size_t, size_t> unitAt;
+    for (size_t i = 0; i < units.size(); i++) {
+        if (units[i].code) unitAt.insert_or_assign(units[i].begin, i);
+    }
+
+    // Argument counts seen at direct call sites and value counts of every ret, per unit. A unit
+    // whose address is taken may also be called indirectly or spawned with any count. One
+    // that is neither called directly nor addressed can only be the entry, run without arguments.
+    std::vector<int32_t> arities(units.size(), NotSeen);
+    std::vector<int32_t> returns(units.size(), NotSeen);
+    for (size_t u = 0; u < units.size(); u++) {
+        if (!units[u].code) continue;
+
+        for (size_t i = units[u].begin; i < units[u].end; i += InstructionUnit::InstructionLength(instructions, i)) {
+            auto& header = instructions[i].ins;
+            if (header.code == OpCode::RET) {
+                Merge(returns[u], std::max(header.data, 0));
+            }
+            else if (header.code == OpCode::CALL && links[i].kind == LinkedSymbol::Kind::UNIT && unitAt.contains(links[i].target)) {
+                Merge(arities[unitAt.at(links[i].target)], std::max(header.data, 0));
+            }
+            else if (header.code == OpCode::GETGLOBAL && links[i].kind == LinkedSymbol::Kind::UNIT && unitAt.contains(links[i].target)) {
+                arities[unitAt.at(links[i].target)] = Addressed;
+            }
+        }
+    }
+
+    size_t verified = 0;
+    for (auto& unit : units) {
+        unit.verified = unit.code && VerifyUnit(unit, arities, returns);
+        if (unit.verified) verified++;
+    }
+
+    for (size_t i = 0; i < links.size(); i++) {
+        auto& link = links[i];
+        if (link.kind == LinkedSymbol::Kind::UNIT && instructions[i].ins.code == OpCode::CALL) {
+            link.tail = IsTailCall(i + link.length, link.target, instructions[i].ins.data);
+        }
+    }
+    log::LogInfo("Verified "s + std::to_string(verified) + " of " + std::to_string(units.size()) + " units.");
+}
+
+bool VirtualMachine::VerifyUnit(GlobalUnitInfo& unit, const std::vector<int32_t>& arities, const std::vector<int32_t>& returns) {
+    auto index = &unit - &units[0];
+    auto reject = [this, &unit] (const std::string& reason) {
+        log::LogWarning("Unit \""s + UnitName(unit) + "\" not verified: " + reason + ".");
+        return false;
+    };
+
+    // Kept even if the unit is rejected below, a checked callee can still be called in tail position.
+    unit.returns = returns[index] == NotSeen ? 0 : returns[index];
+    if (returns[index] == Conflicting) return reject("returns different numbers of values");
+    if (arities[index] == Conflicting) return reject("called with different argument counts");
+    if (arities[index] == Addressed) return reject("address taken, so the argument count is not known");
+    unit.args = arities[index] == NotSeen ? 0 : arities[index];
+
+    auto size = unit.end - unit.begin;
+    std::vector<bool> starts(size, false);
+    for (size_t i = unit.begin; i < unit.end; i += InstructionUnit::InstructionLength(instructions, i)) {
+        starts[i - unit.begin] = true;
+    }
+
+    std::vector<FlowState> states(size);
+    std::vector<size_t> work;
+    std::string error;
+
+    auto flow = [&] (int64_t target, FlowState state) {
+        if (target < int64_t(unit.begin) || target >= int64_t(unit.end)) {
+            error = "control flow leaves the unit";
+            return false;
+        }
+        if (!starts[target - unit.begin]) {
+            error = "jump into the middle of an instruction";
+            return false;
+        }
+
+        auto& known = states[target - unit.begin];
+        if (known.depth < 0) {
+            known = state;
+            work.push_back(target);
+            return true;
+        }
+        if (known.depth != state.depth || known.locals != state.locals) {
+            error = "stack depth or locals differ between paths";
+            return false;
+        }
+        return true;
+    };
+
+    int32_t maxStack = 0;
+    states[0] = {0, unit.args};
+    work.push_back(unit.begin);
+
+    while (!work.empty()) {
+        auto i = work.back();
+        work.pop_back();
+
+        auto state = states[i - unit.begin];
+        auto& header = instructions[i].ins;
+        auto next = int64_t(i + InstructionUnit::InstructionLength(instructions, i));
+
+        auto pops = [&] (int32_t n) {
+            if (state.depth < n) {
+                error = "stack underflow";
+                return false;
+            }
+            state.depth -= n;
+            return true;
+        };
+        auto local = [&] (int32_t n) {
+            if (n < 0 || n >= state.locals) {
+                error = "local index out of range";
+                return false;
+            }
+            return true;
+        };
+
+        using Op = OpCode;
+        bool ok = true;
+        bool falls = true;
+        switch (header.code) {
+            case Op::NOP:
+                break;
+            case Op::HALT:
+                falls = false;
+                break;
+            case Op::LOAD:
+                ok = local(header.data);
+                state.depth++;
+                break;
+            case Op::STORE:
+                ok = pops(1) && local(header.data);
+                break;
+            case Op::LOADCONST:
+            case Op::GETGLOBAL:
+                state.depth++;
+                break;
+            case Op::STORECONST:
+                ok = local(header.data);
+                break;
+            case Op::CONVERT: {
+                auto from = header.optype[0];
+                auto to = header.optype[1];
+                if (from == to || to == DataType::PTR) break;
+                ok = pops(1);
+                if (IsNumeric(from) && IsNumeric(to)) state.depth++;
+                break;
+            }
+            case Op::ADD:
+            case Op::SUB:
+            case Op::MUL:
+            case Op::DIV:
+            case Op::LAND:
+            case Op::LOR:
+            case Op::GT:
+            case Op::GEQ:
+            case Op::LT:
+            case Op::LEQ:
+            case Op::EQ:
+            case Op::NOTEQ:
+            case Op::BAND:
+            case Op::BOR:
+            case Op::BXOR:
+            case Op::LSHIFT:
+            case Op::RSHIFT:
+                ok = pops(2);
+                state.depth++;
+                break;
+            case Op::LNOT:
+            case Op::BNOT:
+                ok = pops(1);
+                state.depth++;
+                break;
+            case Op::JMP:
+                ok = flow(int64_t(i) + header.data, state);
+                falls = false;
+                break;
+            case Op::JMPIF:
+                ok = pops(1) && flow(int64_t(i) + header.data, state);
+                break;
+            case Op::CREATELOCALS:
+                state.locals += std::max(header.data, 0);
+                break;
+            case Op::CALL: {
+                auto& link = links[i];
+                if (link.kind == LinkedSymbol::Kind::BUILTIN) {
+                    auto& builtIn = builtInFunctions[link.target];
+                    ok = pops(builtIn.pops);
+                    state.depth += builtIn.pushes;
+                    break;
+                }
+
+                auto* callee = FindUnit(link.target);
+                if (!callee || !callee->code) {
+                    ok = false;
+                    error = "call to a data unit";
+                    break;
+                }
+
+                auto calleeReturns = returns[callee - &units[0]];
+                if (calleeReturns == Conflicting) {
+                    ok = false;
+                    error = "callee returns a varying number of values";
+                    break;
+                }
+                ok = pops(std::max(header.data, 0));
+                state.depth += std::max(calleeReturns, 0);
+                break;
+            }
+            case Op::RET:
+                ok = pops(std::max(header.data, 0));
+                falls = false;
+                break;
+            case Op::CALLINDIRECT:
+                // Only accepted in tail position, where the ret takes its values from the callee.
+                // The ret is reached when the call turns out not to be a tail call, and always
+                // runs checked, so it is entered with the count it returns, whatever the callee
+                // returned.
+                if (next >= int64_t(unit.end) || instructions[next].ins.code != Op::RET) {
+                    ok = false;
+                    error = "indirect call with unknown stack effect";
+                    break;
+                }
+                ok = pops(std::max(header.data, 0) + 1);
+                state.depth += std::max(instructions[next].ins.data, 0);
+                break;
+            case Op::SPAWN:
+                ok = pops(std::max(header.data, 0) + 1);
+                state.depth++;
+                break;
+            case Op::YIELD:
+                break;
+            case Op::JOIN:
+                ok = pops(1);
+                state.depth += std::max(header.data, 0);
+                break;
+            case Op::ATOMICLOAD:
+                ok = pops(1);
+                state.depth++;
+                break;
+            case Op::ATOMICSTORE:
+                ok = pops(2);
+                break;
+            case Op::ATOMICADD:
+                ok = pops(2);
+                state.depth++;
+                break;
+            case Op::ATOMICCAS:
+                ok = pops(3);
+                state.depth++;
+                break;
+            case Op::FENCE:
+                break;
+            default:
+                ok = false;
+                error = "unknown instruction";
+                break;
+        }
+
+        if (!ok) return reject(error);
+        maxStack = std::max(maxStack, state.locals - unit.args + state.depth);
+        if (falls && !flow(next, state)) return reject(error);
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        stackDepths[unit.begin + i] = states[i].depth;
+        localCounts[unit.begin + i] = states[i].locals;
+    }
+    unit.maxStack = maxStack;
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "x64.hpp"
+
+#include <cstring>
+#include <utility>
+
+#if RVM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using rvm::exec::x64::Assembler;
+using rvm::exec::x64::ExecutableCode;
+using rvm::exec::x64::Reg;
+using rvm::exec::x64::Xmm;
+
+namespace {
+    constexpr uint8_t REXW = 0x48;
+
+    uint8_t Direct(uint8_t reg, uint8_t rm) {
+        return 0xC0 | (reg << 3) | rm;
+    }
+
+    uint8_t Number(Reg reg) {
+        return uint8_t(reg);
+    }
+
+    uint8_t Number(Xmm reg) {
+        return uint8_t(reg);
+    }
+}
+
+void Assembler::Emit(std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+void Assembler::Emit32(uint32_t value) {
+    for (int i = 0; i < 4; i++) code.push_back(uint8_t(value >> (8 * i)));
+}
+
+// [rdi + 8 * slot] as the r/m operand, with a 32 bit displacement.
+void Assembler::SlotOperand(uint8_t reg, int32_t slot) {
+    Emit({uint8_t(0x80 | (reg << 3) | Number(Reg::RDI))});
+    Emit32(uint32_t(slot * 8));
+}
+
+void Assembler::LoadSlot(Reg dst, int32_t slot, int bytes) {
+    switch (bytes) {
+        case 1: Emit({REXW, 0x0F, 0xBE}); break;
+        case 2: Emit({REXW, 0x0F, 0xBF}); break;
+        case 4: Emit({REXW, 0x63}); break;
+        default: Emit({REXW, 0x8B}); break;
+    }
+    SlotOperand(Number(dst), slot);
+}
+
+void Assembler::StoreSlot(int32_t slot, Reg src) {
+    Emit({REXW, 0x89});
+    SlotOperand(Number(src), slot);
+}
+
+void Assembler::LoadImmediate(Reg dst, int64_t value) {
+    Emit({REXW, uint8_t(0xB8 + Number(dst))});
+    Emit32(uint32_t(value));
+    Emit32(uint32_t(uint64_t(value) >> 32));
+}
+
+void Assembler::LoadSlot(Xmm dst, int32_t slot) {
+    Emit({0xF2, 0x0F, 0x10});
+    SlotOperand(Number(dst), slot);
+}
+
+void Assembler::StoreSlot(int32_t slot, Xmm src) {
+    Emit({0xF2, 0x0F, 0x11});
+    SlotOperand(Number(src), slot);
+}
+
+void Assembler::Alu(AluOp op, Reg dst, Reg src, bool wide) {
+    if (wide) Emit({REXW});
+    Emit({uint8_t(op), Direct(Number(src), Number(dst))});
+}
+
+void Assembler::Multiply(Reg dst, Reg src) {
+    Emit({REXW, 0x0F, 0xAF, Direct(Number(dst), Number(src))});
+}
+
+void Assembler::Not(Reg reg) {
+    Emit({REXW, 0xF7, Direct(2, Number(reg))});
+}
+
+void Assembler::ShiftLeft(Reg reg) {
+    Emit({REXW, 0xD3, Direct(4, Number(reg))});
+}
+
+void Assembler::ShiftRight(Reg reg) {
+    Emit({REXW, 0xD3, Direct(7, Number(reg))});
+}
+
+void Assembler::Sse(SseOp op, Xmm dst, Xmm src) {
+    Emit({0xF2, 0x0F, uint8_t(op), Direct(Number(dst), Number(src))});
+}
+
+void Assembler::CompareF64(Xmm lhs, Xmm rhs) {
+    Emit({0x66, 0x0F, 0x2E, Direct(Number(lhs), Number(rhs))});
+}
+
+void Assembler::CompareSlotByte(int32_t slot, int8_t value) {
+    Emit({0x80});
+    SlotOperand(7, slot);
+    Emit({uint8_t(value)});
+}
+
+void Assembler::SetCondition(Condition cc, Reg dst) {
+    Emit({0x0F, uint8_t(0x90 + uint8_t(cc)), Direct(0, Number(dst))});
+}
+
+void Assembler::ZeroExtend(Reg reg, int bytes) {
+    switch (bytes) {
+        case 1: Emit({0x0F, 0xB6, Direct(Number(reg), Number(reg))}); break;
+        case 2: Emit({0x0F, 0xB7, Direct(Number(reg), Number(reg))}); break;
+        case 4: Emit({0x89, Direct(Number(reg), Number(reg))}); break;
+        default: break;
+    }
+}
+
+void Assembler::ConvertToF64(Xmm dst, Reg src) {
+    Emit({0xF2, REXW, 0x0F, 0x2A, Direct(Number(dst), Number(src))});
+}
+
+void Assembler::ConvertF64(Reg dst, Xmm src, bool wide) {
+    if (wide) Emit({0xF2, REXW, 0x0F, 0x2C, Direct(Number(dst), Number(src))});
+    else Emit({0xF2, 0x0F, 0x2C, Direct(Number(dst), Number(src))});
+}
+
+size_t Assembler::Jump() {
+    Emit({0xE9});
+    Emit32(0);
+    return code.size() - 4;
+}
+
+size_t Assembler::JumpIf(Condition cc) {
+    Emit({0x0F, uint8_t(0x80 + uint8_t(cc))});
+    Emit32(0);
+    return code.size() - 4;
+}
+
+void Assembler::Patch(size_t at, size_t target) {
+    auto offset = uint32_t(int64_t(target) - int64_t(at + 4));
+    for (int i = 0; i < 4; i++) code[at + i] = uint8_t(offset >> (8 * i));
+}
+
+void Assembler::Return(uint32_t value) {
+    Emit({0xB8});
+    Emit32(value);
+    Emit({0xC3});
+}
+
+ExecutableCode::ExecutableCode(const std::vector<uint8_t>& code) {
+#if RVM_JIT
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    size = (code.size() + page - 1) / page * page;
+    memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        memory = nullptr;
+        return;
+    }
+
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        memory = nullptr;
+    }
+#endif
+}
+
+ExecutableCode::ExecutableCode(ExecutableCode&& other) noexcept
+    : memory(std::exchange(other.memory, nullptr)), size(std::exchange(other.size, 0)) { }
+
+ExecutableCode::~ExecutableCode() {
+#if RVM_JIT
+    if (memory) munmap(memory, size);
+#endif
+}
\ No newline at end of file
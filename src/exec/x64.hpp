@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(RVM_NO_JIT)
+#define RVM_JIT 1
+#else
+#define RVM_JIT 0
+#endif
+
+namespace rvm::exec::x64 {
+    enum class Reg : uint8_t {
+        RAX = 0,
+        RCX = 1,
+        RDX = 2,
+        RDI = 7
+    };
+
+    enum class Xmm : uint8_t {
+        XMM0 = 0,
+        XMM1 = 1
+    };
+
+    // Condition codes as encoded in jcc and setcc.
+    enum class Condition : uint8_t {
+        B = 0x2,
+        AE = 0x3,
+        E = 0x4,
+        NE = 0x5,
+        BE = 0x6,
+        A = 0x7,
+        P = 0xA,
+        NP = 0xB,
+        L = 0xC,
+        GE = 0xD,
+        LE = 0xE,
+        G = 0xF
+    };
+
+    enum class AluOp : uint8_t {
+        ADD = 0x01,
+        OR = 0x09,
+        AND = 0x21,
+        SUB = 0x29,
+        XOR = 0x31,
+        CMP = 0x39
+    };
+
+    enum class SseOp : uint8_t {
+        ADD = 0x58,
+        MUL = 0x59,
+        SUB = 0x5C,
+        DIV = 0x5E
+    };
+
+    // Emits the few x86-64 instructions the template JIT is made of. Memory operands are
+    // always value slots addressed from rdi, which holds the frame pointer in native code.
+    class Assembler {
+    public:
+        // mov dst, [slot], sign extending `bytes` wide values.
+        void LoadSlot(Reg dst, int32_t slot, int bytes = 8);
+        void StoreSlot(int32_t slot, Reg src);
+        void LoadImmediate(Reg dst, int64_t value);
+        void LoadSlot(Xmm dst, int32_t slot);
+        void StoreSlot(int32_t slot, Xmm src);
+
+        void Alu(AluOp op, Reg dst, Reg src, bool wide = true);
+        void Multiply(Reg dst, Reg src);
+        void Not(Reg reg);
+        void ShiftLeft(Reg reg);
+        void ShiftRight(Reg reg);
+        void Sse(SseOp op, Xmm dst, Xmm src);
+        void CompareF64(Xmm lhs, Xmm rhs);
+        void CompareSlotByte(int32_t slot, int8_t value);
+
+        void SetCondition(Condition cc, Reg dst);
+        // Clears everything above the low `bytes` bytes.
+        void ZeroExtend(Reg reg, int bytes);
+        void ConvertToF64(Xmm dst, Reg src);
+        void ConvertF64(Reg dst, Xmm src, bool wide);
+
+        // Both return the position of the rel32 to resolve with Patch.
+        size_t Jump();
+        size_t JumpIf(Condition cc);
+        void Patch(size_t at, size_t target);
+        void Return(uint32_t value);
+
+        size_t Size() const { return code.size(); }
+        const std::vector<uint8_t>& Code() const { return code; }
+
+    private:
+        void Emit(std::initializer_list<uint8_t> bytes);
+        void Emit32(uint32_t value);
+        void SlotOperand(uint8_t reg, int32_t slot);
+
+        std::vector<uint8_t> code;
+    };
+
+    // Executable, read only copy of assembled code.
+    class ExecutableCode {
+    public:
+        explicit ExecutableCode(const std::vector<uint8_t>& code);
+        ExecutableCode(ExecutableCode&& other) noexcept;
+        ExecutableCode(const ExecutableCode&) = delete;
+        ExecutableCode& operator=(const ExecutableCode&) = delete;
+        ~ExecutableCode();
+
+        bool Valid() const { return memory != nullptr; }
+        void* At(size_t offset) const { return (uint8_t*) memory + offset; }
+
+    private:
+        void* memory = nullptr;
+        size_t size = 0;
+    };
+}
\ No newline at end of file
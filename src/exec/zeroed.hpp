@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace rvm::exec {
+    // Hands out zero-filled memory and leaves out value initialization, so a vector created with
+    // a size costs nothing until its pages are touched. Elements start out as zero bytes rather
+    // than default constructed, and memory kept from before a shrink is not zeroed again.
+    template <typename T>
+    struct ZeroedAllocator {
+        using value_type = T;
+
+        ZeroedAllocator() = default;
+        template <typename U>
+        ZeroedAllocator(const ZeroedAllocator<U>&) { }
+
+        T* allocate(size_t n) {
+            auto* memory = std::calloc(n, sizeof(T));
+            if (!memory) throw std::bad_alloc();
+            return static_cast<T*>(memory);
+        }
+
+        void deallocate(T* memory, size_t) {
+            std::free(memory);
+        }
+
+        template <typename U>
+        void construct(U*) noexcept { }
+
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args) {
+            ::new ((void*) p) U(std::forward<Args>(args)...);
+        }
+
+        bool operator==(const ZeroedAllocator&) const { return true; }
+    };
+
+    template <typename T>
+    using ZeroedVector = std::vector<T, ZeroedAllocator<T>>;
+}
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "cache.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string_view>
+#include <system_error>
+
+using rvm::loading::CodeCache;
+using rvm::loading::GlobalDataUnit;
+using rvm::loading::MappedImage;
+namespace fs = std::filesystem;
+namespace ldg = rvm::loading;
+using namespace std::literals;
+
+namespace {
+    constexpr char EntryMagic[4] = {'R', 'V', 'M', 'C'};
+    // Changes whenever the VM or the optimizer would load the same files differently, which
+    // makes every existing entry stale.
+    constexpr uint32_t EntryVersion = 1;
+
+    // The image follows the header and the state follows the image.
+    struct EntryHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint64_t imageSize;
+        uint64_t stateSize;
+        // Hash of the image and the state.
+        uint64_t checksum;
+    };
+
+    static_assert(sizeof(EntryHeader) % 8 == 0);
+
+    constexpr uint64_t HashSeed = 0xCBF29CE484222325;
+
+    // Tells apart inputs that differ by accident, not ones made to collide.
+    uint64_t Hash(std::string_view data, uint64_t hash = HashSeed) {
+        constexpr uint64_t Prime = 0x100000001B3;
+        size_t i = 0;
+        for (; i + 8 <= data.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data.data() + i, 8);
+            hash = (hash ^ word) * Prime;
+            hash ^= hash >> 29;
+        }
+        for (; i < data.size(); i++) hash = (hash ^ uint8_t(data[i])) * Prime;
+        return hash;
+    }
+
+    uint64_t Hash(uint64_t value, uint64_t hash) {
+        return Hash(std::string_view((const char*) &value, sizeof(value)), hash);
+    }
+
+    // Hashes the next `size` bytes of a stream in pieces, the same as if all at once.
+    bool HashStream(std::istream& in, uint64_t size, uint64_t& hash) {
+        std::string buffer(size_t(1) << 20, '\0');
+        while (size > 0) {
+            auto piece = std::min<uint64_t>(size, buffer.size());
+            if (!in.read(buffer.data(), std::streamsize(piece))) return false;
+            hash = Hash(std::string_view(buffer.data(), piece), hash);
+            size -= piece;
+        }
+        return true;
+    }
+
+    fs::path Directory() {
+        auto* cache = std::getenv("XDG_CACHE_HOME");
+        if (cache && *cache) return fs::path(cache) / "rvm";
+        auto* home = std::getenv("HOME");
+        if (home && *home) return fs::path(home) / ".cache" / "rvm";
+        return {};
+    }
+}
+
+CodeCache::CodeCache(const std::vector<std::string>& paths, const std::string& options) {
+    auto directory = Directory();
+    if (directory.empty()) return;
+
+    key = Hash(options, Hash(EntryVersion, Hash(paths.size(), 0)));
+    for (auto& path : paths) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in.is_open()) return;
+        auto size = uint64_t(in.tellg());
+        in.seekg(0);
+        key = Hash(size, key);
+        if (!HashStream(in, size, key)) return;
+    }
+
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+    entry = directory / (name + ".rvmc"s);
+}
+
+std::unique_ptr<MappedImage> CodeCache::Load(std::string& state) const {
+    if (entry.empty()) return nullptr;
+    std::ifstream in(entry, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) return nullptr;
+
+    auto size = uint64_t(in.tellg());
+    in.seekg(0);
+    EntryHeader header;
+    uint64_t checksum = HashSeed;
+    auto valid = size >= sizeof(EntryHeader) && in.read((char*) &header, sizeof(EntryHeader))
+        && std::memcmp(header.magic, EntryMagic, sizeof(EntryMagic)) == 0 && header.version == EntryVersion && header.key == key
+        && header.imageSize % 8 == 0 && header.imageSize <= size - sizeof(EntryHeader) && header.stateSize == size - sizeof(EntryHeader) - header.imageSize
+        && HashStream(in, header.imageSize, checksum);
+    if (valid) {
+        state.resize(header.stateSize);
+        valid = in.read(state.data(), std::streamsize(state.size())) && Hash(state, checksum) == header.checksum;
+    }
+    if (!valid) {
+        rvm::log::LogWarning("Ignoring stale or damaged cache entry \""s + entry.string() + "\".");
+        return nullptr;
+    }
+
+    auto image = MappedImage::Open(entry.string(), sizeof(EntryHeader));
+    if (!image) return nullptr;
+    rvm::log::LogInfo("Loaded cache entry \""s + entry.string() + "\".");
+    return image;
+}
+
+// The entry is written under another name first, so other runs only ever see complete entries.
+void CodeCache::Store(const std::vector<GlobalDataUnit>& units, const std::string& state) const {
+    if (entry.empty()) return;
+
+    // Images are whole instruction units, so hashing the state after the image matches hashing
+    // them in pieces.
+    auto image = ldg::Serialize(units, ldg::Format::V2);
+    EntryHeader header = {{EntryMagic[0], EntryMagic[1], EntryMagic[2], EntryMagic[3]}, EntryVersion, key, image.size(), state.size(), Hash(state, Hash(image))};
+
+    std::error_code error;
+    fs::create_directories(entry.parent_path(), error);
+    auto temporary = entry;
+    temporary += "." + std::to_string(std::random_device()());
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write((const char*) &header, sizeof(EntryHeader));
+        out.write(image.data(), std::streamsize(image.size()));
+        out.write(state.data(), std::streamsize(state.size()));
+        if (!out) error = std::make_error_code(std::errc::io_error);
+    }
+    if (!error) fs::rename(temporary, entry, error);
+    if (error) {
+        fs::remove(temporary, error);
+        rvm::log::LogWarning("Could not write cache entry \""s + entry.string() + "\".");
+        return;
+    }
+    rvm::log::LogInfo("Wrote cache entry \""s + entry.string() + "\".");
+}
\ No newline at end of file
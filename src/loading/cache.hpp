@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "loading.hpp"
+
+namespace rvm::loading {
+    // Programs as they were loaded before, kept in $XDG_CACHE_HOME/rvm, or ~/.cache/rvm, as a
+    // version 2 executable together with what the VM saved about it.
+    class CodeCache {
+    public:
+        // The entry is keyed by the contents of the files and by `options`, which names anything
+        // else that changes the loaded code.
+        CodeCache(const std::vector<std::string>& paths, const std::string& options);
+
+        // False if there is nowhere to cache or the files can not be read.
+        bool Enabled() const { return !entry.empty(); }
+        // Returns nullptr if there is no entry, or the entry is stale or damaged.
+        std::unique_ptr<MappedImage> Load(std::string& state) const;
+        // Failing to write the entry only leaves it out of later runs.
+        void Store(const std::vector<GlobalDataUnit>& units, const std::string& state) const;
+
+    private:
+        std::filesystem::path entry;
+        uint64_t key = 0;
+    };
+}
\ No newline at end of file
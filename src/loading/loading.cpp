@@ -1,10 +1,146 @@
 #include "loading.hpp"
 #include "../exec/instruction.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include "../log/log.hpp"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define RVM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define RVM_MMAP 0
+#endif
+
+using rvm::exec::InstructionUnit;
 using rvm::loading::GlobalDataUnit;
+using rvm::loading::MappedImage;
 namespace ldg = rvm::loading;
+using namespace std::literals;
+
+namespace {
+    // Version 1 files start with a decimal digit, so they never begin with this.
+    constexpr char ImageMagic[4] = {'\x7F', 'R', 'V', 'M'};
+    constexpr uint32_t ImageVersion = 2;
+
+    struct ImageHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t unitCount;
+        // Bytes of names following the symbol table.
+        uint32_t namesSize;
+        // File offset of the code, a multiple of 8, and its size in instruction units.
+        uint64_t codeOffset;
+        uint64_t codeSize;
+    };
+
+    struct ImageSymbol {
+        // Name position within the names, excluding its terminating zero byte.
+        uint32_t nameOffset;
+        uint32_t nameSize;
+        // Unit position within the code, in instruction units.
+        uint64_t begin;
+        uint64_t size;
+    };
+
+    static_assert(sizeof(ImageHeader) == 32 && sizeof(ImageSymbol) == 24);
+
+    bool IsImage(const char* data, size_t size) {
+        return size >= sizeof(ImageMagic) && std::memcmp(data, ImageMagic, sizeof(ImageMagic)) == 0;
+    }
+
+    void InvalidImage(const std::string& reason) {
+        rvm::log::LogError("Invalid executable: "s + reason + ".");
+    }
+
+    // Reads the header and symbol table of a version 2 image. Unit names point into `data`.
+    std::vector<MappedImage::Unit> ReadImage(const char* data, size_t size, ImageHeader& header) {
+        if (size < sizeof(ImageHeader)) InvalidImage("truncated header");
+        std::memcpy(&header, data, sizeof(ImageHeader));
+        if (header.version != ImageVersion) InvalidImage("unsupported version "s + std::to_string(header.version));
+
+        uint64_t table = sizeof(ImageHeader);
+        uint64_t names = table + uint64_t(header.unitCount) * sizeof(ImageSymbol);
+        uint64_t namesEnd = names + header.namesSize;
+        if (namesEnd > size) InvalidImage("truncated symbol table");
+        if (header.codeOffset % sizeof(InstructionUnit) != 0 || header.codeOffset < namesEnd || header.codeOffset > size
+            || header.codeSize > (size - header.codeOffset) / sizeof(InstructionUnit)) InvalidImage("bad code section");
+
+        std::vector<MappedImage::Unit> units;
+        units.reserve(header.unitCount);
+        uint64_t previousEnd = 0;
+        for (uint32_t u = 0; u < header.unitCount; u++) {
+            ImageSymbol symbol;
+            std::memcpy(&symbol, data + table + u * sizeof(ImageSymbol), sizeof(ImageSymbol));
+            if (uint64_t(symbol.nameOffset) + symbol.nameSize > header.namesSize) InvalidImage("bad symbol name");
+            if (symbol.begin < previousEnd || symbol.begin > header.codeSize || symbol.size > header.codeSize - symbol.begin) {
+                InvalidImage("bad symbol bounds");
+            }
+
+            previousEnd = symbol.begin + symbol.size;
+            units.push_back({std::string_view(data + names + symbol.nameOffset, symbol.nameSize), size_t(symbol.begin), size_t(previousEnd)});
+        }
+        return units;
+    }
+
+    std::string SerializeImage(const std::vector<GlobalDataUnit>& units) {
+        ImageHeader header = {{ImageMagic[0], ImageMagic[1], ImageMagic[2], ImageMagic[3]}, ImageVersion, uint32_t(units.size()), 0, 0, 0};
+        std::vector<ImageSymbol> symbols;
+        std::string names;
+        for (auto& unit : units) {
+            symbols.push_back({uint32_t(names.size()), uint32_t(unit.name.size()), header.codeSize, unit.dataVector.size()});
+            names += unit.name;
+            names += '\0';
+            header.codeSize += unit.dataVector.size();
+        }
+
+        auto namesOffset = sizeof(ImageHeader) + symbols.size() * sizeof(ImageSymbol);
+        header.namesSize = uint32_t(names.size());
+        header.codeOffset = (namesOffset + names.size() + sizeof(InstructionUnit) - 1) / sizeof(InstructionUnit) * sizeof(InstructionUnit);
+
+        std::string out(header.codeOffset + header.codeSize * sizeof(InstructionUnit), '\0');
+        std::memcpy(out.data(), &header, sizeof(ImageHeader));
+        if (!symbols.empty()) std::memcpy(out.data() + sizeof(ImageHeader), symbols.data(), symbols.size() * sizeof(ImageSymbol));
+        std::memcpy(out.data() + namesOffset, names.data(), names.size());
+        for (size_t u = 0; u < units.size(); u++) {
+            auto& data = units[u].dataVector;
+            if (data.empty()) continue;
+            std::memcpy(out.data() + header.codeOffset + symbols[u].begin * sizeof(InstructionUnit), data.data(), data.size() * sizeof(InstructionUnit));
+        }
+        return out;
+    }
+
+    // Reads a decimal length and the 0xFF separator after it.
+    size_t ReadLength(const std::string& code, size_t& index) {
+        auto separator = code.find((char) 0xFF, index);
+        if (separator == std::string::npos) InvalidImage("missing separator");
+
+        size_t length = 0;
+        auto [end, error] = std::from_chars(code.data() + index, code.data() + separator, length);
+        if (error != std::errc() || end != code.data() + separator || length > code.size() - separator - 1) InvalidImage("bad length");
+        index = separator + 1;
+        return length;
+    }
+}
+
+bool ldg::ReadFile(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) return false;
+
+    out.resize(size_t(in.tellg()));
+    in.seekg(0);
+    return bool(in.read(out.data(), std::streamsize(out.size())));
+}
 
 std::string ldg::Serialize(const GlobalDataUnit& unit) {
     std::string out;
@@ -22,7 +158,9 @@ std::string ldg::Serialize(const GlobalDataUnit& unit) {
     return out;
 }
 
-std::string ldg::Serialize(const std::vector<GlobalDataUnit>& units) {
+std::string ldg::Serialize(const std::vector<GlobalDataUnit>& units, Format format) {
+    if (format == Format::V2) return SerializeImage(units);
+
     std::string out;
     for (auto& unit : units) {
         out += Serialize(unit);
@@ -34,47 +172,126 @@ std::vector<GlobalDataUnit> ldg::Deserialize(const std::string& code) {
     rvm::log::LogInfo("Deserializing file.");
     std::vector<GlobalDataUnit> out;
 
-    unsigned int index = 0;
+    if (IsImage(code.data(), code.size())) {
+        ImageHeader header;
+        auto units = ReadImage(code.data(), code.size(), header);
+        auto* image = code.data() + header.codeOffset;
+
+        out.reserve(units.size());
+        for (auto& unit : units) {
+            GlobalDataUnit gdu;
+            gdu.name = unit.name;
+            gdu.dataVector.resize(unit.end - unit.begin);
+            if (unit.end > unit.begin) {
+                std::memcpy(gdu.dataVector.data(), image + unit.begin * sizeof(InstructionUnit), gdu.dataVector.size() * sizeof(InstructionUnit));
+            }
+            out.push_back(std::move(gdu));
+        }
+        rvm::log::LogInfo("Finished deserializing.");
+        return out;
+    }
+
+    size_t index = 0;
     while (index < code.size()) {
-        std::string numberString, nameString, dataString;
         GlobalDataUnit gdu;
 
-        char c = code.at(index++);
-        do {
-            numberString += c;
-            c = code.at(index++);
-        } while (c != (char) 0xFF);
+        auto length = ReadLength(code, index);
+        gdu.name = code.substr(index, length);
+        index += length;
 
-        //index++;
+        // Version 1 data is read as if followed by a zero byte, which takes a unit of its own
+        // when the data fills whole units.
+        length = ReadLength(code, index);
+        gdu.dataVector.resize(length / sizeof(InstructionUnit) + 1);
+        std::memcpy(gdu.dataVector.data(), code.data() + index, length);
+        index += length;
 
-        int length = std::stoi(numberString);
-        for (int i = 0; i < length; i++) {
-            nameString += code.at(index++);
-        }
-        //index++;
-
-        numberString = "";
-        c = code.at(index++);
-        do {
-            numberString += c;
-            c = code.at(index++);
-        } while (c != (char) 0xFF);
-        //index++;
-
-        length = std::stoi(numberString);
-        for (int i = 0; i < length; i++) {
-            dataString += code.at(index++);
-        }
+        out.push_back(std::move(gdu));
+    }
+    rvm::log::LogInfo("Finished deserializing.");
+    return out;
+}
 
-        gdu.name = nameString;
+std::vector<GlobalDataUnit> ldg::DeserializeFiles(const std::vector<std::string>& paths) {
+    std::vector<std::vector<GlobalDataUnit>> files(paths.size());
+    std::vector<char> failed(paths.size(), false);
+    ParallelFor(paths.size(), [&] (size_t f) {
+        std::string code;
+        if (ReadFile(paths[f], code)) files[f] = Deserialize(code);
+        else failed[f] = true;
+    });
 
-        auto dataStream = rvm::exec::InstructionUnit::CreateInstructionDataStream(dataString);
-        for (auto &iu : dataStream) {
-            gdu.dataVector.push_back(iu);
-        }
+    for (size_t f = 0; f < paths.size(); f++) {
+        if (failed[f]) rvm::log::LogError("Could not open input file \""s + paths[f] + "\".");
+    }
+    return MergeFiles(files, paths);
+}
+
+std::vector<GlobalDataUnit> ldg::MergeFiles(std::vector<std::vector<GlobalDataUnit>>& files, const std::vector<std::string>& paths) {
+    size_t total = 0;
+    for (auto& file : files) total += file.size();
 
-        out.push_back(gdu);
+    std::vector<GlobalDataUnit> out;
+    out.reserve(total);
+    std::unordered_map<std::string_view, size_t> definedIn;
+    for (size_t f = 0; f < paths.size(); f++) {
+        for (auto& unit : files[f]) {
+            out.push_back(std::move(unit));
+            auto [defined, added] = definedIn.try_emplace(out.back().name, f);
+            if (!added && defined->second != f) {
+                rvm::log::LogWarning("Unit \""s + out.back().name + "\" in \"" + paths[f] + "\" replaces the one in \"" + paths[defined->second] + "\".");
+            }
+            defined->second = f;
+        }
     }
-    rvm::log::LogInfo("Finished deserializing.");
     return out;
+}
+
+void ldg::ParallelFor(size_t count, const std::function<void(size_t)>& work) {
+    std::atomic<size_t> next = 0;
+    auto worker = [&] {
+        for (auto i = next++; i < count; i = next++) work(i);
+    };
+
+    auto threads = std::min<size_t>(count, std::max(std::thread::hardware_concurrency(), 1u));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) workers.emplace_back(worker);
+    worker();
+    for (auto& thread : workers) thread.join();
+}
+
+std::unique_ptr<MappedImage> MappedImage::Open(const std::string& path, size_t offset) {
+#if RVM_MMAP
+    auto file = open(path.c_str(), O_RDONLY);
+    if (file < 0) return nullptr;
+
+    struct stat status;
+    char magic[sizeof(ImageMagic)];
+    if (offset % sizeof(InstructionUnit) != 0 || fstat(file, &status) != 0 || size_t(status.st_size) < offset + sizeof(ImageHeader)
+        || pread(file, magic, sizeof(magic), off_t(offset)) != ssize_t(sizeof(magic)) || !IsImage(magic, sizeof(magic))) {
+        close(file);
+        return nullptr;
+    }
+
+    auto size = size_t(status.st_size);
+    auto* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    close(file);
+    if (memory == MAP_FAILED) return nullptr;
+
+    rvm::log::LogInfo("Mapping file.");
+    std::unique_ptr<MappedImage> image(new MappedImage(memory, size));
+    ImageHeader header;
+    auto* data = (char*) memory + offset;
+    image->units = ReadImage(data, size - offset, header);
+    image->code = {(InstructionUnit*) (data + header.codeOffset), size_t(header.codeSize)};
+    return image;
+#else
+    return nullptr;
+#endif
+}
+
+MappedImage::~MappedImage() {
+#if RVM_MMAP
+    munmap(memory, size);
+#endif
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 #include "../exec/instruction.hpp"
 
 namespace rvm::loading {
@@ -9,7 +15,58 @@ namespace rvm::loading {
         std::vector<exec::InstructionUnit> dataVector;
     };
 
+    enum class Format {
+        // Text-delimited units, see "Executable format" in the documentation.
+        V1,
+        // Binary header and symbol table followed by all code, 8-byte aligned, so that a
+        // mapped file can be run in place.
+        V2
+    };
+
+    // Reads a whole file. Returns false if it can not be read.
+    bool ReadFile(const std::string& path, std::string& out);
+
     std::string Serialize(const GlobalDataUnit& unit);
-    std::string Serialize(const std::vector<GlobalDataUnit>& units);
+    std::string Serialize(const std::vector<GlobalDataUnit>& units, Format format = Format::V1);
+    // Reads executables of either format.
     std::vector<GlobalDataUnit> Deserialize(const std::string& code);
+    // Reads and deserializes files concurrently. The units come in the order of the files, and
+    // a unit named like one in an earlier file, which takes over that name, is warned about.
+    std::vector<GlobalDataUnit> DeserializeFiles(const std::vector<std::string>& paths);
+    // Moves the units of each file, read from `paths`, into one list the way DeserializeFiles does.
+    std::vector<GlobalDataUnit> MergeFiles(std::vector<std::vector<GlobalDataUnit>>& files, const std::vector<std::string>& paths);
+
+    // Calls `work` for every index below `count`, on up to one thread per core.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& work);
+
+    // A version 2 executable mapped into memory. Its code is used where it lies in the file,
+    // and writes to it stay private to the process.
+    class MappedImage {
+    public:
+        struct Unit {
+            std::string_view name;
+            size_t begin;
+            size_t end;
+        };
+
+        // Returns nullptr for files that can not be mapped or are not version 2 executables. The
+        // executable starts `offset` bytes into the file, a multiple of 8.
+        static std::unique_ptr<MappedImage> Open(const std::string& path, size_t offset = 0);
+
+        MappedImage(const MappedImage&) = delete;
+        MappedImage& operator=(const MappedImage&) = delete;
+        ~MappedImage();
+
+        // Units in the order they appear in the code, with their bounds as code indices.
+        const std::vector<Unit>& Units() const { return units; }
+        std::span<exec::InstructionUnit> Code() const { return code; }
+
+    private:
+        MappedImage(void* memory, size_t size) : memory(memory), size(size) { }
+
+        void* memory;
+        size_t size;
+        std::vector<Unit> units;
+        std::span<exec::InstructionUnit> code;
+    };
 }
\ No newline at end of file
@@ -2,36 +2,45 @@
 
 #include <chrono>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 
-rvm::log::LogCategory rvm::log::LogLevel = rvm::log::LogCategory::ERROR;
+std::atomic<rvm::log::LogCategory> rvm::log::LogLevel = rvm::log::LogCategory::ERROR;
 
-auto ProgramStart = std::chrono::high_resolution_clock::now();
+const auto ProgramStart = std::chrono::high_resolution_clock::now();
 using namespace std::chrono;
 
 namespace {
+    // Lines are written whole, so those of different threads do not interleave.
+    std::mutex OutputMutex;
+
     void Log(const std::string& msg, rvm::log::LogCategory category) {
         if (category < rvm::log::LogLevel) return;
 
         auto currentTime = std::chrono::high_resolution_clock::now();
         auto programDuration = std::chrono::duration_cast<microseconds>(currentTime - ProgramStart).count();
 
-        std::cout << "[T+" << programDuration << "us]\t"; 
+        std::ostringstream line;
+        line << "[T+" << programDuration << "us]\t"; 
 
         using enum rvm::log::LogCategory;
         switch (category) {
             case INFO:
-                std::cout << "[INFO] ";
+                line << "[INFO] ";
                 break;
             case WARNING:
-                std::cout << "[WARNING] ";
+                line << "[WARNING] ";
                 break;
             case ERROR:
-                std::cout << "[ERROR] ";
+                line << "[ERROR] ";
                 break;
             case ALL:
                 break;
         }
-        std::cout << msg << "\n";
+        line << msg << "\n";
+
+        std::lock_guard lock(OutputMutex);
+        std::cout << line.str();
     }
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 
 namespace rvm::log {
@@ -10,7 +11,8 @@ namespace rvm::log {
         ERROR
     };
 
-    extern LogCategory LogLevel;
+    // Safe to change while other threads log.
+    extern std::atomic<LogCategory> LogLevel;
 
     void LogError(const std::string& msg, int code = 1);
     void LogWarning(const std::string& msg);
@@ -1,11 +1,15 @@
 #include <args.hxx>
 
+#include "assembler/assembler.hpp"
 #include "exec/vmachine.hpp"
 #include "loading/loading.hpp"
+#include "loading/cache.hpp"
 #include "log/log.hpp"
+#include "optimize/optimize.hpp"
 #include <cstdlib>
 #include <fstream>
-#include <sstream>
+#include <optional>
+#include <string>
 #include <vector>
 
 void MainError(const char* msg, int code = 1) {
@@ -22,8 +26,24 @@ int main(int argc, char** argv) {
     args::Group executeFlags(parser, "Execution options", args::Group::Validators::DontCare);
     args::ValueFlag<unsigned long> stackSize(executeFlags, "size", "Stack size (in MB).", {"xmS"}, 1);
     args::ValueFlag<unsigned long> localSize(executeFlags, "N", "Number of locals pre-allocated (in thousands).", {"xmL"}, 8);
+    args::ValueFlag<unsigned long> heapSize(executeFlags, "size", "Size of the heap shared by fibers (in MB).", {"xmH"}, 16);
     args::ValueFlag<std::string> entryPoint(executeFlags, "func", "Name of entry function (defaults to \"main\").", {'e', "entry"}, "main");
-
+    args::ValueFlag<std::string> engine(executeFlags, "engine", "Execution engine: switch or threaded (defaults to \"switch\").", {"engine"}, "switch");
+    args::Flag jit(executeFlags, "", "Compile verified functions to native x86-64 code (implies the threaded engine).", {"jit"});
+    args::ValueFlag<unsigned long> tierThreshold(executeFlags, "N", "Calls or loop iterations before the threaded engine optimizes a function (0 optimizes everything at load).", {"tier-threshold"}, 1000);
+    args::ValueFlag<size_t> threads(executeFlags, "N", "Number of threads fibers run on, 0 for one per core (defaults to 1).", {"threads"}, 1);
+    args::Flag lazy(executeFlags, "", "Link, verify and decode each function when it is first called instead of all at load.", {"lazy"});
+    args::Flag profilePairs(executeFlags, "", "Print the most frequently executed opcode pairs (runs on the switch engine).", {"profile-pairs"});
+    args::Flag useCache(executeFlags, "", "Keep loaded programs in a cache under ~/.cache/rvm and start them from it when run again.", {"cache"});
+
+    args::Flag assemble(parser, "", "Assemble the input files, which are assembly source, instead of reading bytecode.", {'a', "assemble"});
+    args::Flag runSource(parser, "", "Assemble the input files and run them (the same as -a without -o).", {"rs"});
+    args::Flag optimize(parser, "", "Optimize the bytecode before running or writing it.", {'O', "optimize"});
+    args::Flag treeShake(parser, "", "Drop the units that the entry function can not reach before running or writing the bytecode.", {"tree-shake"});
+    args::ValueFlag<size_t> inlineSize(parser, "N", "Largest function, in instructions, that -O inlines into its callers (0 disables inlining).", {"inline-size"}, 12);
+    args::ValueFlag<size_t> inlineLimit(parser, "N", "Size, in instructions, up to which -O grows a function by inlining.", {"inline-limit"}, 1000);
+    args::ValueFlag<std::string> outputFile(parser, "file", "Write the bytecode to a file instead of running it.", {'o', "output"});
+    args::ValueFlag<std::string> outputFormat(parser, "format", "Executable format written by -o: v1 or v2 (defaults to \"v1\").", {"format"}, "v1");
     args::Flag verbose(parser, "", "Verbose mode.", {'v', "verbose"});
     
     args::PositionalList<std::string> inputFiles(parser, "files", "Input files.");
@@ -77,25 +97,82 @@ int main(int argc, char** argv) {
     }
 
     if (inputFiles->size() == 0) MainError("Expected input file(s).");
+    if (runSource && outputFile) MainError("--rs runs the source, use -a to write it with -o.");
+    bool source = assemble || runSource;
 
+    auto selectedEngine = rvm::exec::ExecutionEngine::SWITCH;
+    if (engine.Get() == "switch") selectedEngine = rvm::exec::ExecutionEngine::SWITCH;
+    else if (engine.Get() == "threaded") selectedEngine = rvm::exec::ExecutionEngine::THREADED;
+    else MainError("Unknown execution engine.");
+    if (jit) selectedEngine = rvm::exec::ExecutionEngine::THREADED;
 
-    std::vector<rvm::loading::GlobalDataUnit> code;
-    for (auto& inFile : inputFiles) {
-        std::ifstream inStream(inFile);
-        if (!inStream.is_open()) MainError("Could not open input file.");
+    auto selectedFormat = rvm::loading::Format::V1;
+    if (outputFormat.Get() == "v1") selectedFormat = rvm::loading::Format::V1;
+    else if (outputFormat.Get() == "v2") selectedFormat = rvm::loading::Format::V2;
+    else MainError("Unknown executable format.");
 
-        std::stringstream buf;
-        buf << inStream.rdbuf();
+    rvm::exec::VirtualMachine vm(stackSize.Get() * 1024 * 1024 / 8, localSize.Get() * 1000);
 
-        auto deserialized = rvm::loading::Deserialize(buf.str());
+    // With --cache, programs that are run come from the cache when they were run before.
+    // Otherwise a single version 2 executable that is only run is used in place, without reading it.
+    std::optional<rvm::loading::CodeCache> cache;
+    if (!outputFile && useCache) {
+        std::string options = source ? "-a" : "";
+        if (treeShake) options += " --tree-shake " + entryPoint.Get();
+        if (optimize) options += " -O " + std::to_string(inlineSize.Get()) + " " + std::to_string(inlineLimit.Get());
+        options += " " + vm.ResolutionsKey();
+        cache.emplace(*inputFiles, options);
+        if (!cache->Enabled()) cache.reset();
+    }
 
-        for (auto& unit : deserialized) code.push_back(unit);
+    std::unique_ptr<rvm::loading::MappedImage> image;
+    std::string resolutions;
+    if (cache) image = cache->Load(resolutions);
+    auto cached = bool(image);
+    if (!image && !cache && inputFiles->size() == 1 && !source && !optimize && !treeShake && !outputFile) image = rvm::loading::MappedImage::Open(inputFiles->front());
+
+    std::vector<rvm::loading::GlobalDataUnit> code;
+    if (!image && source) code = rvm::assembler::AssembleFiles(*inputFiles);
+    else if (!image) code = rvm::loading::DeserializeFiles(*inputFiles);
+
+    // Shaking again after inlining drops the functions that were only called where they got inlined.
+    if (treeShake && !image) rvm::optimize::TreeShake(code, entryPoint.Get());
+    if (optimize && !image) {
+        rvm::optimize::Optimize(code, {inlineSize.Get(), inlineLimit.Get()});
+        if (treeShake) rvm::optimize::TreeShake(code, entryPoint.Get());
+    }
+    if (outputFile) {
+        std::ofstream outStream(outputFile.Get(), std::ios::binary);
+        if (!outStream.is_open()) MainError("Could not open output file.");
+        outStream << rvm::loading::Serialize(code, selectedFormat);
+        return 0;
     }
 
-    rvm::exec::VirtualMachine vm(stackSize.Get() * 1024 * 1024 / 8, localSize.Get() * 1000);
-    vm.LoadBytecode(code);
+    vm.SetEngine(selectedEngine);
+    vm.SetJit(bool(jit));
+    vm.SetTierThreshold(uint32_t(tierThreshold.Get()));
+    vm.SetLazyLoading(bool(lazy));
+    vm.SetThreads(threads.Get());
+    vm.SetHeapSize(heapSize.Get() * 1024 * 1024);
+    vm.SetPairProfiling(bool(profilePairs));
+    if (image) vm.LoadImage(std::move(image), resolutions);
+    else vm.LoadBytecode(code);
+    if (cache && !cached) cache->Store(code, vm.SaveResolutions());
     vm.Run(entryPoint.Get());
 
+    if (profilePairs) {
+        auto profile = vm.GetPairProfile();
+        uint64_t total = 0;
+        for (auto& pair : profile) total += pair.count;
+
+        std::cout << "Opcode pair profile (" << total << " pairs):\n";
+        for (size_t i = 0; i < profile.size() && i < 20; i++) {
+            auto& pair = profile[i];
+            std::cout << "  " << rvm::exec::OpCodeName(pair.first) << " -> " << rvm::exec::OpCodeName(pair.second)
+                << "\t" << pair.count << "\t(" << (100.0 * pair.count / total) << "%)\n";
+        }
+    }
+
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "function.hpp"
+#include <algorithm>
+#include <cstdint>
+
+using rvm::exec::DataType;
+using rvm::exec::InstructionHeader;
+using rvm::exec::InstructionUnit;
+using rvm::exec::OpCode;
+using rvm::loading::GlobalDataUnit;
+using rvm::optimize::Function;
+using rvm::optimize::Node;
+namespace opt = rvm::optimize;
+
+bool opt::IsJump(OpCode code) {
+    return code == OpCode::JMP || code == OpCode::JMPIF;
+}
+
+bool opt::FallsThrough(OpCode code) {
+    return code != OpCode::JMP && code != OpCode::RET && code != OpCode::HALT;
+}
+
+bool opt::IsNumeric(DataType t) {
+    return t >= DataType::I8 && t <= DataType::F64;
+}
+
+bool opt::IsNoOpConvert(const InstructionHeader& header) {
+    return header.code == OpCode::CONVERT && (header.optype[0] == header.optype[1] || header.optype[1] == DataType::PTR);
+}
+
+bool opt::IsDroppingConvert(const InstructionHeader& header) {
+    return header.code == OpCode::CONVERT && !IsNoOpConvert(header)
+        && (!IsNumeric(header.optype[0]) || !IsNumeric(header.optype[1]));
+}
+
+std::string opt::SymbolName(const Node& node) {
+    return std::string((const char*) node.payload.data());
+}
+
+// Splits a unit into its instructions. Only units that read as a valid instruction stream,
+// end in a jmp, ret or halt and only jump to their own instructions are taken as functions.
+// Deserialized units are padded with a zero unit, so trailing nops are ignored, but a jump
+// to one of them would run off the end and is not accepted.
+bool opt::Decode(const GlobalDataUnit& unit, Function& out) {
+    auto& data = unit.dataVector;
+    std::vector<size_t> nodeAt(data.size(), SIZE_MAX);
+    std::vector<size_t> offsets;
+
+    for (size_t i = 0; i < data.size();) {
+        auto length = InstructionUnit::InstructionLength(data, i);
+        if (length == 0) return false;
+
+        nodeAt[i] = out.size();
+        offsets.push_back(i);
+        out.push_back({data[i].ins, std::vector<InstructionUnit>(data.begin() + i + 1, data.begin() + i + length)});
+        i += length;
+    }
+    auto last = std::find_if(out.rbegin(), out.rend(), [] (const Node& node) { return node.header.code != OpCode::NOP; });
+    if (last == out.rend() || FallsThrough(last->header.code)) return false;
+    auto end = size_t(out.rend() - last);
+
+    for (size_t n = 0; n < out.size(); n++) {
+        auto& node = out[n];
+        if (!IsJump(node.header.code)) continue;
+
+        auto target = int64_t(offsets[n]) + node.header.data;
+        if (target < 0 || target >= int64_t(data.size()) || nodeAt[target] >= end) return false;
+        node.target = nodeAt[target];
+    }
+    return true;
+}
+
+std::vector<InstructionUnit> opt::Encode(const Function& code) {
+    std::vector<size_t> offsets;
+    size_t size = 0;
+    for (auto& node : code) {
+        offsets.push_back(size);
+        size += 1 + node.payload.size();
+    }
+
+    std::vector<InstructionUnit> out;
+    out.reserve(size);
+    for (size_t n = 0; n < code.size(); n++) {
+        auto header = code[n].header;
+        if (IsJump(header.code)) header.data = int32_t(int64_t(offsets[code[n].target]) - int64_t(offsets[n]));
+        out.emplace_back(header);
+        out.insert(out.end(), code[n].payload.begin(), code[n].payload.end());
+    }
+    return out;
+}
+
+// Drops dead instructions. A jump to a dropped instruction lands on the next one left.
+void opt::Compact(Function& code) {
+    std::vector<size_t> remap(code.size() + 1);
+    size_t live = 0;
+    for (size_t n = 0; n < code.size(); n++) {
+        remap[n] = live;
+        if (!code[n].dead) live++;
+    }
+    remap[code.size()] = live;
+
+    Function out;
+    out.reserve(live);
+    bool toEnd = false;
+    for (auto& node : code) {
+        if (node.dead) continue;
+        node.target = remap[node.target];
+        toEnd |= IsJump(node.header.code) && node.target == live;
+        out.push_back(std::move(node));
+    }
+    if (toEnd || out.empty()) out.push_back(Node());
+    code = std::move(out);
+}
+
+std::vector<bool> opt::JumpTargets(const Function& code) {
+    std::vector<bool> targets(code.size() + 1, false);
+    for (auto& node : code) {
+        if (IsJump(node.header.code)) targets[node.target] = true;
+    }
+    return targets;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include "optimize.hpp"
+#include "../exec/instruction.hpp"
+#include "../loading/loading.hpp"
+
+namespace rvm::optimize {
+    // One instruction with its inline data. Jumps refer to other instructions by position
+    // instead of by offset, so instructions can be dropped without fixing up every jump.
+    struct Node {
+        exec::InstructionHeader header;
+        std::vector<exec::InstructionUnit> payload;
+        size_t target = 0;
+        bool dead = false;
+    };
+
+    using Function = std::vector<Node>;
+
+    bool IsJump(exec::OpCode code);
+    bool FallsThrough(exec::OpCode code);
+    bool IsNumeric(exec::DataType t);
+    // Conversions that leave the value alone, and conversions that consume it without pushing a result.
+    bool IsNoOpConvert(const exec::InstructionHeader& header);
+    bool IsDroppingConvert(const exec::InstructionHeader& header);
+    // Name referenced by a call or getglobal.
+    std::string SymbolName(const Node& node);
+
+    bool Decode(const loading::GlobalDataUnit& unit, Function& out);
+    std::vector<exec::InstructionUnit> Encode(const Function& code);
+    void Compact(Function& code);
+    std::vector<bool> JumpTargets(const Function& code);
+
+    // Splices small functions into their callers, callees first, and runs `simplify` on every
+    // function that changed. `functions` is indexed like `units`, empty for units that are
+    // not taken as functions.
+    void InlineCalls(const std::vector<loading::GlobalDataUnit>& units, std::vector<std::optional<Function>>& functions,
+        const Options& options, const std::function<void(Function&)>& simplify);
+}
\ No newline at end of file
@@ -0,0 +1,350 @@
+#include "function.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+using rvm::exec::InstructionUnit;
+using rvm::exec::OpCode;
+using rvm::loading::GlobalDataUnit;
+using rvm::optimize::Function;
+using rvm::optimize::Node;
+namespace opt = rvm::optimize;
+using namespace std::literals;
+
+namespace {
+    constexpr int32_t NotSeen = -2;
+    constexpr int32_t Conflicting = -1;
+
+    void Merge(int32_t& current, int32_t value) {
+        if (current == NotSeen) current = value;
+        else if (current != value) current = Conflicting;
+    }
+
+    bool AccessesLocal(OpCode op) {
+        return op == OpCode::LOAD || op == OpCode::STORE || op == OpCode::STORECONST;
+    }
+
+    Node LocalAccess(OpCode op, int32_t local) {
+        Node node;
+        node.header.code = op;
+        node.header.data = local;
+        if (op == OpCode::STORECONST) node.payload.emplace_back();
+        return node;
+    }
+
+    // Locals a function creates with a createlocals as its first instruction, or -1 if it
+    // creates locals anywhere else, where the number of locals would depend on the path taken.
+    int32_t EntryLocals(const Function& code) {
+        auto targets = opt::JumpTargets(code);
+        for (size_t n = 1; n < code.size(); n++) {
+            if (code[n].header.code == OpCode::CREATELOCALS) return -1;
+        }
+        if (code[0].header.code != OpCode::CREATELOCALS) return 0;
+        return targets[0] ? -1 : std::max(code[0].header.data, 0);
+    }
+
+    bool LocalsBelow(const Function& code, int32_t count) {
+        return std::all_of(code.begin(), code.end(), [count] (const Node& node) {
+            return !AccessesLocal(node.header.code) || (node.header.data >= 0 && node.header.data < count);
+        });
+    }
+
+    class Inliner {
+    public:
+        Inliner(const std::vector<GlobalDataUnit>& units, std::vector<std::optional<Function>>& functions, const opt::Options& options);
+
+        std::vector<size_t> Order() const;
+        bool InlineInto(size_t caller);
+        size_t Inlined() const { return inlined; }
+
+    private:
+        struct Site {
+            size_t callee;
+            int32_t args;
+            int32_t created;
+        };
+
+        std::optional<size_t> CalleeOf(const Node& node) const;
+        bool ReturnsCleanly(const Function& code) const;
+        std::optional<Site> Inlinable(size_t caller, const Node& call) const;
+
+        std::vector<std::optional<Function>>& functions;
+        const opt::Options& options;
+        std::unordered_map<std::string, size_t> unitNamed;
+        // Argument counts of the direct calls to each unit and value counts of its rets.
+        std::vector<int32_t> arities;
+        std::vector<int32_t> returns;
+        std::vector<bool> addressed;
+        size_t inlined = 0;
+    };
+
+    Inliner::Inliner(const std::vector<GlobalDataUnit>& units, std::vector<std::optional<Function>>& functions, const opt::Options& options)
+        : functions(functions), options(options), arities(units.size(), NotSeen), returns(units.size(), NotSeen), addressed(units.size(), false) {
+        // Like the VM, a name stands for the last unit loaded under it.
+        for (size_t u = 0; u < units.size(); u++) unitNamed.insert_or_assign(units[u].name, u);
+
+        for (size_t u = 0; u < units.size(); u++) {
+            auto& data = units[u].dataVector;
+            for (size_t i = 0; i < data.size();) {
+                auto length = InstructionUnit::InstructionLength(data, i);
+                if (length == 0) break;
+
+                auto op = data[i].ins.code;
+                auto named = op == OpCode::CALL || op == OpCode::GETGLOBAL ? unitNamed.find((const char*) &data[i + 1]) : unitNamed.end();
+                if (named != unitNamed.end() && op == OpCode::CALL) Merge(arities[named->second], std::max(data[i].ins.data, 0));
+                else if (named != unitNamed.end()) addressed[named->second] = true;
+                i += length;
+            }
+        }
+
+        for (size_t u = 0; u < functions.size(); u++) {
+            if (!functions[u]) continue;
+            for (auto& node : *functions[u]) {
+                if (node.header.code == OpCode::RET) Merge(returns[u], std::max(node.header.data, 0));
+            }
+        }
+    }
+
+    // Built-in functions, all named with a leading "__", take precedence over units.
+    std::optional<size_t> Inliner::CalleeOf(const Node& node) const {
+        if (node.header.code != OpCode::CALL) return std::nullopt;
+
+        auto name = opt::SymbolName(node);
+        auto named = unitNamed.find(name);
+        if (name.starts_with("__") || named == unitNamed.end() || !functions[named->second]) return std::nullopt;
+        return named->second;
+    }
+
+    // Callees come before their callers, except along recursive calls.
+    std::vector<size_t> Inliner::Order() const {
+        std::vector<size_t> order;
+        std::vector<bool> visited(functions.size(), false);
+        std::vector<std::pair<size_t, size_t>> path;
+
+        for (size_t root = 0; root < functions.size(); root++) {
+            if (!functions[root] || visited[root]) continue;
+            visited[root] = true;
+            path.push_back({root, 0});
+
+            while (!path.empty()) {
+                auto& [u, next] = path.back();
+                auto& code = *functions[u];
+                if (next == code.size()) {
+                    order.push_back(u);
+                    path.pop_back();
+                    continue;
+                }
+
+                auto callee = CalleeOf(code[next++]);
+                if (callee && !visited[*callee]) {
+                    visited[*callee] = true;
+                    path.push_back({*callee, 0});
+                }
+            }
+        }
+        return order;
+    }
+
+    // Whether every ret finds exactly the values it returns on the operand stack, so it can
+    // become a jump out of the inlined body without leaving anything behind.
+    bool Inliner::ReturnsCleanly(const Function& code) const {
+        std::vector<int32_t> depths(code.size() + 1, -1);
+        std::vector<size_t> work = {0};
+        depths[0] = 0;
+
+        while (!work.empty()) {
+            auto n = work.back();
+            work.pop_back();
+            if (n == code.size()) return false;
+
+            auto& header = code[n].header;
+            int32_t pops = 0, pushes = 0;
+            switch (header.code) {
+                case OpCode::NOP:
+                case OpCode::STORECONST:
+                case OpCode::CREATELOCALS:
+                case OpCode::JMP:
+                case OpCode::YIELD:
+                case OpCode::FENCE:
+                    break;
+                case OpCode::HALT:
+                    continue;
+                case OpCode::LOAD:
+                case OpCode::LOADCONST:
+                case OpCode::GETGLOBAL:
+                    pushes = 1;
+                    break;
+                case OpCode::STORE:
+                case OpCode::JMPIF:
+                    pops = 1;
+                    break;
+                case OpCode::CONVERT:
+                    if (opt::IsNoOpConvert(header)) break;
+                    pops = 1;
+                    pushes = opt::IsDroppingConvert(header) ? 0 : 1;
+                    break;
+                case OpCode::LNOT:
+                case OpCode::BNOT:
+                case OpCode::ATOMICLOAD:
+                    pops = 1;
+                    pushes = 1;
+                    break;
+                case OpCode::CALL: {
+                    auto callee = CalleeOf(code[n]);
+                    if (!callee || returns[*callee] < 0) return false;
+                    pops = std::max(header.data, 0);
+                    pushes = returns[*callee];
+                    break;
+                }
+                case OpCode::RET:
+                    if (depths[n] != std::max(header.data, 0)) return false;
+                    continue;
+                case OpCode::CALLINDIRECT:
+                    return false;
+                case OpCode::SPAWN:
+                    pops = std::max(header.data, 0) + 1;
+                    pushes = 1;
+                    break;
+                case OpCode::JOIN:
+                    pops = 1;
+                    pushes = std::max(header.data, 0);
+                    break;
+                case OpCode::ATOMICSTORE:
+                    pops = 2;
+                    break;
+                case OpCode::ATOMICCAS:
+                    pops = 3;
+                    pushes = 1;
+                    break;
+                default:
+                    pops = 2;
+                    pushes = 1;
+                    break;
+            }
+
+            if (depths[n] < pops) return false;
+            auto depth = depths[n] - pops + pushes;
+            auto flow = [&] (size_t target) {
+                if (depths[target] < 0) {
+                    depths[target] = depth;
+                    work.push_back(target);
+                }
+                return depths[target] == depth;
+            };
+            if (opt::IsJump(header.code) && !flow(code[n].target)) return false;
+            if (opt::FallsThrough(header.code) && !flow(n + 1)) return false;
+        }
+        return true;
+    }
+
+    std::optional<Inliner::Site> Inliner::Inlinable(size_t caller, const Node& call) const {
+        auto callee = CalleeOf(call);
+        if (!callee || *callee == caller) return std::nullopt;
+
+        auto& code = *functions[*callee];
+        if (code.size() > options.inlineSize) return std::nullopt;
+        for (auto& node : code) {
+            if (CalleeOf(node) == callee) return std::nullopt;
+        }
+
+        auto args = std::max(call.header.data, 0);
+        auto created = EntryLocals(code);
+        if (created < 0 || !LocalsBelow(code, args + created) || !ReturnsCleanly(code)) return std::nullopt;
+        return Site {*callee, args, created};
+    }
+
+    // Callee locals go after all locals of the caller, which therefore must have the same
+    // number of locals everywhere: its arguments plus what a createlocals at its start adds.
+    // That createlocals is extended, or added, to make room for the callee locals.
+    bool Inliner::InlineInto(size_t caller) {
+        auto& code = *functions[caller];
+        auto arity = arities[caller] == NotSeen ? 0 : arities[caller];
+        auto created = EntryLocals(code);
+        if (addressed[caller] || arity < 0 || created < 0) return false;
+
+        auto base = arity + created;
+        if (!LocalsBelow(code, base)) return false;
+
+        std::vector<std::optional<Site>> sites(code.size());
+        size_t size = code.size();
+        int32_t extra = 0;
+        for (size_t n = 0; n < code.size(); n++) {
+            auto site = Inlinable(caller, code[n]);
+            if (!site) continue;
+
+            auto& callee = *functions[site->callee];
+            auto skip = callee[0].header.code == OpCode::CREATELOCALS ? 1 : 0;
+            auto grown = size + site->args + site->created + callee.size() - skip - 1;
+            if (grown > options.inlineLimit) continue;
+
+            size = grown;
+            extra = std::max(extra, site->args + site->created);
+            sites[n] = site;
+        }
+        if (std::none_of(sites.begin(), sites.end(), [] (auto& site) { return site.has_value(); })) return false;
+
+        bool entry = code[0].header.code == OpCode::CREATELOCALS;
+        bool prepend = !entry && extra > 0;
+        std::vector<size_t> start(code.size() + 1);
+        size_t position = prepend ? 1 : 0;
+        for (size_t n = 0; n < code.size(); n++) {
+            start[n] = position;
+            if (!sites[n]) {
+                position++;
+                continue;
+            }
+            auto& callee = *functions[sites[n]->callee];
+            auto skip = callee[0].header.code == OpCode::CREATELOCALS ? 1 : 0;
+            position += sites[n]->args + sites[n]->created + callee.size() - skip;
+        }
+        start[code.size()] = position;
+
+        Function out;
+        out.reserve(position);
+        if (prepend) out.push_back(LocalAccess(OpCode::CREATELOCALS, extra));
+        for (size_t n = 0; n < code.size(); n++) {
+            if (!sites[n]) {
+                auto node = code[n];
+                if (opt::IsJump(node.header.code)) node.target = start[node.target];
+                if (n == 0 && entry) node.header.data = created + extra;
+                out.push_back(std::move(node));
+                continue;
+            }
+
+            // Arguments are taken off the stack as the callee would find them, first argument
+            // on top. Created locals start out zero on every call.
+            auto& site = *sites[n];
+            for (int32_t k = 0; k < site.args; k++) out.push_back(LocalAccess(OpCode::STORE, base + k));
+            for (int32_t k = site.args; k < site.args + site.created; k++) out.push_back(LocalAccess(OpCode::STORECONST, base + k));
+
+            auto& callee = *functions[site.callee];
+            auto skip = callee[0].header.code == OpCode::CREATELOCALS ? 1 : 0;
+            auto body = out.size() - skip;
+            for (size_t k = skip; k < callee.size(); k++) {
+                auto node = callee[k];
+                if (AccessesLocal(node.header.code)) node.header.data += base;
+                if (opt::IsJump(node.header.code)) node.target += body;
+                if (node.header.code == OpCode::RET) {
+                    node = Node();
+                    node.header.code = OpCode::JMP;
+                    node.target = start[n + 1];
+                }
+                out.push_back(std::move(node));
+            }
+            inlined++;
+        }
+
+        opt::Compact(out);
+        code = std::move(out);
+        return true;
+    }
+}
+
+void opt::InlineCalls(const std::vector<GlobalDataUnit>& units, std::vector<std::optional<Function>>& functions,
+    const Options& options, const std::function<void(Function&)>& simplify) {
+    Inliner inliner(units, functions, options);
+    for (auto u : inliner.Order()) {
+        if (inliner.InlineInto(u)) simplify(*functions[u]);
+    }
+    rvm::log::LogInfo("Inlined "s + std::to_string(inliner.Inlined()) + " calls.");
+}
\ No newline at end of file
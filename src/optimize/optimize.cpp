@@ -0,0 +1,382 @@
+#include "optimize.hpp"
+#include "function.hpp"
+#include "../exec/instruction.hpp"
+#include "../log/log.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+
+using rvm::exec::DataType;
+using rvm::exec::InstructionHeader;
+using rvm::exec::InstructionUnit;
+using rvm::exec::OpCode;
+using rvm::exec::VMValue;
+using rvm::loading::GlobalDataUnit;
+using rvm::optimize::Function;
+using rvm::optimize::Node;
+namespace opt = rvm::optimize;
+using namespace std::literals;
+
+namespace {
+    // Liveness is only tracked for locals below this index, the rest are always live.
+    constexpr int32_t TrackedLocals = 1 << 16;
+
+    // Calls `f` with a value of the C++ type the VM computes `t` in, and `Default` for
+    // the types it has no arithmetic for.
+    template <typename Default, typename F>
+    auto WithType(DataType t, F f) {
+        switch (t) {
+            case DataType::I8: return f(int8_t());
+            case DataType::I16: return f(int16_t());
+            case DataType::I32: return f(int32_t());
+            case DataType::I64: return f(int64_t());
+            case DataType::F32: return f(float());
+            case DataType::F64: return f(double());
+            default: return f(Default());
+        }
+    }
+
+    // Folds exactly what the instruction handlers compute. Whatever traps at run time, or
+    // is left to the hardware, is not folded.
+    bool FoldBinary(const InstructionHeader& header, VMValue lhs, VMValue rhs, VMValue& result) {
+        result = VMValue();
+        auto arithmetic = [&] (auto op) {
+            return WithType<int64_t>(header.optype[0], [&] (auto type) {
+                using T = decltype(type);
+                result.As<T>() = T(op(lhs.As<T>(), rhs.As<T>()));
+                return true;
+            });
+        };
+        auto compare = [&] (auto op) {
+            return WithType<void*>(header.optype[0], [&] (auto type) {
+                using T = decltype(type);
+                result.i8 = op(lhs.As<T>(), rhs.As<T>());
+                return true;
+            });
+        };
+        auto shift = rhs.i64 % 64;
+
+        switch (header.code) {
+            case OpCode::ADD: return arithmetic(std::plus<>());
+            case OpCode::SUB: return arithmetic(std::minus<>());
+            case OpCode::MUL: return arithmetic(std::multiplies<>());
+            case OpCode::DIV:
+                return WithType<int64_t>(header.optype[0], [&] (auto type) {
+                    using T = decltype(type);
+                    auto divisor = rhs.As<T>();
+                    if constexpr (std::is_integral_v<T>) {
+                        if (divisor == 0 || (divisor == -1 && lhs.As<T>() == std::numeric_limits<T>::min())) return false;
+                    }
+                    result.As<T>() = T(lhs.As<T>() / divisor);
+                    return true;
+                });
+            case OpCode::GT: return compare(std::greater<>());
+            case OpCode::GEQ: return compare(std::greater_equal<>());
+            case OpCode::LT: return compare(std::less<>());
+            case OpCode::LEQ: return compare(std::less_equal<>());
+            case OpCode::EQ: return compare(std::equal_to<>());
+            case OpCode::NOTEQ: return compare(std::not_equal_to<>());
+            case OpCode::LAND:
+                result.i8 = lhs.i8 && rhs.i8;
+                return true;
+            case OpCode::LOR:
+                result.i8 = lhs.i8 || rhs.i8;
+                return true;
+            case OpCode::BAND:
+                result.i64 = lhs.i64 & rhs.i64;
+                return true;
+            case OpCode::BOR:
+                result.i64 = lhs.i64 | rhs.i64;
+                return true;
+            case OpCode::BXOR:
+                result.i64 = lhs.i64 ^ rhs.i64;
+                return true;
+            case OpCode::LSHIFT:
+                if (shift < 0) return false;
+                result.i64 = lhs.i64 << shift;
+                return true;
+            case OpCode::RSHIFT:
+                if (shift < 0) return false;
+                result.i64 = lhs.i64 >> shift;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool FoldConvert(DataType from, DataType to, VMValue value, VMValue& result) {
+        if (from == to || !opt::IsNumeric(from) || !opt::IsNumeric(to)) return false;
+
+        return WithType<int64_t>(from, [&] (auto source) {
+            return WithType<int64_t>(to, [&] (auto destination) {
+                using From = decltype(source);
+                using To = decltype(destination);
+                auto v = value.As<From>();
+                if constexpr (std::is_floating_point_v<From> && std::is_integral_v<To>) {
+                    auto limit = -double(std::numeric_limits<To>::min());
+                    if (!(v > -limit - 1 && v < limit)) return false;
+                }
+                result.As<To>() = To(v);
+                return true;
+            });
+        });
+    }
+
+    bool FoldUnary(const InstructionHeader& header, VMValue value, VMValue& result) {
+        result = VMValue();
+        switch (header.code) {
+            case OpCode::LNOT:
+                result.i8 = !value.i8;
+                return true;
+            case OpCode::BNOT:
+                result.i64 = ~value.i64;
+                return true;
+            case OpCode::CONVERT:
+                return FoldConvert(header.optype[0], header.optype[1], value, result);
+            default:
+                return false;
+        }
+    }
+
+    // Locals that may be read after each instruction. Decoded functions never run past their
+    // end, so nothing is live there.
+    std::vector<std::vector<bool>> LiveLocals(const Function& code) {
+        auto local = [] (const Node& node) {
+            auto op = node.header.code;
+            bool access = op == OpCode::LOAD || op == OpCode::STORE || op == OpCode::STORECONST;
+            return access && node.header.data < TrackedLocals ? node.header.data : -1;
+        };
+
+        size_t count = 0;
+        for (auto& node : code) count = std::max(count, size_t(local(node) + 1));
+
+        std::vector<std::vector<bool>> in(code.size() + 1, std::vector<bool>(count, false));
+        std::vector<std::vector<bool>> out(code.size(), std::vector<bool>(count, false));
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t n = code.size(); n-- > 0;) {
+                auto& node = code[n];
+                auto op = node.header.code;
+                auto& after = out[n];
+                for (size_t k = 0; k < count; k++) {
+                    after[k] = (opt::IsJump(op) && in[node.target][k]) || (opt::FallsThrough(op) && in[n + 1][k]);
+                }
+
+                auto before = after;
+                auto index = local(node);
+                if (index >= 0) before[index] = op == OpCode::LOAD;
+                if (before != in[n]) {
+                    in[n] = std::move(before);
+                    changed = true;
+                }
+            }
+        }
+        return out;
+    }
+
+    bool ThreadJumps(Function& code) {
+        bool changed = false;
+        for (size_t n = 0; n < code.size(); n++) {
+            auto& node = code[n];
+            if (!opt::IsJump(node.header.code)) continue;
+
+            // Skip over chains of unconditional jumps, unless they loop forever.
+            auto target = node.target;
+            for (size_t hops = 0; hops < code.size() && code[target].header.code == OpCode::JMP; hops++) {
+                target = code[target].target;
+            }
+            if (code[target].header.code != OpCode::JMP && target != node.target) {
+                node.target = target;
+                changed = true;
+            }
+
+            if (node.header.code != OpCode::JMP) continue;
+            auto& landing = code[node.target].header;
+            if (landing.code == OpCode::RET || landing.code == OpCode::HALT) {
+                node.header = landing;
+                changed = true;
+            }
+            else if (node.target == n + 1) {
+                node.dead = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool RemoveUnreachable(Function& code) {
+        std::vector<bool> reached(code.size() + 1, false);
+        std::vector<size_t> work = {0};
+        while (!work.empty()) {
+            auto n = work.back();
+            work.pop_back();
+            if (reached[n]) continue;
+            reached[n] = true;
+            if (n == code.size()) continue;
+
+            auto op = code[n].header.code;
+            if (opt::IsJump(op)) work.push_back(code[n].target);
+            if (opt::FallsThrough(op)) work.push_back(n + 1);
+        }
+
+        bool changed = false;
+        for (size_t n = 0; n < code.size(); n++) {
+            if (reached[n] || code[n].dead) continue;
+            code[n].dead = true;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Folds constants and forwards stores to locals over short windows of instructions. Only
+    // the first instruction of a window may be a jump target.
+    bool Peephole(Function& code) {
+        auto targets = opt::JumpTargets(code);
+        auto live = LiveLocals(code);
+        auto deadAfter = [&] (size_t n, int32_t local) {
+            return local >= 0 && size_t(local) < live[n].size() && !live[n][local];
+        };
+
+        bool changed = false;
+        auto kill = [&changed] (Node& node) {
+            node.dead = true;
+            changed = true;
+        };
+
+        for (size_t i = 0; i < code.size(); i++) {
+            auto& a = code[i];
+            if (a.dead) continue;
+
+            auto follows = [&] (size_t k) -> Node* {
+                for (size_t j = i + 1; j <= i + k; j++) {
+                    if (j >= code.size() || targets[j] || code[j].dead) return nullptr;
+                }
+                return &code[i + k];
+            };
+            auto* b = follows(1);
+            auto* c = follows(2);
+            auto op = a.header.code;
+            auto next = b ? b->header.code : OpCode::NOP;
+
+            // A jump past the last instruction needs an instruction to land on, see Compact.
+            bool landing = i + 1 == code.size() && targets[i];
+            if ((op == OpCode::NOP && !landing) || opt::IsNoOpConvert(a.header)) {
+                kill(a);
+            }
+            else if (op == OpCode::LOADCONST && b) {
+                auto value = a.payload[0].data;
+                VMValue result;
+                if (next == OpCode::LOADCONST && c && FoldBinary(c->header, value, b->payload[0].data, result)) {
+                    a.payload[0] = InstructionUnit(result);
+                    kill(*b);
+                    kill(*c);
+                }
+                else if (opt::IsDroppingConvert(b->header)) {
+                    kill(a);
+                    kill(*b);
+                }
+                else if (FoldUnary(b->header, value, result)) {
+                    a.payload[0] = InstructionUnit(result);
+                    kill(*b);
+                }
+                else if (next == OpCode::JMPIF && value.i8) {
+                    a.header.code = OpCode::JMP;
+                    a.target = b->target;
+                    a.payload.clear();
+                    kill(*b);
+                }
+                else if (next == OpCode::JMPIF) {
+                    kill(a);
+                    kill(*b);
+                }
+                else if (next == OpCode::STORE) {
+                    a.header.code = OpCode::STORECONST;
+                    a.header.data = b->header.data;
+                    kill(*b);
+                }
+            }
+            else if (op == OpCode::STORECONST && deadAfter(i, a.header.data)) {
+                kill(a);
+            }
+            else if (op == OpCode::STORECONST && next == OpCode::LOAD && b->header.data == a.header.data) {
+                b->header = InstructionHeader();
+                b->header.code = OpCode::LOADCONST;
+                b->payload = a.payload;
+                changed = true;
+            }
+            else if (op == OpCode::STORE && next == OpCode::LOAD && b->header.data == a.header.data
+                && deadAfter(i + 1, a.header.data)) {
+                kill(a);
+                kill(*b);
+            }
+            else if (op == OpCode::LOAD && next == OpCode::STORE && a.header.data >= 0
+                && (b->header.data == a.header.data || deadAfter(i + 1, b->header.data))) {
+                kill(a);
+                kill(*b);
+            }
+        }
+        return changed;
+    }
+
+    void Simplify(Function& code) {
+        bool changed = true;
+        while (changed) {
+            changed = ThreadJumps(code);
+            opt::Compact(code);
+            changed |= RemoveUnreachable(code);
+            opt::Compact(code);
+            changed |= Peephole(code);
+            opt::Compact(code);
+        }
+    }
+}
+
+void opt::Optimize(std::vector<GlobalDataUnit>& units, const Options& options) {
+    rvm::log::LogInfo("Optimizing bytecode.");
+
+    // Units whose address is taken but that are never called may well be data that happens
+    // to read as instructions.
+    std::unordered_set<std::string> called, addressed;
+    for (auto& unit : units) {
+        auto& data = unit.dataVector;
+        for (size_t i = 0; i < data.size();) {
+            auto length = InstructionUnit::InstructionLength(data, i);
+            if (length == 0) break;
+
+            auto op = data[i].ins.code;
+            if (op == OpCode::CALL) called.insert((const char*) &data[i + 1]);
+            else if (op == OpCode::GETGLOBAL) addressed.insert((const char*) &data[i + 1]);
+            i += length;
+        }
+    }
+
+    std::vector<std::optional<Function>> functions(units.size());
+    for (size_t u = 0; u < units.size(); u++) {
+        if (addressed.contains(units[u].name) && !called.contains(units[u].name)) continue;
+
+        Function code;
+        if (!Decode(units[u], code)) continue;
+        Simplify(code);
+        functions[u] = std::move(code);
+    }
+    if (options.inlineSize > 0) InlineCalls(units, functions, options, Simplify);
+
+    size_t before = 0, after = 0, optimized = 0;
+    for (size_t u = 0; u < units.size(); u++) {
+        if (!functions[u]) continue;
+
+        auto encoded = Encode(*functions[u]);
+        before += units[u].dataVector.size();
+        after += encoded.size();
+        optimized++;
+        units[u].dataVector = std::move(encoded);
+    }
+    rvm::log::LogInfo("Optimized "s + std::to_string(optimized) + " functions from " + std::to_string(before)
+        + " to " + std::to_string(after) + " instruction units.");
+}
\ No newline at end of file
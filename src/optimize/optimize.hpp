@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+#include "../loading/loading.hpp"
+
+namespace rvm::optimize {
+    struct Options {
+        // Functions of up to this many instructions are inlined into their callers, 0 disables inlining.
+        size_t inlineSize = 12;
+        // Inlining stops growing a function once it has this many instructions.
+        size_t inlineLimit = 1000;
+    };
+
+    // Rewrites the functions among `units` into equivalent, usually shorter code: inlining,
+    // constant folding, store/load forwarding, jump threading and unreachable code removal.
+    // Units that do not read as functions are left untouched.
+    void Optimize(std::vector<loading::GlobalDataUnit>& units, const Options& options = Options());
+
+    // Drops the units that can not be reached from `entry` through the names in call and
+    // getglobal instructions, which includes every function whose address is taken. Units
+    // that do not read as functions are kept when reached, but not looked into.
+    void TreeShake(std::vector<loading::GlobalDataUnit>& units, std::string_view entry);
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "optimize.hpp"
+#include "../exec/instruction.hpp"
+#include "../log/log.hpp"
+#include <string>
+#include <unordered_map>
+
+using rvm::exec::InstructionUnit;
+using rvm::exec::OpCode;
+using rvm::loading::GlobalDataUnit;
+namespace opt = rvm::optimize;
+using namespace std::literals;
+
+namespace {
+    // Names a unit refers to, none if it does not read as an instruction stream, like the VM
+    // links only those units.
+    std::vector<std::string_view> References(const std::vector<InstructionUnit>& data) {
+        std::vector<std::string_view> names;
+        for (size_t i = 0; i < data.size();) {
+            auto length = InstructionUnit::InstructionLength(data, i);
+            if (length == 0) return {};
+
+            auto op = data[i].ins.code;
+            if (op == OpCode::CALL || op == OpCode::GETGLOBAL) names.emplace_back((const char*) &data[i + 1]);
+            i += length;
+        }
+        return names;
+    }
+}
+
+void opt::TreeShake(std::vector<GlobalDataUnit>& units, std::string_view entry) {
+    // Like the VM, a name stands for the last unit loaded under it. A call to a name that is
+    // also a built-in function still keeps the unit.
+    std::unordered_map<std::string_view, size_t> unitNamed;
+    for (size_t u = 0; u < units.size(); u++) unitNamed.insert_or_assign(units[u].name, u);
+
+    auto root = unitNamed.find(entry);
+    if (root == unitNamed.end()) rvm::log::LogError("Unable to find entry function: "s + std::string(entry) + ".");
+
+    std::vector<bool> reachable(units.size(), false);
+    std::vector<size_t> work = {root->second};
+    reachable[root->second] = true;
+    while (!work.empty()) {
+        auto u = work.back();
+        work.pop_back();
+        for (auto name : References(units[u].dataVector)) {
+            auto target = unitNamed.find(name);
+            if (target == unitNamed.end() || reachable[target->second]) continue;
+            reachable[target->second] = true;
+            work.push_back(target->second);
+        }
+    }
+
+    auto total = units.size();
+    size_t kept = 0;
+    for (size_t u = 0; u < total; u++) {
+        if (!reachable[u]) continue;
+        if (kept != u) units[kept] = std::move(units[u]);
+        kept++;
+    }
+    units.resize(kept);
+    rvm::log::LogInfo("Tree shaking removed "s + std::to_string(total - kept) + " of " + std::to_string(total) + " units.");
+}
\ No newline at end of file
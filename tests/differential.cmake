@@ -0,0 +1,78 @@
+# Runs PROGRAM, an assembly source, on the switch engine and checks that it prints what the
+# .out file next to it holds, then that it prints the same in every other configuration, read
+# back from executables of both formats, tree shaken, and started from the code cache.
+#   cmake -DRVM=<rvm executable> -DPROGRAM=<file.rvas> -DWORK=<scratch directory> -P differential.cmake
+
+set(configurations
+    "--engine threaded"
+    "--engine threaded --tier-threshold 0"
+    "--jit"
+    "--jit --tier-threshold 0"
+    "--engine threaded --lazy"
+    "--engine threaded --threads 3"
+    "-O"
+    "-O --jit --tier-threshold 0"
+    "--tree-shake"
+    "-O --tree-shake --engine threaded"
+)
+
+get_filename_component(name ${PROGRAM} NAME_WE)
+get_filename_component(directory ${PROGRAM} DIRECTORY)
+if(NOT EXISTS ${directory}/${name}.out)
+    message(FATAL_ERROR "${PROGRAM} has no expected output in ${directory}/${name}.out")
+endif()
+# The output, then "exit" and the exit status.
+file(READ ${directory}/${name}.out expected)
+
+function(run_program out)
+    execute_process(
+        COMMAND ${ARGN}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output
+        RESULT_VARIABLE result
+        TIMEOUT 120
+    )
+    # Log lines carry the time since start.
+    string(REGEX REPLACE "\\[T\\+[0-9]+us\\]" "" output "${output}")
+    set(${out} "${output}exit ${result}\n" PARENT_SCOPE)
+endfunction()
+
+function(check actual configuration)
+    if(NOT actual STREQUAL expected)
+        message(FATAL_ERROR "${PROGRAM} ${configuration} printed\n${actual}instead of\n${expected}")
+    endif()
+endfunction()
+
+run_program(actual ${RVM} --rs ${PROGRAM})
+check("${actual}" "on the switch engine")
+foreach(configuration IN LISTS configurations)
+    separate_arguments(flags UNIX_COMMAND "${configuration}")
+    run_program(actual ${RVM} --rs ${PROGRAM} ${flags})
+    check("${actual}" "with ${configuration}")
+endforeach()
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+foreach(format v1 v2)
+    set(executable ${WORK}/${name}.${format}.rvm)
+    execute_process(COMMAND ${RVM} -a ${PROGRAM} -o ${executable} --format ${format} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${PROGRAM} could not be written as a ${format} executable")
+    endif()
+    run_program(actual ${RVM} ${executable})
+    check("${actual}" "read back from a ${format} executable")
+    run_program(actual ${RVM} --engine threaded ${executable})
+    check("${actual}" "read back from a ${format} executable on the threaded engine")
+endforeach()
+
+# The first run writes the entry and the second starts from it.
+set(cached ${CMAKE_COMMAND} -E env XDG_CACHE_HOME=${WORK}/cache ${RVM} --rs --cache ${PROGRAM})
+run_program(actual ${cached})
+check("${actual}" "with --cache")
+file(GLOB entries ${WORK}/cache/rvm/*.rvmc)
+if(NOT entries)
+    message(FATAL_ERROR "${PROGRAM} with --cache wrote no cache entry")
+endif()
+run_program(actual ${cached} --engine threaded)
+check("${actual}" "from the cache on the threaded engine")
\ No newline at end of file